@@ -13,13 +13,16 @@ out vec3 f_Kd;
 out vec3 f_Ks;
 
 uniform mat4 mvp;
+uniform mat4 model; // instance to world
+uniform mat3 normal_model; // inverse transpose of model
 
 void main()
 {
-   gl_Position = mvp * vec4(v_Position, 1);
+   vec4 position = model * vec4(v_Position, 1);
+   gl_Position = mvp * position;
 
-   f_Position = v_Position;
-   f_Normal = v_Normal;
+   f_Position = vec3(position);
+   f_Normal = normal_model * v_Normal;
    f_Ka = v_Ka;
    f_Kd = v_Kd;
    f_Ks = v_Ks;
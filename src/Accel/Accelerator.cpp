@@ -0,0 +1,34 @@
+#include "Accelerator.h"
+
+#include <iterator>
+
+void Accelerator::closestHitBatch(const Ray *rays, int count, real *t, size_t *k) const
+{
+   for (int i = 0; i < count; ++i)
+      k[i] = closestHit(rays[i], &t[i]);
+}
+
+void Accelerator::occludedBatch(const Ray *rays, const real *tmax, const size_t *skip, int count,
+                                bool *hit) const
+{
+   for (int i = 0; i < count; ++i)
+      hit[i] = occluded(rays[i], tmax[i], skip[i]);
+}
+
+static const char *ACCELERATOR_NAMES[] = { "bvh", "kd", "grid", "grid2", "linear" };
+
+bool parseAcceleratorKind(const std::string &name, AcceleratorKind *kind)
+{
+   for (int i = 0; i < static_cast<int>(std::size(ACCELERATOR_NAMES)); ++i)
+      if (name == ACCELERATOR_NAMES[i])
+      {
+         *kind = static_cast<AcceleratorKind>(i);
+         return true;
+      }
+   return false;
+}
+
+const char *acceleratorName(AcceleratorKind kind)
+{
+   return ACCELERATOR_NAMES[static_cast<int>(kind)];
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+
+#include "Raytracer.h"
+#include "Accel/TriangleKernel.h"
+
+/*
+ * Queries rayTrace runs against the instances of the scene, whatever
+ * structure answers them. Hit ids are hitId(instance, triangle).
+ */
+struct Accelerator
+{
+   virtual ~Accelerator() = default;
+
+   virtual size_t closestHit(const Ray &ray, real *ct) const = 0;
+   /* Closest hits of every ray of the packet, into its t and k. */
+   virtual void closestHitPacket(RayPacket *packet) const = 0;
+   /* True if a triangle other than skip is hit before tmax. */
+   virtual bool occluded(const Ray &ray, real tmax, size_t skip = -1) const = 0;
+   /* Watertight tests need secondary ray origins offset by the caller. */
+   virtual TriangleTest triangleTest() const = 0;
+
+   /* Closest hits of unrelated rays, into t and k; ray by ray unless a
+    * structure has a better way. */
+   virtual void closestHitBatch(const Ray *rays, int count, real *t, size_t *k) const;
+   /* occluded() of every ray with its own tmax and skip, into hit. */
+   virtual void occludedBatch(const Ray *rays, const real *tmax, const size_t *skip, int count,
+                              bool *hit) const;
+};
+
+enum class AcceleratorKind
+{
+   BVH,
+   KdTree,
+   Grid,
+   TwoLevelGrid,
+   LinearScan,
+};
+
+/* Kinds by their names on the command line and in configuration files:
+ * bvh, kd, grid, grid2 and linear. */
+bool parseAcceleratorKind(const std::string &name, AcceleratorKind *kind);
+const char *acceleratorName(AcceleratorKind kind);
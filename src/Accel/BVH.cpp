@@ -0,0 +1,1946 @@
+#include "BVH.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+#include "Accel/NodeKernel.h"
+#include "Accel/TriangleKernel.h"
+#include "Intersection.h"
+#include "RayStats.h"
+#include "Utils/Binary.h"
+#include "Utils/Log.h"
+#include "Utils/ThreadPool.h"
+#include "Utils/Timer.h"
+
+static constexpr int BIN_COUNT = 16;
+static constexpr int MAX_DEPTH = 64;
+static constexpr uint MAX_LEAF_SIZE = TRI_BLOCK_SIZE;
+static constexpr real TRAVERSAL_COST = 1;
+static constexpr real BLOCK_INTERSECTION_COST = 2; // one SIMD test of a whole TriangleBlock
+static constexpr real INTERSECTION_COST = BLOCK_INTERSECTION_COST / TRI_BLOCK_SIZE;
+static constexpr real inf = std::numeric_limits<real>::infinity();
+static constexpr uint CHUNK_MIN_COUNT = 1 << 14; // smaller ranges are scanned on one thread
+static constexpr uint SUBTREE_MIN_COUNT = 1 << 12;
+static constexpr uint SUBTREE = static_cast<uint>(-1); // `count` of a subtree placeholder
+static constexpr int MORTON_BITS = 10;
+static constexpr int SPATIAL_BIN_COUNT = 32;
+static constexpr real SPATIAL_SPLIT_ALPHA = 1e-5; // overlap over root area that tries spatial splits
+
+struct BuildContext
+{
+   BVHBuilder builder;
+   std::vector<AABB> boxes;
+   std::vector<vec3> centroids;
+   std::vector<uint> indices;
+   std::vector<uint> codes; // Morton codes in `indices` order, LBVH only
+   uint subtree_size;
+};
+
+/*
+ * Ranges of at most subtree_size triangles are not split on the calling
+ * thread but left as placeholders and built independently by the pool.
+ */
+struct Subtree
+{
+   uint begin, end;
+   int depth;
+   std::vector<BVHNode> nodes;
+};
+
+struct Bin
+{
+   AABB bounds;
+   uint count;
+};
+
+using Bins = Bin[3][BIN_COUNT];
+
+/* A triangle, or the part of it left by spatial splits above, in an SBVH build. */
+struct Reference
+{
+   AABB box;
+   uint tri;
+};
+
+struct SpatialContext
+{
+   const Mesh &mesh;
+   real min_overlap;
+   size_t budget; // references that may still be added by splits
+   std::vector<uint> leaf_refs; // triangles of the leaves, in node order
+};
+
+struct SpatialBin
+{
+   AABB bounds;
+   uint entries, exits;
+};
+
+/* Candidate split: refs go left of bin `split` along `axis`. */
+struct SplitCandidate
+{
+   real cost = inf;
+   int axis = -1;
+   int split;
+   AABB left, right;
+   uint left_count, right_count;
+};
+
+/* Output of the quantized collapse: nodes and leaf blocks in their new
+ * order, and the new first block of every binary leaf. */
+struct QuantizeContext
+{
+   const std::vector<BVHNode> &nodes;
+   const std::vector<TriangleBlock> &blocks;
+   int width;
+   std::vector<QuantizedBVHNode> out;
+   std::vector<TriangleBlock> out_blocks;
+   std::vector<uint> leaf_blocks;
+};
+
+static AABB emptyBox();
+static uint buildRecursive(BuildContext *ctx, ThreadPool *pool, std::vector<BVHNode> *nodes,
+                           uint begin, uint end, int depth, std::vector<Subtree> *subtrees);
+static uint sahSplit(BuildContext *ctx, ThreadPool *pool, uint begin, uint end,
+                     const AABB &bounds, const AABB &cbounds);
+static uint mortonSplit(const BuildContext *ctx, uint begin, uint end);
+static void sortByMortonCode(BuildContext *ctx, ThreadPool *pool);
+static uint buildSpatialRecursive(SpatialContext *ctx, std::vector<Reference> *refs, int depth,
+                                  std::vector<BVHNode> *nodes);
+static SplitCandidate objectSplit(const std::vector<Reference> &refs, const AABB &cbounds);
+static SplitCandidate spatialSplit(const SpatialContext *ctx, const std::vector<Reference> &refs,
+                                   const AABB &bounds);
+static void partitionObjects(std::vector<Reference> *refs, const SplitCandidate &split,
+                             const AABB &cbounds, std::vector<Reference> *left,
+                             std::vector<Reference> *right);
+static void partitionSpatial(SpatialContext *ctx, std::vector<Reference> *refs,
+                             SplitCandidate split, const AABB &bounds,
+                             std::vector<Reference> *left, std::vector<Reference> *right);
+static void binReference(const Mesh &mesh, const Reference &ref, int axis, real origin,
+                         real width, int first, int last, SpatialBin *bins);
+static AABB clipReference(const Mesh &mesh, const Reference &ref, int axis, real lo, real hi);
+static void triangleVertices(const Mesh &mesh, uint k, glm::dvec3 *v);
+static void growVertices(const glm::dvec3 *v, int axis, double lo, double hi, glm::dvec3 *dmin,
+                         glm::dvec3 *dmax);
+static void growCrossing(const glm::dvec3 *v, int axis, double plane, glm::dvec3 *dmin,
+                         glm::dvec3 *dmax);
+static AABB roundOutwards(const glm::dvec3 &dmin, const glm::dvec3 &dmax, const AABB &clip);
+static AABB intersect(const AABB &a, const AABB &b);
+static bool isEmpty(const AABB &box);
+static vec3 center(const AABB &box);
+static void rangeBounds(const BuildContext *ctx, uint begin, uint end,
+                        AABB *bounds, AABB *cbounds);
+static void binRange(const BuildContext *ctx, uint begin, uint end, const AABB &cbounds,
+                     Bins &bins);
+static uint chunkCount(ThreadPool *pool, uint count);
+static uint chunkBegin(uint begin, uint end, uint chunk, uint chunks);
+static void stitch(const std::vector<BVHNode> &top, uint idx,
+                   const std::vector<Subtree> &subtrees, std::vector<BVHNode> *nodes);
+static int collapseLanes(const std::vector<BVHNode> &nodes, uint idx, int width, uint *lanes);
+static uint collapseRecursive(const std::vector<BVHNode> &nodes, uint idx, int width,
+                              std::vector<WideBVHNode> *wide);
+static bool quantizeRecursive(QuantizeContext *ctx, uint idx, uint slot);
+static int8_t gridExponent(real lo, real hi);
+static uint8_t quantizeDown(real v, real origin, real scale);
+static uint8_t quantizeUp(real v, real origin, real scale);
+static int intersectNode(const NodeKernel *kernel, const vec3 &o, const vec3 &inv_d,
+                         const WideBVHNode &node, real tmax, float *t);
+static int intersectNode(const NodeKernel *kernel, const vec3 &o, const vec3 &inv_d,
+                         const QuantizedBVHNode &node, real tmax, float *t);
+static void laneEntry(const WideBVHNode &node, int i, uint *child, uint *count);
+static void laneEntry(const QuantizedBVHNode &node, int i, uint *child, uint *count);
+static void laneBox(const WideBVHNode &node, int i, vec3 *min, vec3 *max);
+static void laneBox(const QuantizedBVHNode &node, int i, vec3 *min, vec3 *max);
+static bool packetMisses(const vec3 &o, const vec3 &imin, const vec3 &imax, const vec3 &min,
+                         const vec3 &max);
+static uint blockCount(uint count);
+static AABB leafBounds(const std::vector<TriangleBlock> &blocks, uint first, uint count);
+static int statsRecursive(const std::vector<BVHNode> &nodes, uint idx, real root_area,
+                          BVHStats *stats);
+static real sahCost(const std::vector<BVHNode> &nodes);
+
+void AABB::grow(const vec3 &p)
+{
+   min = glm::min(min, p);
+   max = glm::max(max, p);
+}
+
+void AABB::grow(const AABB &b)
+{
+   min = glm::min(min, b.min);
+   max = glm::max(max, b.max);
+}
+
+real AABB::area() const
+{
+   vec3 e = max - min;
+   if (e.x < 0)
+      return 0;
+   return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+const char *builderName(BVHBuilder builder)
+{
+   switch (builder)
+   {
+      case BVHBuilder::SAH: return "SAH";
+      case BVHBuilder::LBVH: return "LBVH";
+      case BVHBuilder::SBVH: return "SBVH";
+   }
+   return "unknown";
+}
+
+AABB emptyBox()
+{
+   return AABB { .min = vec3(inf), .max = vec3(-inf) };
+}
+
+uint blockCount(uint count)
+{
+   return (count + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+}
+
+/*
+ * The top of the tree is split on the calling thread, scanning large ranges
+ * in parallel chunks; the subtrees below it are then built by the pool and
+ * stitched back in depth-first order. Every split is decided exactly as in
+ * a serial build, so the tree does not depend on the thread count.
+ */
+void BVH::build(const Mesh &mesh, const BVHBuildOptions &opts)
+{
+   Timer timer("BVH Build");
+
+   nodes.clear();
+   blocks.clear();
+   wide_nodes.clear();
+   quantized_nodes.clear();
+   transform_blocks.clear();
+   vertex_blocks.clear();
+   m_TriangleTest = TriangleTest::MollerTrumbore;
+   m_Kernel = &triangleKernel();
+   m_TriangleCount = mesh.triangleCount();
+   m_Builder = opts.builder;
+   m_SplitGrowth = opts.builder == BVHBuilder::SBVH ? opts.max_split_growth : 0;
+   if (m_TriangleCount == 0)
+      return;
+
+   /* Spatial splits change the reference ranges as they go and are built serially;
+    * the pool only builds the object split tree they are compared against. */
+   bool sbvh = opts.builder == BVHBuilder::SBVH;
+   std::unique_ptr<ThreadPool> pool;
+   if (!sbvh || opts.compare_object_splits)
+      pool = std::make_unique<ThreadPool>(opts.threads);
+   m_BuildThreads = pool && !sbvh ? pool->size() : 1;
+   if (pool && pool->size() == 1)
+      pool.reset();
+
+   uint n = static_cast<uint>(m_TriangleCount);
+   BuildContext ctx;
+   ctx.builder = opts.builder == BVHBuilder::LBVH ? BVHBuilder::LBVH : BVHBuilder::SAH;
+   ctx.boxes.resize(n);
+   ctx.centroids.resize(n);
+   ctx.indices.resize(n);
+   ctx.subtree_size = pool ? std::max(n / (8 * pool->size()), SUBTREE_MIN_COUNT) : n;
+   auto setup = [&](uint begin, uint end) {
+      for (uint i = begin; i < end; ++i)
+      {
+         Triangle tri = mesh.triangle(i);
+         AABB &box = ctx.boxes[i];
+         box = emptyBox();
+         box.grow(tri.bar.P);
+         box.grow(tri.bar.P + tri.bar.u);
+         box.grow(tri.bar.P + tri.bar.v);
+         ctx.centroids[i] = real(0.5) * (box.min + box.max);
+         ctx.indices[i] = i;
+      }
+   };
+   uint chunks = chunkCount(pool.get(), n);
+   if (chunks == 1)
+      setup(0, n);
+   else
+      pool->parallelFor(chunks, [&](uint c, int) {
+         setup(chunkBegin(0, n, c, chunks), chunkBegin(0, n, c + 1, chunks));
+      });
+   if (opts.builder == BVHBuilder::LBVH)
+      sortByMortonCode(&ctx, pool.get());
+
+   real object_cost = 0;
+   if (!sbvh || opts.compare_object_splits)
+   {
+      std::vector<BVHNode> top;
+      std::vector<Subtree> subtrees;
+      buildRecursive(&ctx, pool.get(), &top, 0, n, 0, pool ? &subtrees : nullptr);
+      if (pool)
+         pool->parallelFor(static_cast<uint>(subtrees.size()), [&](uint i, int) {
+            Subtree &st = subtrees[i];
+            st.nodes.reserve(2 * (st.end - st.begin));
+            buildRecursive(&ctx, nullptr, &st.nodes, st.begin, st.end, st.depth, nullptr);
+         });
+
+      if (subtrees.empty())
+         nodes = std::move(top);
+      else
+      {
+         size_t total = top.size();
+         for (const Subtree &st : subtrees)
+            total += st.nodes.size();
+         nodes.reserve(total);
+         stitch(top, 0, subtrees, &nodes);
+      }
+      object_cost = sahCost(nodes);
+   }
+
+   if (sbvh)
+   {
+      AABB bounds = emptyBox();
+      for (const AABB &box : ctx.boxes)
+         bounds.grow(box);
+      SpatialContext sctx {
+         .mesh = mesh,
+         .min_overlap = SPATIAL_SPLIT_ALPHA * bounds.area(),
+         .budget = static_cast<size_t>(std::max(opts.max_split_growth - 1, 0.f) * n),
+      };
+      std::vector<Reference> refs(n);
+      for (uint i = 0; i < n; ++i)
+         refs[i] = Reference { .box = ctx.boxes[i], .tri = i };
+      nodes.clear();
+      sctx.leaf_refs.reserve(n);
+      buildSpatialRecursive(&sctx, &refs, 0, &nodes);
+      ctx.indices = std::move(sctx.leaf_refs);
+      real cost = sahCost(nodes);
+      if (opts.compare_object_splits)
+         print("[BVH] spatial splits: references: ", ctx.indices.size(), " (+",
+               100.f * (ctx.indices.size() - n) / n, "%), SAH cost: ", cost, " vs ", object_cost,
+               " with object splits only (", 100.f * (cost - object_cost) / object_cost, "%)");
+      else
+         print("[BVH] spatial splits: references: ", ctx.indices.size(), " (+",
+               100.f * (ctx.indices.size() - n) / n, "%), SAH cost: ", cost);
+   }
+   nodes.shrink_to_fit();
+
+   /* Repack leaf triangles into SIMD blocks in depth-first order. */
+   for (BVHNode &node : nodes)
+   {
+      if (!node.count)
+         continue;
+      uint first = static_cast<uint>(blocks.size());
+      packTriangleBlocks(mesh, ctx.indices.data() + node.offset, node.count, &blocks);
+      node.offset = first;
+   }
+
+   m_BuildMs = timer.elapsed();
+   m_BuildSahCost = stats().sah_cost;
+   timer.stop();
+   report();
+   collapse(opts.width, opts.quantize);
+   useTriangleTest(mesh, opts.triangle_test);
+}
+
+uint buildRecursive(BuildContext *ctx, ThreadPool *pool, std::vector<BVHNode> *nodes,
+                    uint begin, uint end, int depth, std::vector<Subtree> *subtrees)
+{
+   uint idx = static_cast<uint>(nodes->size());
+   nodes->emplace_back();
+
+   uint count = end - begin;
+   if (subtrees && count <= ctx->subtree_size)
+   {
+      (*nodes)[idx].offset = static_cast<uint>(subtrees->size());
+      (*nodes)[idx].count = SUBTREE;
+      subtrees->push_back(Subtree { .begin = begin, .end = end, .depth = depth });
+      return idx;
+   }
+
+   AABB bounds = emptyBox(), cbounds = emptyBox();
+   uint chunks = chunkCount(pool, count);
+   if (chunks == 1)
+      rangeBounds(ctx, begin, end, &bounds, &cbounds);
+   else
+   {
+      std::vector<AABB> partial(2 * chunks, emptyBox());
+      pool->parallelFor(chunks, [&](uint c, int) {
+         rangeBounds(ctx, chunkBegin(begin, end, c, chunks), chunkBegin(begin, end, c + 1, chunks),
+                     &partial[2 * c], &partial[2 * c + 1]);
+      });
+      for (uint c = 0; c < chunks; ++c)
+      {
+         bounds.grow(partial[2 * c]);
+         cbounds.grow(partial[2 * c + 1]);
+      }
+   }
+   (*nodes)[idx].min = bounds.min;
+   (*nodes)[idx].max = bounds.max;
+
+   auto makeLeaf = [&]() {
+      (*nodes)[idx].offset = begin;
+      (*nodes)[idx].count = count;
+      return idx;
+   };
+   if (count <= 1 || depth + 1 >= MAX_DEPTH)
+      return makeLeaf();
+
+   uint mid = ctx->builder == BVHBuilder::LBVH ? mortonSplit(ctx, begin, end)
+                                               : sahSplit(ctx, pool, begin, end, bounds, cbounds);
+   if (mid == begin)
+      return makeLeaf();
+
+   buildRecursive(ctx, pool, nodes, begin, mid, depth + 1, subtrees);
+   uint right = buildRecursive(ctx, pool, nodes, mid, end, depth + 1, subtrees);
+   (*nodes)[idx].offset = right;
+   (*nodes)[idx].count = 0;
+   return idx;
+}
+
+/* Binned SAH: evaluates BIN_COUNT-1 candidate planes along each axis. Returns
+ * the first index of the right half, or `begin` if a leaf is cheaper. */
+uint sahSplit(BuildContext *ctx, ThreadPool *pool, uint begin, uint end,
+              const AABB &bounds, const AABB &cbounds)
+{
+   Bins bins;
+   uint count = end - begin;
+   uint chunks = chunkCount(pool, count);
+   if (chunks == 1)
+      binRange(ctx, begin, end, cbounds, bins);
+   else
+   {
+      std::vector<Bins> partial(chunks);
+      pool->parallelFor(chunks, [&](uint c, int) {
+         binRange(ctx, chunkBegin(begin, end, c, chunks), chunkBegin(begin, end, c + 1, chunks),
+                  cbounds, partial[c]);
+      });
+      for (int axis = 0; axis < 3; ++axis)
+         for (int b = 0; b < BIN_COUNT; ++b)
+         {
+            bins[axis][b] = partial[0][axis][b];
+            for (uint c = 1; c < chunks; ++c)
+            {
+               bins[axis][b].bounds.grow(partial[c][axis][b].bounds);
+               bins[axis][b].count += partial[c][axis][b].count;
+            }
+         }
+   }
+
+   int best_axis = -1, best_split = 0;
+   real best_cost = inf;
+   vec3 extent = cbounds.max - cbounds.min;
+   for (int axis = 0; axis < 3; ++axis)
+   {
+      if (extent[axis] <= 0)
+         continue;
+
+      real right_area[BIN_COUNT];
+      uint right_count[BIN_COUNT];
+      AABB acc = emptyBox();
+      uint acc_count = 0;
+      for (int b = BIN_COUNT - 1; b > 0; --b)
+      {
+         acc.grow(bins[axis][b].bounds);
+         acc_count += bins[axis][b].count;
+         right_area[b] = acc.area();
+         right_count[b] = acc_count;
+      }
+
+      acc = emptyBox();
+      acc_count = 0;
+      for (int b = 0; b < BIN_COUNT - 1; ++b)
+      {
+         acc.grow(bins[axis][b].bounds);
+         acc_count += bins[axis][b].count;
+         if (acc_count == 0 || right_count[b + 1] == 0)
+            continue;
+         real cost = acc.area() * acc_count + right_area[b + 1] * right_count[b + 1];
+         if (cost < best_cost)
+         {
+            best_cost = cost;
+            best_axis = axis;
+            best_split = b + 1;
+         }
+      }
+   }
+
+   if (best_axis == -1)
+      return begin;
+
+   real split_cost = TRAVERSAL_COST + INTERSECTION_COST * best_cost / bounds.area();
+   real leaf_cost = BLOCK_INTERSECTION_COST * blockCount(count);
+   if (split_cost >= leaf_cost && count <= MAX_LEAF_SIZE)
+      return begin;
+
+   std::vector<uint> &indices = ctx->indices;
+   real scale = BIN_COUNT / extent[best_axis];
+   real cmin = cbounds.min[best_axis];
+   uint *mid_ptr = std::partition(indices.data() + begin, indices.data() + end, [&](uint k) {
+      int b = static_cast<int>((ctx->centroids[k][best_axis] - cmin) * scale);
+      return std::min(b, BIN_COUNT - 1) < best_split;
+   });
+   uint mid = static_cast<uint>(mid_ptr - indices.data());
+   if (mid == begin || mid == end)
+   {
+      mid = begin + count / 2;
+      std::nth_element(indices.data() + begin, indices.data() + mid, indices.data() + end,
+                       [&](uint a, uint b) {
+         return ctx->centroids[a][best_axis] < ctx->centroids[b][best_axis];
+      });
+   }
+   return mid;
+}
+
+/* Splits where the highest differing bit of the sorted Morton codes flips. */
+uint mortonSplit(const BuildContext *ctx, uint begin, uint end)
+{
+   uint count = end - begin;
+   if (count <= MAX_LEAF_SIZE)
+      return begin;
+   uint first = ctx->codes[begin], last = ctx->codes[end - 1];
+   if (first == last)
+      return begin + count / 2;
+   uint bit = 1u << (31 - __builtin_clz(first ^ last));
+   const uint *codes = ctx->codes.data();
+   const uint *mid = std::partition_point(codes + begin, codes + end, [&](uint code) {
+      return !(code & bit);
+   });
+   return static_cast<uint>(mid - codes);
+}
+
+/* Orders ctx->indices along a Z-curve through the centroid bounds. */
+void sortByMortonCode(BuildContext *ctx, ThreadPool *pool)
+{
+   uint n = static_cast<uint>(ctx->indices.size());
+   AABB bounds = emptyBox(), cbounds = emptyBox();
+   rangeBounds(ctx, 0, n, &bounds, &cbounds);
+   vec3 extent = cbounds.max - cbounds.min;
+   vec3 scale;
+   for (int axis = 0; axis < 3; ++axis)
+      scale[axis] = extent[axis] > 0 ? ((1 << MORTON_BITS) - 1) / extent[axis] : 0;
+
+   /* Code in the high half, triangle in the low half, so the order is unique. */
+   std::vector<uint64_t> keys(n);
+   uint chunks = chunkCount(pool, n);
+   auto encode = [&](uint c) {
+      for (uint i = chunkBegin(0, n, c, chunks); i < chunkBegin(0, n, c + 1, chunks); ++i)
+      {
+         vec3 q = (ctx->centroids[i] - cbounds.min) * scale;
+         uint code = expandBits(static_cast<uint>(q.x)) << 2 |
+                     expandBits(static_cast<uint>(q.y)) << 1 |
+                     expandBits(static_cast<uint>(q.z));
+         keys[i] = static_cast<uint64_t>(code) << 32 | i;
+      }
+      std::sort(keys.begin() + chunkBegin(0, n, c, chunks),
+                keys.begin() + chunkBegin(0, n, c + 1, chunks));
+   };
+   if (chunks == 1)
+      encode(0);
+   else
+   {
+      pool->parallelFor(chunks, [&](uint c, int) { encode(c); });
+      for (uint width = 1; width < chunks; width *= 2)
+         pool->parallelFor((chunks + 2 * width - 1) / (2 * width), [&](uint pair, int) {
+            uint lo = 2 * width * pair;
+            uint mid = std::min(lo + width, chunks), hi = std::min(lo + 2 * width, chunks);
+            std::inplace_merge(keys.begin() + chunkBegin(0, n, lo, chunks),
+                               keys.begin() + chunkBegin(0, n, mid, chunks),
+                               keys.begin() + chunkBegin(0, n, hi, chunks));
+         });
+   }
+
+   ctx->codes.resize(n);
+   for (uint i = 0; i < n; ++i)
+   {
+      ctx->codes[i] = static_cast<uint>(keys[i] >> 32);
+      ctx->indices[i] = static_cast<uint>(keys[i]);
+   }
+}
+
+/*
+ * SBVH (Stich et al.): every node weighs the best object split against the
+ * best spatial split, which cuts the node at a plane and sends references
+ * straddling it to both sides, clipped to their half. Spatial splits are
+ * only tried where the object split children overlap noticeably, and only
+ * while the reference budget lasts. Leaves test whole triangles, so a
+ * clipped reference is found however it is reached.
+ */
+uint buildSpatialRecursive(SpatialContext *ctx, std::vector<Reference> *refs, int depth,
+                           std::vector<BVHNode> *nodes)
+{
+   uint idx = static_cast<uint>(nodes->size());
+   nodes->emplace_back();
+
+   AABB bounds = emptyBox(), cbounds = emptyBox();
+   for (const Reference &ref : *refs)
+   {
+      bounds.grow(ref.box);
+      cbounds.grow(center(ref.box));
+   }
+   (*nodes)[idx].min = bounds.min;
+   (*nodes)[idx].max = bounds.max;
+
+   uint count = static_cast<uint>(refs->size());
+   auto makeLeaf = [&]() {
+      (*nodes)[idx].offset = static_cast<uint>(ctx->leaf_refs.size());
+      (*nodes)[idx].count = count;
+      for (const Reference &ref : *refs)
+         ctx->leaf_refs.push_back(ref.tri);
+      return idx;
+   };
+   if (count <= 1 || depth + 1 >= MAX_DEPTH)
+      return makeLeaf();
+
+   SplitCandidate object = objectSplit(*refs, cbounds);
+   SplitCandidate spatial;
+   AABB overlap = intersect(object.left, object.right);
+   if (ctx->budget > 0 && (object.axis == -1 ||
+                           (!isEmpty(overlap) && overlap.area() > ctx->min_overlap)))
+      spatial = spatialSplit(ctx, *refs, bounds);
+   real best_cost = std::min(object.cost, spatial.cost);
+   if (best_cost == inf)
+      return makeLeaf();
+
+   real split_cost = TRAVERSAL_COST + INTERSECTION_COST * best_cost / bounds.area();
+   real leaf_cost = BLOCK_INTERSECTION_COST * blockCount(count);
+   if (split_cost >= leaf_cost && count <= MAX_LEAF_SIZE)
+      return makeLeaf();
+
+   std::vector<Reference> left, right;
+   if (spatial.cost < object.cost)
+      partitionSpatial(ctx, refs, spatial, bounds, &left, &right);
+   if (left.empty() || right.empty())
+   {
+      if (object.axis == -1)
+         return makeLeaf();
+      left.clear();
+      right.clear();
+      partitionObjects(refs, object, cbounds, &left, &right);
+   }
+   std::vector<Reference>().swap(*refs);
+
+   buildSpatialRecursive(ctx, &left, depth + 1, nodes);
+   uint r = buildSpatialRecursive(ctx, &right, depth + 1, nodes);
+   (*nodes)[idx].offset = r;
+   (*nodes)[idx].count = 0;
+   return idx;
+}
+
+/* Binned SAH over the reference centroids, as sahSplit. */
+SplitCandidate objectSplit(const std::vector<Reference> &refs, const AABB &cbounds)
+{
+   SplitCandidate best;
+   vec3 extent = cbounds.max - cbounds.min;
+   for (int axis = 0; axis < 3; ++axis)
+   {
+      if (extent[axis] <= 0)
+         continue;
+      Bin bins[BIN_COUNT];
+      for (Bin &bin : bins)
+         bin = Bin { .bounds = emptyBox(), .count = 0 };
+      real scale = BIN_COUNT / extent[axis];
+      for (const Reference &ref : refs)
+      {
+         int b = static_cast<int>((center(ref.box)[axis] - cbounds.min[axis]) * scale);
+         b = std::min(b, BIN_COUNT - 1);
+         bins[b].bounds.grow(ref.box);
+         bins[b].count++;
+      }
+
+      AABB right_box[BIN_COUNT];
+      uint right_count[BIN_COUNT];
+      AABB acc = emptyBox();
+      uint acc_count = 0;
+      for (int b = BIN_COUNT - 1; b > 0; --b)
+      {
+         acc.grow(bins[b].bounds);
+         acc_count += bins[b].count;
+         right_box[b] = acc;
+         right_count[b] = acc_count;
+      }
+
+      acc = emptyBox();
+      acc_count = 0;
+      for (int b = 0; b < BIN_COUNT - 1; ++b)
+      {
+         acc.grow(bins[b].bounds);
+         acc_count += bins[b].count;
+         if (acc_count == 0 || right_count[b + 1] == 0)
+            continue;
+         real cost = acc.area() * acc_count + right_box[b + 1].area() * right_count[b + 1];
+         if (cost < best.cost)
+            best = SplitCandidate { .cost = cost, .axis = axis, .split = b + 1, .left = acc,
+                                    .right = right_box[b + 1], .left_count = acc_count,
+                                    .right_count = right_count[b + 1] };
+      }
+   }
+   return best;
+}
+
+/* Bins the node bounds, clipping each reference to every bin it spans;
+ * references count on the left up to their exit bin and on the right from
+ * their entry bin. */
+SplitCandidate spatialSplit(const SpatialContext *ctx, const std::vector<Reference> &refs,
+                            const AABB &bounds)
+{
+   SplitCandidate best;
+   uint count = static_cast<uint>(refs.size());
+   vec3 extent = bounds.max - bounds.min;
+   for (int axis = 0; axis < 3; ++axis)
+   {
+      if (extent[axis] <= 0)
+         continue;
+      SpatialBin bins[SPATIAL_BIN_COUNT];
+      for (SpatialBin &bin : bins)
+         bin = SpatialBin { .bounds = emptyBox(), .entries = 0, .exits = 0 };
+      real width = extent[axis] / SPATIAL_BIN_COUNT;
+      real scale = SPATIAL_BIN_COUNT / extent[axis];
+      auto binOf = [&](real p) {
+         return std::clamp(static_cast<int>((p - bounds.min[axis]) * scale), 0,
+                           SPATIAL_BIN_COUNT - 1);
+      };
+      for (const Reference &ref : refs)
+      {
+         int first = binOf(ref.box.min[axis]), last = binOf(ref.box.max[axis]);
+         bins[first].entries++;
+         bins[last].exits++;
+         if (first == last)
+            bins[first].bounds.grow(ref.box);
+         else
+            binReference(ctx->mesh, ref, axis, bounds.min[axis], width, first, last, bins);
+      }
+
+      AABB right_box[SPATIAL_BIN_COUNT];
+      uint right_count[SPATIAL_BIN_COUNT];
+      AABB acc = emptyBox();
+      uint acc_count = 0;
+      for (int b = SPATIAL_BIN_COUNT - 1; b > 0; --b)
+      {
+         acc.grow(bins[b].bounds);
+         acc_count += bins[b].exits;
+         right_box[b] = acc;
+         right_count[b] = acc_count;
+      }
+
+      acc = emptyBox();
+      acc_count = 0;
+      for (int b = 0; b < SPATIAL_BIN_COUNT - 1; ++b)
+      {
+         acc.grow(bins[b].bounds);
+         acc_count += bins[b].entries;
+         uint rc = right_count[b + 1];
+         if (acc_count == 0 || rc == 0 || acc_count + rc - count > ctx->budget ||
+             (acc_count == count && rc == count))
+            continue;
+         real cost = acc.area() * acc_count + right_box[b + 1].area() * rc;
+         if (cost < best.cost)
+            best = SplitCandidate { .cost = cost, .axis = axis, .split = b + 1, .left = acc,
+                                    .right = right_box[b + 1], .left_count = acc_count,
+                                    .right_count = rc };
+      }
+   }
+   return best;
+}
+
+void partitionObjects(std::vector<Reference> *refs, const SplitCandidate &split,
+                      const AABB &cbounds, std::vector<Reference> *left,
+                      std::vector<Reference> *right)
+{
+   int axis = split.axis;
+   real scale = BIN_COUNT / (cbounds.max[axis] - cbounds.min[axis]);
+   for (const Reference &ref : *refs)
+   {
+      int b = static_cast<int>((center(ref.box)[axis] - cbounds.min[axis]) * scale);
+      (std::min(b, BIN_COUNT - 1) < split.split ? left : right)->push_back(ref);
+   }
+   if (!left->empty() && !right->empty())
+      return;
+   left->clear();
+   right->clear();
+   std::vector<Reference> &all = *refs;
+   size_t mid = all.size() / 2;
+   std::nth_element(all.begin(), all.begin() + mid, all.end(),
+                    [&](const Reference &a, const Reference &b) {
+      return center(a.box)[axis] < center(b.box)[axis];
+   });
+   left->assign(all.begin(), all.begin() + mid);
+   right->assign(all.begin() + mid, all.end());
+}
+
+/* Straddling references are split in two unless moving them whole to one
+ * side is cheaper (reference unsplitting). */
+void partitionSpatial(SpatialContext *ctx, std::vector<Reference> *refs, SplitCandidate split,
+                      const AABB &bounds, std::vector<Reference> *left,
+                      std::vector<Reference> *right)
+{
+   int axis = split.axis;
+   real pos = bounds.min[axis] + split.split * ((bounds.max[axis] - bounds.min[axis]) /
+                                                SPATIAL_BIN_COUNT);
+   size_t added = 0;
+   for (const Reference &ref : *refs)
+   {
+      if (ref.box.max[axis] <= pos)
+      {
+         left->push_back(ref);
+         continue;
+      }
+      if (ref.box.min[axis] >= pos)
+      {
+         right->push_back(ref);
+         continue;
+      }
+      AABB l = clipReference(ctx->mesh, ref, axis, -inf, pos);
+      AABB r = clipReference(ctx->mesh, ref, axis, pos, inf);
+      if (isEmpty(l) || isEmpty(r))
+      {
+         (isEmpty(l) ? right : left)->push_back(ref);
+         continue;
+      }
+
+      AABB left_all = split.left, right_all = split.right;
+      left_all.grow(ref.box);
+      right_all.grow(ref.box);
+      real nl = static_cast<real>(split.left_count), nr = static_cast<real>(split.right_count);
+      real cost_split = split.left.area() * nl + split.right.area() * nr;
+      real cost_left = left_all.area() * nl + split.right.area() * (nr - 1);
+      real cost_right = split.left.area() * (nl - 1) + right_all.area() * nr;
+      if (cost_left < cost_split && cost_left <= cost_right)
+      {
+         left->push_back(ref);
+         split.left = left_all;
+         split.right_count--;
+      }
+      else if (cost_right < cost_split)
+      {
+         right->push_back(ref);
+         split.right = right_all;
+         split.left_count--;
+      }
+      else
+      {
+         left->push_back(Reference { .box = l, .tri = ref.tri });
+         right->push_back(Reference { .box = r, .tri = ref.tri });
+         ++added;
+      }
+   }
+   ctx->budget -= std::min(added, ctx->budget);
+}
+
+/*
+ * Clips the reference's triangle to the bins first..last it spans. A bin
+ * holds the corners inside it and the triangle's crossings of its two
+ * planes, each plane being shared with the neighbouring bin. Bin bounds
+ * only estimate the split cost, so they are not rounded outwards.
+ */
+void binReference(const Mesh &mesh, const Reference &ref, int axis, real origin, real width,
+                  int first, int last, SpatialBin *bins)
+{
+   glm::dvec3 v[3];
+   triangleVertices(mesh, ref.tri, v);
+   glm::dvec3 lo_min(inf), lo_max(-inf);
+   for (int b = first; b <= last; ++b)
+   {
+      double lo = b == first ? -inf : origin + b * width;
+      double hi = b == last ? inf : origin + (b + 1) * width;
+      glm::dvec3 dmin(inf), dmax(-inf), hi_min(inf), hi_max(-inf);
+      growVertices(v, axis, lo, hi, &dmin, &dmax);
+      if (b > first)
+         dmin = glm::min(dmin, lo_min), dmax = glm::max(dmax, lo_max);
+      if (b < last)
+      {
+         growCrossing(v, axis, hi, &hi_min, &hi_max);
+         dmin = glm::min(dmin, hi_min), dmax = glm::max(dmax, hi_max);
+      }
+      lo_min = hi_min, lo_max = hi_max;
+      AABB box = intersect(AABB { .min = dmin, .max = dmax }, ref.box);
+      if (!isEmpty(box))
+         bins[b].bounds.grow(box);
+   }
+}
+
+/* Bounds of the part of the reference's triangle between lo and hi along axis. */
+AABB clipReference(const Mesh &mesh, const Reference &ref, int axis, real lo, real hi)
+{
+   glm::dvec3 v[3];
+   triangleVertices(mesh, ref.tri, v);
+   glm::dvec3 dmin(inf), dmax(-inf);
+   growVertices(v, axis, lo, hi, &dmin, &dmax);
+   growCrossing(v, axis, lo, &dmin, &dmax);
+   growCrossing(v, axis, hi, &dmin, &dmax);
+   return roundOutwards(dmin, dmax, ref.box);
+}
+
+/* The triangle P + a u + b v as the kernels test it, exactly in double. */
+void triangleVertices(const Mesh &mesh, uint k, glm::dvec3 *v)
+{
+   Triangle tri = mesh.triangle(k);
+   v[0] = tri.bar.P;
+   v[1] = v[0] + glm::dvec3(tri.bar.u);
+   v[2] = v[0] + glm::dvec3(tri.bar.v);
+}
+
+void growVertices(const glm::dvec3 *v, int axis, double lo, double hi, glm::dvec3 *dmin,
+                  glm::dvec3 *dmax)
+{
+   for (int i = 0; i < 3; ++i)
+      if (v[i][axis] >= lo && v[i][axis] <= hi)
+         *dmin = glm::min(*dmin, v[i]), *dmax = glm::max(*dmax, v[i]);
+}
+
+/* Points where the triangle's edges cross the plane. */
+void growCrossing(const glm::dvec3 *v, int axis, double plane, glm::dvec3 *dmin,
+                  glm::dvec3 *dmax)
+{
+   for (int e = 0; e < 3; ++e)
+   {
+      const glm::dvec3 &a = v[e], &b = v[(e + 1) % 3];
+      if (!((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)))
+         continue;
+      glm::dvec3 q = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+      q[axis] = plane;
+      *dmin = glm::min(*dmin, q), *dmax = glm::max(*dmax, q);
+   }
+}
+
+/* Float box containing the double one, cut down to `clip`. */
+AABB roundOutwards(const glm::dvec3 &dmin, const glm::dvec3 &dmax, const AABB &clip)
+{
+   AABB box = emptyBox();
+   for (int i = 0; i < 3; ++i)
+   {
+      if (dmin[i] > dmax[i])
+         return box;
+      box.min[i] = static_cast<real>(dmin[i]);
+      box.max[i] = static_cast<real>(dmax[i]);
+      if (box.min[i] > dmin[i])
+         box.min[i] = std::nextafter(box.min[i], -inf);
+      if (box.max[i] < dmax[i])
+         box.max[i] = std::nextafter(box.max[i], inf);
+   }
+   return intersect(box, clip);
+}
+
+AABB intersect(const AABB &a, const AABB &b)
+{
+   return AABB { .min = glm::max(a.min, b.min), .max = glm::min(a.max, b.max) };
+}
+
+bool isEmpty(const AABB &box)
+{
+   return box.min.x > box.max.x || box.min.y > box.max.y || box.min.z > box.max.z;
+}
+
+vec3 center(const AABB &box)
+{
+   return real(0.5) * (box.min + box.max);
+}
+
+uint expandBits(uint v)
+{
+   v = (v * 0x00010001u) & 0xFF0000FFu;
+   v = (v * 0x00000101u) & 0x0F00F00Fu;
+   v = (v * 0x00000011u) & 0xC30C30C3u;
+   v = (v * 0x00000005u) & 0x49249249u;
+   return v;
+}
+
+void rangeBounds(const BuildContext *ctx, uint begin, uint end, AABB *bounds, AABB *cbounds)
+{
+   for (uint i = begin; i < end; ++i)
+   {
+      bounds->grow(ctx->boxes[ctx->indices[i]]);
+      cbounds->grow(ctx->centroids[ctx->indices[i]]);
+   }
+}
+
+void binRange(const BuildContext *ctx, uint begin, uint end, const AABB &cbounds, Bins &bins)
+{
+   vec3 extent = cbounds.max - cbounds.min;
+   for (int axis = 0; axis < 3; ++axis)
+   {
+      for (Bin &bin : bins[axis])
+         bin = Bin { .bounds = emptyBox(), .count = 0 };
+      if (extent[axis] <= 0)
+         continue;
+      real scale = BIN_COUNT / extent[axis];
+      for (uint i = begin; i < end; ++i)
+      {
+         uint k = ctx->indices[i];
+         int b = static_cast<int>((ctx->centroids[k][axis] - cbounds.min[axis]) * scale);
+         b = std::min(b, BIN_COUNT - 1);
+         bins[axis][b].bounds.grow(ctx->boxes[k]);
+         bins[axis][b].count++;
+      }
+   }
+}
+
+uint chunkCount(ThreadPool *pool, uint count)
+{
+   if (!pool)
+      return 1;
+   return std::clamp(count / CHUNK_MIN_COUNT, 1u, 4u * pool->size());
+}
+
+uint chunkBegin(uint begin, uint end, uint chunk, uint chunks)
+{
+   return begin + static_cast<uint>(static_cast<uint64_t>(end - begin) * chunk / chunks);
+}
+
+/* Copies the top tree in depth-first order, splicing in the subtrees. */
+void stitch(const std::vector<BVHNode> &top, uint idx,
+            const std::vector<Subtree> &subtrees, std::vector<BVHNode> *nodes)
+{
+   const BVHNode &node = top[idx];
+   if (node.count == SUBTREE)
+   {
+      uint base = static_cast<uint>(nodes->size());
+      for (BVHNode sub : subtrees[node.offset].nodes)
+      {
+         if (!sub.count)
+            sub.offset += base;
+         nodes->push_back(sub);
+      }
+      return;
+   }
+
+   uint at = static_cast<uint>(nodes->size());
+   nodes->push_back(node);
+   if (node.count)
+      return;
+   stitch(top, idx + 1, subtrees, nodes);
+   (*nodes)[at].offset = static_cast<uint>(nodes->size());
+   stitch(top, node.offset, subtrees, nodes);
+}
+
+/*
+ * Builds wide_nodes from the binary tree: every wide node takes the children
+ * of a binary node and keeps replacing its largest inner child by that
+ * child's two children until `width` lanes are used. A width of 2 or less
+ * drops the wide nodes and queries go back to the binary tree. Quantized
+ * nodes are collapsed the same way.
+ */
+void BVH::collapse(int width, bool quantize)
+{
+   wide_nodes.clear();
+   quantized_nodes.clear();
+   m_Width = width;
+   if (width <= 2 || nodes.empty())
+      return;
+   width = std::min(width, WIDE_BVH_WIDTH);
+   m_NodeKernel = &nodeKernel();
+   constexpr float MB = 1024 * 1024;
+   if (quantize && quantizeNodes(width))
+   {
+      size_t lanes = 0;
+      for (const QuantizedBVHNode &node : quantized_nodes)
+         for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+            lanes += (node.inner_mask >> i & 1) || node.count[i];
+      print("[BVH] ", width, "-wide quantized: nodes: ", quantized_nodes.size(),
+            ", average children: ", static_cast<float>(lanes) / quantized_nodes.size(),
+            ", node data: ", quantized_nodes.size() * sizeof(QuantizedBVHNode) / MB, " MB (",
+            quantized_nodes.size() * sizeof(WideBVHNode) / MB, " MB unquantized)");
+      return;
+   }
+   if (quantize)
+      print("[BVH] a leaf has more than 255 triangles, keeping unquantized nodes");
+
+   wide_nodes.reserve(nodes.size() / (width - 1) + 1);
+   collapseRecursive(nodes, 0, width, &wide_nodes);
+   wide_nodes.shrink_to_fit();
+
+   size_t lanes = 0;
+   for (const WideBVHNode &node : wide_nodes)
+      lanes += node.size;
+   print("[BVH] ", width, "-wide: nodes: ", wide_nodes.size(), ", average children: ",
+         static_cast<float>(lanes) / wide_nodes.size(), ", node data: ",
+         wide_nodes.size() * sizeof(WideBVHNode) / MB, " MB");
+}
+
+/* Lanes of the wide node over binary node idx, in depth-first order. */
+int collapseLanes(const std::vector<BVHNode> &nodes, uint idx, int width, uint *lanes)
+{
+   int n = 0;
+   if (nodes[idx].count)
+      lanes[n++] = idx;
+   else
+   {
+      lanes[n++] = idx + 1;
+      lanes[n++] = nodes[idx].offset;
+   }
+   while (n < width)
+   {
+      int best = -1;
+      real best_area = -1;
+      for (int i = 0; i < n; ++i)
+      {
+         const BVHNode &node = nodes[lanes[i]];
+         real area = AABB { .min = node.min, .max = node.max }.area();
+         if (!node.count && area > best_area)
+            best = i, best_area = area;
+      }
+      if (best == -1)
+         break;
+      /* Keep the lanes in depth-first order. */
+      uint split = lanes[best];
+      for (int i = n; i > best + 1; --i)
+         lanes[i] = lanes[i - 1];
+      lanes[best] = split + 1;
+      lanes[best + 1] = nodes[split].offset;
+      ++n;
+   }
+   return n;
+}
+
+uint collapseRecursive(const std::vector<BVHNode> &nodes, uint idx, int width,
+                       std::vector<WideBVHNode> *wide)
+{
+   uint lanes[WIDE_BVH_WIDTH];
+   int n = collapseLanes(nodes, idx, width, lanes);
+
+   uint w = static_cast<uint>(wide->size());
+   WideBVHNode &node = wide->emplace_back();
+   node.size = n;
+   for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+   {
+      /* Unused lanes are masked out by `size` and never hit. */
+      const BVHNode *child = i < n ? &nodes[lanes[i]] : nullptr;
+      vec3 bmin = child ? child->min : vec3(inf), bmax = child ? child->max : vec3(-inf);
+      node.min_x[i] = bmin.x, node.min_y[i] = bmin.y, node.min_z[i] = bmin.z;
+      node.max_x[i] = bmax.x, node.max_y[i] = bmax.y, node.max_z[i] = bmax.z;
+      node.child[i] = child && child->count ? child->offset : 0;
+      node.count[i] = child ? child->count : 0;
+   }
+   for (int i = 0; i < n; ++i)
+      if (!nodes[lanes[i]].count)
+      {
+         uint c = collapseRecursive(nodes, lanes[i], width, wide);
+         (*wide)[w].child[i] = c;
+      }
+   return w;
+}
+
+/*
+ * Lays the quantized nodes out so that the children of a node are
+ * consecutive, and moves the leaf blocks to match. The binary leaves are
+ * pointed at the moved blocks, so the binary tree stays usable. Fails on a
+ * leaf too large for its 8-bit count.
+ */
+bool BVH::quantizeNodes(int width)
+{
+   QuantizeContext ctx { .nodes = nodes, .blocks = blocks, .width = width };
+   ctx.out.reserve(nodes.size() / (width - 1) + 1);
+   ctx.out_blocks.reserve(blocks.size());
+   ctx.leaf_blocks.resize(nodes.size());
+   ctx.out.emplace_back();
+   if (!quantizeRecursive(&ctx, 0, 0))
+      return false;
+
+   for (size_t i = 0; i < nodes.size(); ++i)
+      if (nodes[i].count)
+         nodes[i].offset = ctx.leaf_blocks[i];
+   blocks = std::move(ctx.out_blocks);
+   quantized_nodes = std::move(ctx.out);
+   quantized_nodes.shrink_to_fit();
+   return true;
+}
+
+bool quantizeRecursive(QuantizeContext *ctx, uint idx, uint slot)
+{
+   const std::vector<BVHNode> &nodes = ctx->nodes;
+   uint lanes[WIDE_BVH_WIDTH];
+   int n = collapseLanes(nodes, idx, ctx->width, lanes);
+
+   QuantizedBVHNode node {};
+   const BVHNode &parent = nodes[idx];
+   node.origin = parent.min;
+   vec3 scale;
+   for (int a = 0; a < 3; ++a)
+   {
+      node.exponent[a] = gridExponent(parent.min[a], parent.max[a]);
+      scale[a] = quantizedScale(node.exponent[a]);
+   }
+   node.child_base = static_cast<uint>(ctx->out.size());
+   node.block_base = static_cast<uint>(ctx->out_blocks.size());
+   uint8_t *lo[3] = { node.lo_x, node.lo_y, node.lo_z };
+   uint8_t *hi[3] = { node.hi_x, node.hi_y, node.hi_z };
+   uint inner = 0;
+   for (int i = 0; i < n; ++i)
+   {
+      const BVHNode &child = nodes[lanes[i]];
+      for (int a = 0; a < 3; ++a)
+      {
+         lo[a][i] = quantizeDown(child.min[a], node.origin[a], scale[a]);
+         hi[a][i] = quantizeUp(child.max[a], node.origin[a], scale[a]);
+      }
+      if (!child.count)
+      {
+         node.inner_mask |= 1 << i;
+         ++inner;
+         continue;
+      }
+      if (child.count > UINT8_MAX)
+         return false;
+      node.count[i] = static_cast<uint8_t>(child.count);
+      ctx->leaf_blocks[lanes[i]] = static_cast<uint>(ctx->out_blocks.size());
+      ctx->out_blocks.insert(ctx->out_blocks.end(), ctx->blocks.begin() + child.offset,
+                             ctx->blocks.begin() + child.offset + blockCount(child.count));
+   }
+   ctx->out.resize(ctx->out.size() + inner);
+   ctx->out[slot] = node;
+
+   uint next = node.child_base;
+   for (int i = 0; i < n; ++i)
+      if (!nodes[lanes[i]].count && !quantizeRecursive(ctx, lanes[i], next++))
+         return false;
+   return true;
+}
+
+/* Smallest power of two step whose 255 steps from lo reach hi, as decoded. */
+int8_t gridExponent(real lo, real hi)
+{
+   int e = -126;
+   double extent = static_cast<double>(hi) - lo;
+   if (extent > 0)
+      e = std::max(e, static_cast<int>(std::ceil(std::log2(extent / UINT8_MAX))));
+   while (lo + UINT8_MAX * quantizedScale(static_cast<int8_t>(e)) < hi)
+      ++e;
+   return static_cast<int8_t>(e);
+}
+
+/* Grid coordinates that decode at or below v, and at or above v for quantizeUp. */
+uint8_t quantizeDown(real v, real origin, real scale)
+{
+   int q = std::clamp(static_cast<int>(std::floor((static_cast<double>(v) - origin) / scale)), 0,
+                      static_cast<int>(UINT8_MAX));
+   while (q > 0 && origin + static_cast<real>(q) * scale > v)
+      --q;
+   return static_cast<uint8_t>(q);
+}
+
+uint8_t quantizeUp(real v, real origin, real scale)
+{
+   int q = std::clamp(static_cast<int>(std::ceil((static_cast<double>(v) - origin) / scale)), 0,
+                      static_cast<int>(UINT8_MAX));
+   while (q < UINT8_MAX && origin + static_cast<real>(q) * scale < v)
+      ++q;
+   return static_cast<uint8_t>(q);
+}
+
+/*
+ * Leaves are reloaded lane for lane and the bounds regrown from the bottom
+ * up. Children follow their parents in both node arrays, so one backwards
+ * pass over each finishes every child before its parent. Quantized nodes
+ * are laid out again from the refitted binary tree. SBVH leaves lose their
+ * clipping and bound whole triangles again.
+ */
+void BVH::refit(const Mesh &mesh)
+{
+   refitTriangleBlocks(mesh, &blocks);
+   for (size_t i = nodes.size(); i-- > 0;)
+   {
+      BVHNode &node = nodes[i];
+      AABB box;
+      if (node.count)
+         box = leafBounds(blocks, node.offset, node.count);
+      else
+      {
+         const BVHNode &l = nodes[i + 1], &r = nodes[node.offset];
+         box = AABB { .min = glm::min(l.min, r.min), .max = glm::max(l.max, r.max) };
+      }
+      node.min = box.min;
+      node.max = box.max;
+   }
+
+   for (size_t w = wide_nodes.size(); w-- > 0;)
+   {
+      WideBVHNode &node = wide_nodes[w];
+      for (uint i = 0; i < node.size; ++i)
+      {
+         AABB box = emptyBox();
+         if (node.count[i])
+            box = leafBounds(blocks, node.child[i], node.count[i]);
+         else
+         {
+            const WideBVHNode &child = wide_nodes[node.child[i]];
+            for (uint j = 0; j < child.size; ++j)
+            {
+               box.grow(vec3(child.min_x[j], child.min_y[j], child.min_z[j]));
+               box.grow(vec3(child.max_x[j], child.max_y[j], child.max_z[j]));
+            }
+         }
+         node.min_x[i] = box.min.x, node.min_y[i] = box.min.y, node.min_z[i] = box.min.z;
+         node.max_x[i] = box.max.x, node.max_y[i] = box.max.y, node.max_z[i] = box.max.z;
+      }
+   }
+   /* Same topology, so the leaf blocks keep their order. */
+   if (!quantized_nodes.empty())
+      quantizeNodes(m_Width);
+
+   if (m_TriangleTest == TriangleTest::BaldwinWeber)
+      packTransformBlocks(blocks, &transform_blocks);
+   else if (m_TriangleTest == TriangleTest::Watertight)
+      packVertexBlocks(mesh, blocks, &vertex_blocks);
+}
+
+/* SAH cost is relative to the root area, so it tracks how well the leaves
+ * still fit their triangles rather than how far the mesh moved. */
+bool BVH::update(const Mesh &mesh, const BVHBuildOptions &opts)
+{
+   refit(mesh);
+   real cost = stats().sah_cost;
+   if (cost <= opts.max_refit_cost * m_BuildSahCost)
+      return false;
+   print("[BVH] refit SAH cost: ", cost, " (", m_BuildSahCost, " at build), rebuilding");
+   build(mesh, opts);
+   return true;
+}
+
+/* Bounds of the triangles as the kernels see them, the same as at build. */
+AABB leafBounds(const std::vector<TriangleBlock> &blocks, uint first, uint count)
+{
+   AABB box = emptyBox();
+   for (uint b = first; b < first + blockCount(count); ++b)
+   {
+      const TriangleBlock &block = blocks[b];
+      for (int i = 0; i < TRI_BLOCK_SIZE; ++i)
+      {
+         if (block.ids[i] == static_cast<uint>(-1))
+            continue;
+         vec3 p(block.px[i], block.py[i], block.pz[i]);
+         box.grow(p);
+         box.grow(p + vec3(block.ux[i], block.uy[i], block.uz[i]));
+         box.grow(p + vec3(block.vx[i], block.vy[i], block.vz[i]));
+      }
+   }
+   return box;
+}
+
+size_t BVH::closestHit(const Ray &ray, real *ct) const
+{
+   size_t ck = -1;
+   *ct = inf;
+   closerHit(ray, ct, &ck);
+   return ck;
+}
+
+/* Closest-hit traversal that starts from the hit (*ct, *ck) found so far. */
+void BVH::closerHit(const Ray &ray, real *ct, size_t *ck) const
+{
+   if (!quantized_nodes.empty())
+      return closerHitWide(ray, quantized_nodes, ct, ck);
+   if (!wide_nodes.empty())
+      return closerHitWide(ray, wide_nodes, ct, ck);
+
+   struct StackEntry
+   {
+      uint node;
+      real t;
+   };
+
+   if (nodes.empty())
+      return;
+
+   vec3 inv_d = real(1) / ray.d;
+   StackEntry stack[MAX_DEPTH];
+   int sp = 0;
+
+   real troot = rayBoxIntersection(ray.o, inv_d, nodes[0].min, nodes[0].max, *ct);
+   if (troot == inf)
+      return;
+   stack[sp++] = StackEntry { 0, troot };
+
+   while (sp > 0)
+   {
+      StackEntry entry = stack[--sp];
+      if (entry.t > *ct)
+         continue;
+      uint idx = entry.node;
+      for (;;)
+      {
+         const BVHNode &node = nodes[idx];
+         RAY_STAT(node_visits, 1);
+         if (node.count)
+         {
+            intersectLeaf(ray, node.offset, node.count, ct, ck);
+            break;
+         }
+
+         uint l = idx + 1, r = node.offset;
+         real tl = rayBoxIntersection(ray.o, inv_d, nodes[l].min, nodes[l].max, *ct);
+         real tr = rayBoxIntersection(ray.o, inv_d, nodes[r].min, nodes[r].max, *ct);
+         if (tl > tr)
+            std::swap(l, r), std::swap(tl, tr);
+         if (tl == inf)
+            break;
+         if (tr != inf)
+            stack[sp++] = StackEntry { r, tr };
+         idx = l;
+      }
+   }
+}
+
+/*
+ * Closest hits for a packet of rays sharing an origin. A node is entered with
+ * the index of the first ray known to be active in it; if that ray misses a
+ * child, an interval-arithmetic test over the whole packet culls the child
+ * before the remaining rays are scanned. Nodes popped off the stack find
+ * their first ray again once leaves have shortened it, and leaves only test
+ * the rays that enter their box. Packets whose directions straddle an axis
+ * have no usable interval and are traced as single rays. Wide and quantized
+ * nodes are walked the same way, lane by lane.
+ */
+void BVH::closestHitPacket(RayPacket *packet) const
+{
+   struct StackEntry
+   {
+      uint node;
+      int first;
+      real t; // where the first ray enters the node
+   };
+
+   const int n = packet->count;
+   const vec3 &o = packet->o;
+   for (int i = 0; i < n; ++i)
+      packet->t[i] = inf, packet->k[i] = -1;
+   if (nodes.empty() || n == 0)
+      return;
+
+   vec3 inv_d[MAX_PACKET_RAYS];
+   vec3 imin(inf), imax(-inf);
+   for (int i = 0; i < n; ++i)
+   {
+      inv_d[i] = real(1) / packet->d[i];
+      imin = glm::min(imin, inv_d[i]);
+      imax = glm::max(imax, inv_d[i]);
+   }
+   for (int a = 0; a < 3; ++a)
+      if (std::signbit(imin[a]) != std::signbit(imax[a]))
+      {
+         for (int i = 0; i < n; ++i)
+            packet->k[i] = closestHit(Ray { .o = o, .d = packet->d[i] }, &packet->t[i]);
+         return;
+      }
+   if (!quantized_nodes.empty())
+      return closestHitPacketWide(packet, quantized_nodes, inv_d, imin, imax);
+   if (!wide_nodes.empty())
+      return closestHitPacketWide(packet, wide_nodes, inv_d, imin, imax);
+
+   /* First ray at or after `first` that hits the node, or n. */
+   auto firstActive = [&](const BVHNode &node, int first, real *tenter) {
+      *tenter = rayBoxIntersection(o, inv_d[first], node.min, node.max, packet->t[first]);
+      if (*tenter != inf)
+         return first;
+      if (packetMisses(o, imin, imax, node.min, node.max))
+         return n;
+      for (int i = first + 1; i < n; ++i)
+      {
+         *tenter = rayBoxIntersection(o, inv_d[i], node.min, node.max, packet->t[i]);
+         if (*tenter != inf)
+            return i;
+      }
+      return n;
+   };
+
+   StackEntry stack[MAX_DEPTH];
+   int sp = 0;
+   real troot;
+   int root_first = firstActive(nodes[0], 0, &troot);
+   if (root_first == n)
+      return;
+   stack[sp++] = StackEntry { 0, root_first, troot };
+
+   while (sp > 0)
+   {
+      StackEntry entry = stack[--sp];
+      uint idx = entry.node;
+      int first = entry.first;
+      real tenter;
+      if (entry.t > packet->t[first] && (first = firstActive(nodes[idx], first, &tenter)) == n)
+         continue;
+      for (;;)
+      {
+         const BVHNode &node = nodes[idx];
+         RAY_STAT(node_visits, 1);
+         if (node.count)
+         {
+            for (int i = first; i < n; ++i)
+               if (i == first || rayBoxIntersection(o, inv_d[i], node.min, node.max,
+                                                    packet->t[i]) != inf)
+                  intersectLeaf(Ray { .o = o, .d = packet->d[i] }, node.offset, node.count,
+                                &packet->t[i], &packet->k[i]);
+            break;
+         }
+
+         uint l = idx + 1, r = node.offset;
+         real tl, tr;
+         int fl = firstActive(nodes[l], first, &tl);
+         int fr = firstActive(nodes[r], first, &tr);
+         if (fl == n && fr == n)
+            break;
+         if (fl == n || (fr != n && (fr < fl || (fr == fl && tr < tl))))
+            std::swap(l, r), std::swap(fl, fr), std::swap(tl, tr);
+         if (fr != n)
+            stack[sp++] = StackEntry { r, fr, tr };
+         idx = l;
+         first = fl;
+      }
+   }
+}
+
+/* Conservative test whether no ray of a packet, with inverse directions
+ * between imin and imax that do not straddle an axis, can enter the box. */
+bool packetMisses(const vec3 &o, const vec3 &imin, const vec3 &imax, const vec3 &min,
+                  const vec3 &max)
+{
+   real enter = 0, exit = inf;
+   for (int a = 0; a < 3; ++a)
+   {
+      real lo = min[a] - o[a], hi = max[a] - o[a];
+      real near, far;
+      if (!std::signbit(imin[a]))
+      {
+         near = lo * (lo >= 0 ? imin[a] : imax[a]);
+         far = hi * (hi >= 0 ? imax[a] : imin[a]);
+      }
+      else
+      {
+         near = hi * (hi >= 0 ? imin[a] : imax[a]);
+         far = lo * (lo >= 0 ? imax[a] : imin[a]);
+      }
+      if (near > enter)
+         enter = near;
+      if (far < exit)
+         exit = far;
+   }
+   return enter > exit * BOX_EXIT_SCALE;
+}
+
+/*
+ * closestHitPacket over wide nodes. The first active ray tests all lanes at
+ * once; lanes it misses are culled for the whole packet by the interval
+ * test, or else go to the first later ray that enters them. Entered lanes
+ * are pushed so the one with the earliest first ray, then the nearest, is
+ * visited next. A lane is resolved when popped, after its first ray is
+ * checked against the hits found since.
+ */
+template<class Node>
+void BVH::closestHitPacketWide(RayPacket *packet, const std::vector<Node> &wide,
+                               const vec3 *inv_d, const vec3 &imin, const vec3 &imax) const
+{
+   struct StackEntry
+   {
+      uint node;
+      int lane; // of node, -1 for the root
+      int first;
+      real t;
+   };
+
+   const int n = packet->count;
+   const vec3 &o = packet->o;
+   StackEntry stack[MAX_DEPTH * (WIDE_BVH_WIDTH - 1) + 1];
+   int sp = 0;
+   stack[sp++] = StackEntry { 0, -1, 0, 0 };
+
+   while (sp > 0)
+   {
+      StackEntry entry = stack[--sp];
+      uint child = 0, count = 0;
+      int cur = entry.first;
+      if (entry.lane >= 0)
+      {
+         const Node &parent = wide[entry.node];
+         vec3 bmin, bmax;
+         laneBox(parent, entry.lane, &bmin, &bmax);
+         if (entry.t > packet->t[cur])
+         {
+            while (++cur < n &&
+                   rayBoxIntersection(o, inv_d[cur], bmin, bmax, packet->t[cur]) == inf)
+               ;
+            if (cur == n)
+               continue;
+         }
+         laneEntry(parent, entry.lane, &child, &count);
+         if (count)
+         {
+            for (int i = cur; i < n; ++i)
+               if (i == cur || rayBoxIntersection(o, inv_d[i], bmin, bmax, packet->t[i]) != inf)
+                  intersectLeaf(Ray { .o = o, .d = packet->d[i] }, child, count,
+                                &packet->t[i], &packet->k[i]);
+            continue;
+         }
+      }
+
+      const Node &node = wide[child];
+      RAY_STAT(node_visits, 1);
+      float t[WIDE_BVH_WIDTH], tr[WIDE_BVH_WIDTH];
+      int first[WIDE_BVH_WIDTH];
+      int entered = intersectNode(m_NodeKernel, o, inv_d[cur], node, packet->t[cur], t);
+      for (int mask = entered; mask; mask &= mask - 1)
+         first[__builtin_ctz(mask)] = cur;
+      int pending = usedLanes(node) & ~entered;
+      for (int mask = pending; mask; mask &= mask - 1)
+      {
+         int i = __builtin_ctz(mask);
+         vec3 bmin, bmax;
+         laneBox(node, i, &bmin, &bmax);
+         if (packetMisses(o, imin, imax, bmin, bmax))
+            pending &= ~(1 << i);
+      }
+      for (int r = cur + 1; r < n && pending; ++r)
+      {
+         int hit = intersectNode(m_NodeKernel, o, inv_d[r], node, packet->t[r], tr) & pending;
+         for (int mask = hit; mask; mask &= mask - 1)
+         {
+            int i = __builtin_ctz(mask);
+            first[i] = r, t[i] = tr[i];
+         }
+         pending &= ~hit;
+         entered |= hit;
+      }
+
+      int base = sp;
+      for (int mask = entered; mask; mask &= mask - 1)
+      {
+         int i = __builtin_ctz(mask);
+         int j = sp++;
+         for (; j > base && (stack[j - 1].first < first[i] ||
+                             (stack[j - 1].first == first[i] && stack[j - 1].t < t[i])); --j)
+            stack[j] = stack[j - 1];
+         stack[j] = StackEntry { child, i, first[i], t[i] };
+      }
+   }
+}
+
+/* Any-hit query: no ordering and no closest-hit bookkeeping, stops at the first blocker. */
+bool BVH::occluded(const Ray &ray, real tmax, size_t skip) const
+{
+   if (nodes.empty())
+      return false;
+   if (!quantized_nodes.empty())
+      return occludedWide(ray, quantized_nodes, tmax, skip);
+   if (!wide_nodes.empty())
+      return occludedWide(ray, wide_nodes, tmax, skip);
+
+   vec3 inv_d = real(1) / ray.d;
+   uint stack[MAX_DEPTH];
+   int sp = 0;
+   stack[sp++] = 0;
+
+   while (sp > 0)
+   {
+      const BVHNode &node = nodes[stack[--sp]];
+      RAY_STAT(node_visits, 1);
+      if (rayBoxIntersection(ray.o, inv_d, node.min, node.max, tmax) == inf)
+         continue;
+      if (node.count)
+      {
+         if (occludedLeaf(ray, node.offset, node.count, tmax, skip))
+            return true;
+         continue;
+      }
+      stack[sp++] = node.offset;
+      stack[sp++] = static_cast<uint>(&node - nodes.data()) + 1;
+   }
+   return false;
+}
+
+/*
+ * Ordered traversal of the wide nodes: the children a ray enters are pushed
+ * farthest first, so the nearest one is visited next and later entries are
+ * dropped once a hit is closer than their entry distance. Node is either
+ * WideBVHNode or QuantizedBVHNode.
+ */
+template<class Node>
+void BVH::closerHitWide(const Ray &ray, const std::vector<Node> &wide, real *ct,
+                        size_t *ck) const
+{
+   struct StackEntry
+   {
+      uint child;
+      uint count;
+      real t;
+   };
+
+   vec3 inv_d = real(1) / ray.d;
+   StackEntry stack[MAX_DEPTH * (WIDE_BVH_WIDTH - 1) + 1];
+   int sp = 0;
+   stack[sp++] = StackEntry { 0, 0, 0 };
+
+   while (sp > 0)
+   {
+      StackEntry entry = stack[--sp];
+      if (entry.t > *ct)
+         continue;
+      if (entry.count)
+      {
+         intersectLeaf(ray, entry.child, entry.count, ct, ck);
+         continue;
+      }
+
+      const Node &node = wide[entry.child];
+      RAY_STAT(node_visits, 1);
+      float t[WIDE_BVH_WIDTH];
+      int base = sp;
+      for (int mask = intersectNode(m_NodeKernel, ray.o, inv_d, node, *ct, t); mask;
+           mask &= mask - 1)
+      {
+         int i = __builtin_ctz(mask);
+         int j = sp++;
+         for (; j > base && stack[j - 1].t < t[i]; --j)
+            stack[j] = stack[j - 1];
+         stack[j].t = t[i];
+         laneEntry(node, i, &stack[j].child, &stack[j].count);
+      }
+   }
+}
+
+template<class Node>
+bool BVH::occludedWide(const Ray &ray, const std::vector<Node> &wide, real tmax,
+                       size_t skip) const
+{
+   struct StackEntry
+   {
+      uint child;
+      uint count;
+   };
+
+   vec3 inv_d = real(1) / ray.d;
+   StackEntry stack[MAX_DEPTH * (WIDE_BVH_WIDTH - 1) + 1];
+   int sp = 0;
+   stack[sp++] = StackEntry { 0, 0 };
+
+   while (sp > 0)
+   {
+      StackEntry entry = stack[--sp];
+      if (entry.count)
+      {
+         if (occludedLeaf(ray, entry.child, entry.count, tmax, skip))
+            return true;
+         continue;
+      }
+
+      const Node &node = wide[entry.child];
+      RAY_STAT(node_visits, 1);
+      float t[WIDE_BVH_WIDTH];
+      for (int mask = intersectNode(m_NodeKernel, ray.o, inv_d, node, tmax, t); mask;
+           mask &= mask - 1)
+      {
+         StackEntry &e = stack[sp++];
+         laneEntry(node, __builtin_ctz(mask), &e.child, &e.count);
+      }
+   }
+   return false;
+}
+
+int intersectNode(const NodeKernel *kernel, const vec3 &o, const vec3 &inv_d,
+                  const WideBVHNode &node, real tmax, float *t)
+{
+   return kernel->intersect(o, inv_d, node, tmax, t);
+}
+
+int intersectNode(const NodeKernel *kernel, const vec3 &o, const vec3 &inv_d,
+                  const QuantizedBVHNode &node, real tmax, float *t)
+{
+   return kernel->intersectQuantized(o, inv_d, node, tmax, t);
+}
+
+/* Stack entry of lane i: inner node and 0, or first block and triangle count. */
+void laneEntry(const WideBVHNode &node, int i, uint *child, uint *count)
+{
+   *child = node.child[i];
+   *count = node.count[i];
+}
+
+void laneBox(const WideBVHNode &node, int i, vec3 *min, vec3 *max)
+{
+   *min = vec3(node.min_x[i], node.min_y[i], node.min_z[i]);
+   *max = vec3(node.max_x[i], node.max_y[i], node.max_z[i]);
+}
+
+/* Decoded like the node kernels do it. */
+void laneBox(const QuantizedBVHNode &node, int i, vec3 *min, vec3 *max)
+{
+   vec3 scale(quantizedScale(node.exponent[0]), quantizedScale(node.exponent[1]),
+              quantizedScale(node.exponent[2]));
+   *min = node.origin + vec3(node.lo_x[i], node.lo_y[i], node.lo_z[i]) * scale;
+   *max = node.origin + vec3(node.hi_x[i], node.hi_y[i], node.hi_z[i]) * scale;
+}
+
+/* Quantized nodes store no per lane offsets: inner children are consecutive
+ * from child_base and the blocks of the leaf lanes from block_base. */
+void laneEntry(const QuantizedBVHNode &node, int i, uint *child, uint *count)
+{
+   *count = node.count[i];
+   if (!*count)
+   {
+      *child = node.child_base + __builtin_popcount(node.inner_mask & ((1u << i) - 1));
+      return;
+   }
+   *child = node.block_base;
+   for (int j = 0; j < i; ++j)
+      *child += blockCount(node.count[j]);
+}
+
+/* Leaf tests, on the blocks of the triangle test in use. The watertight
+ * test has no triangle to skip: callers offset their origins instead. */
+void BVH::intersectLeaf(const Ray &ray, uint first, uint count, real *ct, size_t *ck) const
+{
+   RAY_STAT(triangle_tests, count);
+   uint end = first + blockCount(count);
+   switch (m_TriangleTest)
+   {
+      case TriangleTest::MollerTrumbore:
+         for (uint b = first; b < end; ++b)
+            m_Kernel->closestHit(ray, blocks[b], ct, ck);
+         break;
+      case TriangleTest::BaldwinWeber:
+         for (uint b = first; b < end; ++b)
+            m_Kernel->closestHitTransform(ray, transform_blocks[b], ct, ck);
+         break;
+      case TriangleTest::Watertight:
+         for (uint b = first; b < end; ++b)
+            m_Kernel->closestHitWatertight(ray, vertex_blocks[b], ct, ck);
+         break;
+   }
+}
+
+bool BVH::occludedLeaf(const Ray &ray, uint first, uint count, real tmax, size_t skip) const
+{
+   RAY_STAT(triangle_tests, count);
+   uint end = first + blockCount(count);
+   switch (m_TriangleTest)
+   {
+      case TriangleTest::MollerTrumbore:
+         for (uint b = first; b < end; ++b)
+            if (m_Kernel->anyHit(ray, blocks[b], tmax, skip))
+               return true;
+         break;
+      case TriangleTest::BaldwinWeber:
+         for (uint b = first; b < end; ++b)
+            if (m_Kernel->anyHitTransform(ray, transform_blocks[b], tmax, skip))
+               return true;
+         break;
+      case TriangleTest::Watertight:
+         for (uint b = first; b < end; ++b)
+            if (m_Kernel->anyHitWatertight(ray, vertex_blocks[b], tmax))
+               return true;
+         break;
+   }
+   return false;
+}
+
+/* The other tests' leaves are derived from the Möller–Trumbore blocks,
+ * which stay the stored form. */
+void BVH::useTriangleTest(const Mesh &mesh, TriangleTest test)
+{
+   m_TriangleTest = test;
+   transform_blocks.clear();
+   vertex_blocks.clear();
+   size_t bytes = 0;
+   if (test == TriangleTest::BaldwinWeber)
+   {
+      packTransformBlocks(blocks, &transform_blocks);
+      bytes = transform_blocks.size() * sizeof(TransformBlock);
+   }
+   else if (test == TriangleTest::Watertight)
+   {
+      packVertexBlocks(mesh, blocks, &vertex_blocks);
+      bytes = vertex_blocks.size() * sizeof(VertexBlock);
+   }
+   if (bytes)
+      print("[BVH] triangle test: ", triangleTestName(test), ", leaf data: ",
+            bytes / (1024.f * 1024.f), " MB");
+   transform_blocks.shrink_to_fit();
+   vertex_blocks.shrink_to_fit();
+}
+
+TriangleTest BVH::triangleTest() const
+{
+   return m_TriangleTest;
+}
+
+size_t BVH::triangleCount() const
+{
+   return m_TriangleCount;
+}
+
+bool BVH::builtWith(const BVHBuildOptions &opts) const
+{
+   float growth = opts.builder == BVHBuilder::SBVH ? opts.max_split_growth : 0;
+   return m_Builder == opts.builder && m_SplitGrowth == growth;
+}
+
+BVHStats BVH::stats() const
+{
+   BVHStats stats {};
+   stats.build_ms = m_BuildMs;
+   if (nodes.empty())
+      return stats;
+   AABB root { .min = nodes[0].min, .max = nodes[0].max };
+   stats.depth = statsRecursive(nodes, 0, root.area(), &stats);
+   return stats;
+}
+
+real sahCost(const std::vector<BVHNode> &nodes)
+{
+   BVHStats stats {};
+   AABB root { .min = nodes[0].min, .max = nodes[0].max };
+   statsRecursive(nodes, 0, root.area(), &stats);
+   return stats.sah_cost;
+}
+
+int statsRecursive(const std::vector<BVHNode> &nodes, uint idx, real root_area,
+                   BVHStats *stats)
+{
+   const BVHNode &node = nodes[idx];
+   AABB box { .min = node.min, .max = node.max };
+   real rel_area = root_area > 0 ? box.area() / root_area : 1;
+   stats->nodes++;
+   if (node.count)
+   {
+      stats->leaves++;
+      stats->sah_cost += BLOCK_INTERSECTION_COST * blockCount(node.count) * rel_area;
+      return 1;
+   }
+   stats->sah_cost += TRAVERSAL_COST * rel_area;
+   int l = statsRecursive(nodes, idx + 1, root_area, stats);
+   int r = statsRecursive(nodes, node.offset, root_area, stats);
+   return 1 + std::max(l, r);
+}
+
+void BVH::report() const
+{
+   BVHStats s = stats();
+   if (m_BuildThreads)
+      print("[BVH] ", builderName(m_Builder), " build on ", m_BuildThreads, " threads");
+   print("[BVH] triangles: ", m_TriangleCount, ", nodes: ", s.nodes, ", leaves: ", s.leaves,
+         ", depth: ", s.depth, ", SAH cost: ", s.sah_cost);
+}
+
+void BVH::write(BinaryWriter *out) const
+{
+   out->write<uint64_t>(m_TriangleCount);
+   out->write(m_Builder);
+   out->write(m_SplitGrowth);
+   out->writeVector(nodes);
+   out->writeVector(blocks);
+}
+
+bool BVH::read(BinaryReader *in)
+{
+   uint64_t triangle_count;
+   BVHBuilder builder;
+   float split_growth;
+   if (!in->read(&triangle_count) || !in->read(&builder) || !in->read(&split_growth) ||
+       !in->readVector(&nodes) || !in->readVector(&blocks))
+      return false;
+   m_TriangleCount = triangle_count;
+   m_Builder = builder;
+   m_SplitGrowth = split_growth;
+   m_BuildThreads = 0;
+   wide_nodes.clear();
+   quantized_nodes.clear();
+   transform_blocks.clear();
+   vertex_blocks.clear();
+   m_TriangleTest = TriangleTest::MollerTrumbore;
+   m_Kernel = &triangleKernel();
+   m_BuildMs = 0;
+   m_BuildSahCost = stats().sah_cost;
+   return true;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Raytracer.h"
+#include "Accel/TriangleKernel.h"
+
+struct AABB
+{
+   vec3 min;
+   vec3 max;
+
+   void grow(const vec3 &p);
+   void grow(const AABB &b);
+   real area() const;
+};
+
+/* Spreads the low 10 bits of v to every third bit, for Morton codes. */
+uint expandBits(uint v);
+
+/*
+ * Nodes are stored in depth-first order, so the left child of an inner node
+ * directly follows it and `offset` points to the right child. For leaves
+ * `offset` is the first entry in BVH::blocks and `count` is the non-zero
+ * number of triangles packed into the following blocks.
+ */
+struct BVHNode
+{
+   vec3 min;
+   uint offset;
+   vec3 max;
+   uint count;
+};
+
+static constexpr int WIDE_BVH_WIDTH = 8;
+
+/*
+ * Node of the collapsed BVH: up to WIDE_BVH_WIDTH children with their bounds
+ * in SoA layout, so a ray is tested against all of them at once. Children
+ * with a non-zero `count` are leaves starting at BVH::blocks[child]; the
+ * others are indices into BVH::wide_nodes.
+ */
+struct alignas(32) WideBVHNode
+{
+   float min_x[WIDE_BVH_WIDTH], min_y[WIDE_BVH_WIDTH], min_z[WIDE_BVH_WIDTH];
+   float max_x[WIDE_BVH_WIDTH], max_y[WIDE_BVH_WIDTH], max_z[WIDE_BVH_WIDTH];
+   uint child[WIDE_BVH_WIDTH];
+   uint count[WIDE_BVH_WIDTH];
+   uint size;
+};
+
+/*
+ * WideBVHNode in 80 instead of 288 bytes. Child bounds are 8-bit steps of a
+ * per-axis power-of-two grid laid from the node's min corner, rounded
+ * outwards, so the decoded boxes still contain the children. Inner children
+ * are stored consecutively from child_base and the blocks of the leaf
+ * children from block_base, both in lane order.
+ */
+struct alignas(16) QuantizedBVHNode
+{
+   vec3 origin;
+   int8_t exponent[3]; // lane bounds are origin + q * 2^exponent
+   uint8_t inner_mask;
+   uint child_base;
+   uint block_base;
+   uint8_t count[WIDE_BVH_WIDTH]; // triangles of leaf lanes, 0 for inner and unused ones
+   uint8_t lo_x[WIDE_BVH_WIDTH], lo_y[WIDE_BVH_WIDTH], lo_z[WIDE_BVH_WIDTH];
+   uint8_t hi_x[WIDE_BVH_WIDTH], hi_y[WIDE_BVH_WIDTH], hi_z[WIDE_BVH_WIDTH];
+};
+
+static_assert(sizeof(QuantizedBVHNode) == 80);
+
+enum class BVHBuilder : uint32_t
+{
+   SAH,  // binned surface area heuristic, best trees
+   LBVH, // splits along a Morton curve, fastest builds
+   SBVH, // SAH with spatial splits, duplicates triangles straddling a split plane
+};
+
+const char *builderName(BVHBuilder builder);
+
+struct BVHBuildOptions
+{
+   BVHBuilder builder = BVHBuilder::SAH;
+   int threads = 0; // 0 = one per hardware thread
+   int width = 8;   // 4 or 8 collapses the tree into wide nodes, 2 keeps it binary
+   bool quantize = false; // store the wide nodes as QuantizedBVHNodes
+   TriangleTest triangle_test = TriangleTest::MollerTrumbore;
+   float max_refit_cost = 1.5f; // update() rebuilds once refits raise the SAH cost by this factor
+   float max_split_growth = 1.3f; // SBVH: leaves hold at most this many times the triangles
+   bool compare_object_splits = false; // SBVH: also build without spatial splits, to report against
+};
+
+struct BVHStats
+{
+   size_t nodes;
+   size_t leaves;
+   int depth;
+   real sah_cost;
+   float build_ms;
+};
+
+struct NodeKernel;
+struct BinaryReader;
+struct BinaryWriter;
+
+struct BVH
+{
+   std::vector<BVHNode> nodes;
+   std::vector<TriangleBlock> blocks;
+   std::vector<WideBVHNode> wide_nodes; // used for queries when not empty
+   std::vector<QuantizedBVHNode> quantized_nodes; // used instead when not empty
+   std::vector<TransformBlock> transform_blocks; // leaves for TriangleTest::BaldwinWeber
+   std::vector<VertexBlock> vertex_blocks; // leaves for TriangleTest::Watertight
+
+   void build(const Mesh &mesh, const BVHBuildOptions &opts = {});
+   void collapse(int width, bool quantize = false);
+   void useTriangleTest(const Mesh &mesh, TriangleTest test);
+   /* Moves the bounds to new vertex positions of the mesh the tree was built
+    * for, keeping its topology. */
+   void refit(const Mesh &mesh);
+   /* Refits, or rebuilds when that leaves the SAH cost above opts.max_refit_cost
+    * times the cost at the last build. Returns true on a rebuild. */
+   bool update(const Mesh &mesh, const BVHBuildOptions &opts);
+   size_t closestHit(const Ray &ray, real *ct) const;
+   void closerHit(const Ray &ray, real *ct, size_t *ck) const;
+   void closestHitPacket(RayPacket *packet) const;
+   bool occluded(const Ray &ray, real tmax, size_t skip = -1) const;
+   /* True if building with opts gives this tree: the options that shape it
+    * match. The others are applied to a built tree or only affect updates. */
+   bool builtWith(const BVHBuildOptions &opts) const;
+   TriangleTest triangleTest() const;
+   size_t triangleCount() const;
+   BVHStats stats() const;
+   void report() const;
+   void write(BinaryWriter *out) const;
+   bool read(BinaryReader *in);
+
+private:
+   bool quantizeNodes(int width);
+   template<class Node>
+   void closerHitWide(const Ray &ray, const std::vector<Node> &wide, real *ct, size_t *ck) const;
+   template<class Node>
+   void closestHitPacketWide(RayPacket *packet, const std::vector<Node> &wide,
+                             const vec3 *inv_d, const vec3 &imin, const vec3 &imax) const;
+   template<class Node>
+   bool occludedWide(const Ray &ray, const std::vector<Node> &wide, real tmax,
+                     size_t skip) const;
+   void intersectLeaf(const Ray &ray, uint first, uint count, real *ct, size_t *ck) const;
+   bool occludedLeaf(const Ray &ray, uint first, uint count, real tmax, size_t skip) const;
+
+   const TriangleKernel *m_Kernel = nullptr;
+   const NodeKernel *m_NodeKernel = nullptr;
+   size_t m_TriangleCount = 0;
+   BVHBuilder m_Builder = BVHBuilder::SAH;
+   float m_SplitGrowth = 0; // max_split_growth of SBVH builds
+   TriangleTest m_TriangleTest = TriangleTest::MollerTrumbore;
+   int m_Width = 2;
+   int m_BuildThreads = 0;
+   float m_BuildMs = 0;
+   real m_BuildSahCost = 0;
+};
@@ -0,0 +1,479 @@
+#include "Grid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "Intersection.h"
+#include "RayStats.h"
+#include "Accel/WorldMesh.h"
+#include "Utils/Log.h"
+#include "Utils/Timer.h"
+
+static constexpr real GRID_DENSITY = 2; // cells per triangle of a uniform grid or a sub-grid
+static constexpr real GRID_TOP_DENSITY = 1.0f / 16; // cells per triangle of a two-level top grid
+static constexpr uint GRID_REFINE_MIN = 16; // triangles in a top cell that get it a sub-grid
+static constexpr real GRID_MAX_SUB_GROWTH = 4; // references per triangle of a sub-grid
+static constexpr int GRID_MAX_RES = 256;
+static constexpr real GRID_PAD = 1e-5f; // of the scene diagonal, covers rounding of cell indices
+static constexpr int GRID_MAILBOX_SIZE = 32; // power of two
+static constexpr real inf = std::numeric_limits<real>::infinity();
+
+/* Recently tested triangles of one ray, direct mapped by id. Per ray rather
+ * than per triangle, so threads share nothing. */
+struct Mailbox
+{
+   uint ids[GRID_MAILBOX_SIZE];
+
+   Mailbox()
+   {
+      std::fill(ids, ids + GRID_MAILBOX_SIZE, static_cast<uint>(-1));
+   }
+
+   bool visited(uint k)
+   {
+      uint &slot = ids[k & (GRID_MAILBOX_SIZE - 1)];
+      if (slot == k)
+         return true;
+      slot = k;
+      return false;
+   }
+};
+
+static GridLevel makeLevel(const AABB &box, size_t count, real density);
+static void setResolution(const int res[3], GridLevel *level);
+static size_t cellCount(const GridLevel &level);
+static size_t referenceCount(const GridLevel &level, const std::vector<AABB> &boxes,
+                             const uint *ids, size_t count);
+static AABB cellBounds(const GridLevel &level, size_t cell);
+static void cellRange(const GridLevel &level, const AABB &box, int lo[3], int hi[3]);
+static void fillLevel(const GridLevel &level, const std::vector<AABB> &boxes, const uint *ids,
+                      size_t count, GridCell *cells, std::vector<uint> *refs);
+
+void Grid::build(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+                 TriangleTest test, bool two_level)
+{
+   Timer timer("Grid Build");
+
+   levels.clear();
+   cells.clear();
+   refs.clear();
+   blocks.clear();
+   transform_blocks.clear();
+   vertex_blocks.clear();
+   m_Kernel = &triangleKernel();
+   m_TriangleTest = test;
+
+   Mesh world = bakeInstances(meshes, instances, &m_InstanceFirst);
+   m_TriangleCount = world.triangleCount();
+   if (m_TriangleCount == 0)
+      return;
+
+   uint n = static_cast<uint>(m_TriangleCount);
+   std::vector<AABB> boxes(n);
+   AABB bounds { .min = vec3(inf), .max = vec3(-inf) };
+   for (uint i = 0; i < n; ++i)
+   {
+      Triangle tri = world.triangle(i);
+      AABB &box = boxes[i];
+      box = AABB { .min = vec3(inf), .max = vec3(-inf) };
+      box.grow(tri.bar.P);
+      box.grow(tri.bar.P + tri.bar.u);
+      box.grow(tri.bar.P + tri.bar.v);
+      bounds.grow(box);
+   }
+   vec3 pad(std::max(GRID_PAD * glm::length(bounds.max - bounds.min),
+                     std::numeric_limits<real>::min()));
+   bounds.min -= pad;
+   bounds.max += pad;
+   for (AABB &box : boxes)
+   {
+      box.min -= pad;
+      box.max += pad;
+   }
+
+   std::vector<uint> ids(n);
+   for (uint i = 0; i < n; ++i)
+      ids[i] = i;
+   GridLevel top = makeLevel(bounds, n, two_level ? GRID_TOP_DENSITY : GRID_DENSITY);
+   levels.push_back(top);
+   size_t top_cells = cellCount(top);
+   cells.resize(top_cells);
+   if (!two_level)
+      fillLevel(top, boxes, ids.data(), n, cells.data(), &refs);
+   else
+   {
+      std::vector<GridCell> coarse(top_cells);
+      std::vector<uint> coarse_refs;
+      fillLevel(top, boxes, ids.data(), n, coarse.data(), &coarse_refs);
+      for (size_t c = 0; c < top_cells; ++c)
+      {
+         const GridCell &src = coarse[c];
+         if (src.count <= GRID_REFINE_MIN)
+         {
+            cells[c] = GridCell { static_cast<uint>(refs.size()), src.count };
+            refs.insert(refs.end(), coarse_refs.begin() + src.first,
+                        coarse_refs.begin() + src.first + src.count);
+            continue;
+         }
+         /* Large triangles would be listed in most cells of a fine sub-grid. */
+         const uint *sub_ids = coarse_refs.data() + src.first;
+         GridLevel sub = makeLevel(cellBounds(top, c), src.count, GRID_DENSITY);
+         while (referenceCount(sub, boxes, sub_ids, src.count) > GRID_MAX_SUB_GROWTH * src.count &&
+                cellCount(sub) > 1)
+         {
+            int res[3] = { (sub.res[0] + 1) / 2, (sub.res[1] + 1) / 2, (sub.res[2] + 1) / 2 };
+            setResolution(res, &sub);
+         }
+         sub.first_cell = static_cast<uint>(cells.size());
+         cells[c] = GridCell { static_cast<uint>(levels.size()), GRID_REFINED };
+         levels.push_back(sub);
+         cells.resize(cells.size() + cellCount(sub));
+         fillLevel(sub, boxes, sub_ids, src.count, cells.data() + sub.first_cell, &refs);
+      }
+   }
+
+   /* Lanes are gathered by triangle, so the blocks hold the triangles in order. */
+   packTriangleBlocks(world, nullptr, n, &blocks);
+   m_EmptyBlock = TriangleBlock {};
+   std::fill(m_EmptyBlock.ids, m_EmptyBlock.ids + TRI_BLOCK_SIZE, static_cast<uint>(-1));
+   std::vector<TriangleBlock> empty { m_EmptyBlock };
+   if (test == TriangleTest::BaldwinWeber)
+   {
+      packTransformBlocks(blocks, &transform_blocks);
+      std::vector<TransformBlock> out;
+      packTransformBlocks(empty, &out);
+      m_EmptyTransformBlock = out[0];
+   }
+   else if (test == TriangleTest::Watertight)
+   {
+      packVertexBlocks(world, blocks, &vertex_blocks);
+      std::vector<VertexBlock> out;
+      packVertexBlocks(world, empty, &out);
+      m_EmptyVertexBlock = out[0];
+   }
+
+   m_BuildMs = timer.elapsed();
+   timer.stop();
+   report();
+}
+
+/* Cubic cells of about count * density in total, at least one per axis. */
+GridLevel makeLevel(const AABB &box, size_t count, real density)
+{
+   GridLevel level;
+   level.min = box.min;
+   level.max = box.max;
+   level.first_cell = 0;
+   vec3 extent = box.max - box.min;
+   real k = std::cbrt(density * count / (extent.x * extent.y * extent.z));
+   int res[3];
+   for (int a = 0; a < 3; ++a)
+      res[a] = static_cast<int>(glm::clamp(extent[a] * k, real(1), real(GRID_MAX_RES)));
+   setResolution(res, &level);
+   return level;
+}
+
+void setResolution(const int res[3], GridLevel *level)
+{
+   std::copy(res, res + 3, level->res);
+   vec3 r(res[0], res[1], res[2]);
+   vec3 extent = level->max - level->min;
+   level->cell_size = extent / r;
+   level->inv_cell_size = r / extent;
+}
+
+size_t cellCount(const GridLevel &level)
+{
+   return static_cast<size_t>(level.res[0]) * level.res[1] * level.res[2];
+}
+
+AABB cellBounds(const GridLevel &level, size_t cell)
+{
+   int c[3] = { static_cast<int>(cell % level.res[0]),
+                static_cast<int>(cell / level.res[0] % level.res[1]),
+                static_cast<int>(cell / level.res[0] / level.res[1]) };
+   AABB box;
+   for (int a = 0; a < 3; ++a)
+   {
+      box.min[a] = level.min[a] + c[a] * level.cell_size[a];
+      box.max[a] = c[a] + 1 == level.res[a] ? level.max[a]
+                                            : level.min[a] + (c[a] + 1) * level.cell_size[a];
+   }
+   return box;
+}
+
+size_t referenceCount(const GridLevel &level, const std::vector<AABB> &boxes, const uint *ids,
+                      size_t count)
+{
+   size_t refs = 0;
+   for (size_t i = 0; i < count; ++i)
+   {
+      int lo[3], hi[3];
+      cellRange(level, boxes[ids[i]], lo, hi);
+      refs += static_cast<size_t>(hi[0] - lo[0] + 1) * (hi[1] - lo[1] + 1) * (hi[2] - lo[2] + 1);
+   }
+   return refs;
+}
+
+void cellRange(const GridLevel &level, const AABB &box, int lo[3], int hi[3])
+{
+   for (int a = 0; a < 3; ++a)
+   {
+      lo[a] = glm::clamp(static_cast<int>((box.min[a] - level.min[a]) * level.inv_cell_size[a]),
+                         0, level.res[a] - 1);
+      hi[a] = glm::clamp(static_cast<int>((box.max[a] - level.min[a]) * level.inv_cell_size[a]),
+                         0, level.res[a] - 1);
+   }
+}
+
+/* Counts the triangles overlapping every cell by their boxes, then lists
+ * them at the end of refs. */
+void fillLevel(const GridLevel &level, const std::vector<AABB> &boxes, const uint *ids,
+               size_t count, GridCell *cells, std::vector<uint> *refs)
+{
+   size_t n = cellCount(level);
+   std::fill(cells, cells + n, GridCell { 0, 0 });
+   auto forCells = [&](uint k, auto f) {
+      int lo[3], hi[3];
+      cellRange(level, boxes[k], lo, hi);
+      for (int z = lo[2]; z <= hi[2]; ++z)
+         for (int y = lo[1]; y <= hi[1]; ++y)
+            for (int x = lo[0]; x <= hi[0]; ++x)
+               f(cells[(static_cast<size_t>(z) * level.res[1] + y) * level.res[0] + x]);
+   };
+
+   for (size_t i = 0; i < count; ++i)
+      forCells(ids[i], [](GridCell &cell) { cell.count++; });
+   uint first = static_cast<uint>(refs->size());
+   for (size_t c = 0; c < n; ++c)
+   {
+      cells[c].first = first;
+      first += cells[c].count;
+      cells[c].count = 0;
+   }
+   refs->resize(first);
+   for (size_t i = 0; i < count; ++i)
+      forCells(ids[i], [&](GridCell &cell) { (*refs)[cell.first + cell.count++] = ids[i]; });
+}
+
+/*
+ * Steps through the cells of a level that the ray crosses between tmin and
+ * tmax (3D-DDA). visit(cell, t0, t1) gets every cell with the stretch of the
+ * ray inside it and returns true to stop, which is then returned.
+ */
+template<class Visit>
+bool Grid::walk(const Ray &ray, const vec3 &inv_d, uint l, real tmin, real tmax,
+                Visit visit) const
+{
+   const GridLevel &level = levels[l];
+   vec3 t0 = (level.min - ray.o) * inv_d;
+   vec3 t1 = (level.max - ray.o) * inv_d;
+   vec3 tn = glm::min(t0, t1), tf = glm::max(t0, t1);
+   tmin = glm::max(glm::max(tn.x, tn.y), glm::max(tn.z, tmin));
+   tmax = glm::min(glm::min(glm::min(tf.x, tf.y), tf.z) * BOX_EXIT_SCALE, tmax);
+   if (!(tmin <= tmax))
+      return false;
+
+   vec3 p = ray.o + ray.d * tmin;
+   int c[3], step[3];
+   real next[3];
+   for (int a = 0; a < 3; ++a)
+   {
+      c[a] = glm::clamp(static_cast<int>((p[a] - level.min[a]) * level.inv_cell_size[a]), 0,
+                        level.res[a] - 1);
+      step[a] = ray.d[a] > 0 ? 1 : ray.d[a] < 0 ? -1 : 0;
+      next[a] = step[a] ? (level.min[a] + (c[a] + (step[a] > 0)) * level.cell_size[a] - ray.o[a])
+                             * inv_d[a]
+                        : inf;
+   }
+
+   real t = tmin;
+   for (;;)
+   {
+      int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+      uint cell = level.first_cell +
+                  static_cast<uint>((c[2] * level.res[1] + c[1]) * level.res[0] + c[0]);
+      RAY_STAT(node_visits, 1);
+      if (visit(cell, t, glm::min(next[a], tmax)))
+         return true;
+      if (next[a] >= tmax)
+         return false;
+      c[a] += step[a];
+      if (c[a] < 0 || c[a] >= level.res[a])
+         return false;
+      t = next[a];
+      next[a] = (level.min[a] + (c[a] + (step[a] > 0)) * level.cell_size[a] - ray.o[a]) * inv_d[a];
+   }
+}
+
+/* leaf(cell, t) gets the triangle cells front to back with the distance the
+ * ray leaves them at, and returns true to stop. */
+template<class Leaf>
+bool Grid::traverse(const Ray &ray, real tmax, Leaf leaf) const
+{
+   if (levels.empty())
+      return false;
+   vec3 inv_d = real(1) / ray.d;
+   return walk(ray, inv_d, 0, 0, tmax, [&](uint idx, real t0, real t1) {
+      const GridCell &cell = cells[idx];
+      if (cell.count != GRID_REFINED)
+         return leaf(cell, t1);
+      return walk(ray, inv_d, cell.first, t0, t1,
+                  [&](uint sub, real, real s1) { return leaf(cells[sub], s1); });
+   });
+}
+
+/* Blocks are rows of TRI_BLOCK_SIZE four byte lanes. */
+template<class Block>
+static inline void copyLane(const Block &src, int i, Block *dst, int j)
+{
+   static_assert(sizeof(Block) % (TRI_BLOCK_SIZE * 4) == 0, "blocks are rows of lanes");
+   constexpr int ROWS = sizeof(Block) / (TRI_BLOCK_SIZE * 4);
+   const char *s = reinterpret_cast<const char*>(&src);
+   char *d = reinterpret_cast<char*>(dst);
+   for (int r = 0; r < ROWS; ++r)
+      std::memcpy(d + (r * TRI_BLOCK_SIZE + j) * 4, s + (r * TRI_BLOCK_SIZE + i) * 4, 4);
+}
+
+/*
+ * Gathers the triangles of the cell the ray has not tested yet into blocks
+ * for the SIMD kernels; test(block) returns true to stop.
+ */
+template<class Block, class Test>
+static bool testCell(const GridCell &cell, const std::vector<uint> &refs,
+                     const std::vector<Block> &blocks, const Block &empty, Mailbox *mailbox,
+                     Test test)
+{
+   Block batch;
+   int n = 0;
+   for (uint i = cell.first; i < cell.first + cell.count; ++i)
+   {
+      uint k = refs[i];
+      if (mailbox->visited(k))
+         continue;
+      copyLane(blocks[k / TRI_BLOCK_SIZE], k % TRI_BLOCK_SIZE, &batch, n);
+      if (++n == TRI_BLOCK_SIZE)
+      {
+         RAY_STAT(triangle_tests, n);
+         if (test(batch))
+            return true;
+         n = 0;
+      }
+   }
+   if (n == 0)
+      return false;
+   RAY_STAT(triangle_tests, n);
+   for (int j = n; j < TRI_BLOCK_SIZE; ++j)
+      copyLane(empty, 0, &batch, j);
+   return test(batch);
+}
+
+/* Hits found in earlier cells are kept, so a hit before the cell's exit is
+ * final. The exit is rounded like the BVH slab test. */
+size_t Grid::closestHit(const Ray &ray, real *ct) const
+{
+   size_t ck = -1;
+   *ct = inf;
+   Mailbox mailbox;
+   traverse(ray, inf, [&](const GridCell &cell, real t) {
+      switch (m_TriangleTest)
+      {
+         case TriangleTest::MollerTrumbore:
+            testCell(cell, refs, blocks, m_EmptyBlock, &mailbox, [&](const TriangleBlock &b) {
+               m_Kernel->closestHit(ray, b, ct, &ck);
+               return false;
+            });
+            break;
+         case TriangleTest::BaldwinWeber:
+            testCell(cell, refs, transform_blocks, m_EmptyTransformBlock, &mailbox,
+                     [&](const TransformBlock &b) {
+                        m_Kernel->closestHitTransform(ray, b, ct, &ck);
+                        return false;
+                     });
+            break;
+         case TriangleTest::Watertight:
+            testCell(cell, refs, vertex_blocks, m_EmptyVertexBlock, &mailbox,
+                     [&](const VertexBlock &b) {
+                        m_Kernel->closestHitWatertight(ray, b, ct, &ck);
+                        return false;
+                     });
+            break;
+      }
+      return *ct * BOX_EXIT_SCALE <= t;
+   });
+   return ck == static_cast<size_t>(-1) ? ck : worldHitId(m_InstanceFirst, ck);
+}
+
+/* Rays are traced one by one; the cell walk has no use for a shared origin. */
+void Grid::closestHitPacket(RayPacket *packet) const
+{
+   for (int i = 0; i < packet->count; ++i)
+      packet->k[i] = closestHit(Ray { .o = packet->o, .d = packet->d[i] }, &packet->t[i]);
+}
+
+bool Grid::occluded(const Ray &ray, real tmax, size_t skip) const
+{
+   size_t local = worldTriangle(m_InstanceFirst, skip);
+   Mailbox mailbox;
+   return traverse(ray, tmax, [&](const GridCell &cell, real) {
+      switch (m_TriangleTest)
+      {
+         case TriangleTest::MollerTrumbore:
+            return testCell(cell, refs, blocks, m_EmptyBlock, &mailbox,
+                            [&](const TriangleBlock &b) {
+                               return m_Kernel->anyHit(ray, b, tmax, local);
+                            });
+         case TriangleTest::BaldwinWeber:
+            return testCell(cell, refs, transform_blocks, m_EmptyTransformBlock, &mailbox,
+                            [&](const TransformBlock &b) {
+                               return m_Kernel->anyHitTransform(ray, b, tmax, local);
+                            });
+         case TriangleTest::Watertight:
+            return testCell(cell, refs, vertex_blocks, m_EmptyVertexBlock, &mailbox,
+                            [&](const VertexBlock &b) {
+                               return m_Kernel->anyHitWatertight(ray, b, tmax);
+                            });
+      }
+      return false;
+   });
+}
+
+TriangleTest Grid::triangleTest() const
+{
+   return m_TriangleTest;
+}
+
+GridStats Grid::stats() const
+{
+   GridStats stats {};
+   stats.build_ms = m_BuildMs;
+   stats.sub_grids = levels.empty() ? 0 : levels.size() - 1;
+   for (const GridCell &cell : cells)
+   {
+      if (cell.count == GRID_REFINED)
+         continue;
+      stats.cells++;
+      stats.empty_cells += cell.count == 0;
+   }
+   stats.references = refs.size();
+   stats.bytes = levels.size() * sizeof(GridLevel) + cells.size() * sizeof(GridCell) +
+                 refs.size() * sizeof(uint) + blocks.size() * sizeof(TriangleBlock) +
+                 transform_blocks.size() * sizeof(TransformBlock) +
+                 vertex_blocks.size() * sizeof(VertexBlock);
+   return stats;
+}
+
+void Grid::report() const
+{
+   if (levels.empty())
+      return;
+   GridStats s = stats();
+   constexpr float MB = 1024 * 1024;
+   const GridLevel &top = levels[0];
+   print("[Grid] triangles: ", m_TriangleCount, ", top level: ", top.res[0], "x", top.res[1],
+         "x", top.res[2], ", sub-grids: ", s.sub_grids, ", cells: ", s.cells, " (",
+         100.f * s.empty_cells / s.cells, "% empty), references: ", s.references);
+   print("[Grid] data: ", s.bytes / MB, " MB, triangle test: ", triangleTestName(m_TriangleTest));
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+
+#include "Raytracer.h"
+#include "Accel/Accelerator.h"
+#include "Accel/BVH.h"
+
+/* Cells are numbered x fastest, then y, then z, from first_cell on. */
+struct GridLevel
+{
+   vec3 min, max;
+   vec3 cell_size, inv_cell_size;
+   int res[3];
+   uint first_cell;
+};
+
+/* Triangles refs[first..first + count), or with count GRID_REFINED the
+ * sub-grid levels[first] covering the cell. */
+struct GridCell
+{
+   uint first;
+   uint count;
+};
+
+static constexpr uint GRID_REFINED = static_cast<uint>(-1);
+
+struct GridStats
+{
+   size_t cells;
+   size_t empty_cells;
+   size_t sub_grids;
+   size_t references; // triangles in cells, counting every cell they overlap
+   float build_ms;
+   size_t bytes;
+};
+
+/*
+ * Uniform grid over the world space triangles of all instances, built in
+ * linear time. Two-level grids start coarse and give every crowded cell a
+ * sub-grid of its own resolution. Rays step through the cells front to back
+ * (3D-DDA) and remember the triangles they tested, so one straddling many
+ * cells is tested once.
+ */
+struct Grid : Accelerator
+{
+   std::vector<GridLevel> levels; // the top level, then the sub-grids
+   std::vector<GridCell> cells;
+   std::vector<uint> refs; // world triangles of the cells
+   /* World triangle k is lane k % TRI_BLOCK_SIZE of block k / TRI_BLOCK_SIZE. */
+   std::vector<TriangleBlock> blocks;
+   std::vector<TransformBlock> transform_blocks; // for TriangleTest::BaldwinWeber
+   std::vector<VertexBlock> vertex_blocks; // for TriangleTest::Watertight
+
+   void build(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+              TriangleTest test = TriangleTest::MollerTrumbore, bool two_level = true);
+   size_t closestHit(const Ray &ray, real *ct) const override;
+   void closestHitPacket(RayPacket *packet) const override;
+   bool occluded(const Ray &ray, real tmax, size_t skip = -1) const override;
+   TriangleTest triangleTest() const override;
+   GridStats stats() const;
+   void report() const;
+
+private:
+   template<class Visit>
+   bool walk(const Ray &ray, const vec3 &inv_d, uint level, real tmin, real tmax,
+             Visit visit) const;
+   template<class Leaf>
+   bool traverse(const Ray &ray, real tmax, Leaf leaf) const;
+
+   std::vector<uint> m_InstanceFirst; // first world triangle of every instance
+   /* Blocks of unused lanes, filling up partly gathered blocks. */
+   TriangleBlock m_EmptyBlock;
+   TransformBlock m_EmptyTransformBlock;
+   VertexBlock m_EmptyVertexBlock;
+   const TriangleKernel *m_Kernel = nullptr;
+   TriangleTest m_TriangleTest = TriangleTest::MollerTrumbore;
+   size_t m_TriangleCount = 0;
+   float m_BuildMs = 0;
+};
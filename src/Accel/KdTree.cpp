@@ -0,0 +1,431 @@
+#include "KdTree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "Intersection.h"
+#include "Accel/WorldMesh.h"
+#include "RayStats.h"
+#include "Utils/Log.h"
+#include "Utils/Timer.h"
+
+static constexpr int KD_BIN_COUNT = 32;
+static constexpr int KD_MAX_DEPTH = 64;
+static constexpr int KD_STACK_SIZE = 8; // power of two, older entries are dropped
+static constexpr real TRAVERSAL_COST = 1;
+static constexpr real BLOCK_INTERSECTION_COST = 2; // as in the BVH, one SIMD test of a block
+static constexpr real INTERSECTION_COST = BLOCK_INTERSECTION_COST / TRI_BLOCK_SIZE;
+static constexpr real EMPTY_BONUS = 0.8f; // cost factor of splits cutting off empty space
+static constexpr real inf = std::numeric_limits<real>::infinity();
+
+struct KdBuildContext
+{
+   std::vector<AABB> boxes; // per world triangle
+   std::vector<uint> refs; // leaf triangles in node order
+   int max_depth;
+};
+
+struct KdBin
+{
+   uint starts, ends;
+};
+
+static uint buildRecursive(KdBuildContext *ctx, std::vector<uint> *ids, const AABB &voxel,
+                           int depth, std::vector<KdNode> *nodes);
+static bool findSplit(const KdBuildContext *ctx, const std::vector<uint> &ids,
+                      const AABB &voxel, int *axis, real *plane);
+static AABB childVoxel(const AABB &voxel, int axis, real plane, bool above);
+static uint blockCount(uint count);
+static int statsRecursive(const std::vector<KdNode> &nodes, uint idx, const AABB &voxel,
+                          real root_area, KdTreeStats *stats);
+
+uint blockCount(uint count)
+{
+   return (count + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+}
+
+/* The instances are baked into one world space mesh for the build; only its
+ * packed leaf blocks are kept. */
+void KdTree::build(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+                   TriangleTest test)
+{
+   Timer timer("Kd-tree Build");
+
+   nodes.clear();
+   blocks.clear();
+   transform_blocks.clear();
+   vertex_blocks.clear();
+   m_Kernel = &triangleKernel();
+   m_TriangleTest = test;
+
+   Mesh world = bakeInstances(meshes, instances, &m_InstanceFirst);
+   m_TriangleCount = world.triangleCount();
+   if (m_TriangleCount == 0)
+      return;
+
+   uint n = static_cast<uint>(m_TriangleCount);
+   KdBuildContext ctx;
+   ctx.boxes.resize(n);
+   ctx.max_depth = std::min(KD_MAX_DEPTH, static_cast<int>(8 + 1.3f * std::log2(n)));
+   m_Bounds = AABB { .min = vec3(inf), .max = vec3(-inf) };
+   std::vector<uint> ids(n);
+   for (uint i = 0; i < n; ++i)
+   {
+      Triangle tri = world.triangle(i);
+      AABB &box = ctx.boxes[i];
+      box = AABB { .min = vec3(inf), .max = vec3(-inf) };
+      box.grow(tri.bar.P);
+      box.grow(tri.bar.P + tri.bar.u);
+      box.grow(tri.bar.P + tri.bar.v);
+      m_Bounds.grow(box);
+      ids[i] = i;
+   }
+   buildRecursive(&ctx, &ids, m_Bounds, 0, &nodes);
+   nodes.shrink_to_fit();
+
+   for (KdNode &node : nodes)
+   {
+      if ((node.data & 3) != KD_LEAF)
+         continue;
+      uint first = static_cast<uint>(blocks.size());
+      packTriangleBlocks(world, ctx.refs.data() + node.first, node.data >> 2, &blocks);
+      node.first = first;
+   }
+   if (test == TriangleTest::BaldwinWeber)
+      packTransformBlocks(blocks, &transform_blocks);
+   else if (test == TriangleTest::Watertight)
+      packVertexBlocks(world, blocks, &vertex_blocks);
+
+   m_BuildMs = timer.elapsed();
+   timer.stop();
+   report();
+}
+
+uint buildRecursive(KdBuildContext *ctx, std::vector<uint> *ids, const AABB &voxel, int depth,
+                    std::vector<KdNode> *nodes)
+{
+   uint idx = static_cast<uint>(nodes->size());
+   nodes->emplace_back();
+
+   int axis;
+   real plane;
+   if (depth >= ctx->max_depth || !findSplit(ctx, *ids, voxel, &axis, &plane))
+   {
+      (*nodes)[idx].first = static_cast<uint>(ctx->refs.size());
+      (*nodes)[idx].data = static_cast<uint>(ids->size()) << 2 | KD_LEAF;
+      ctx->refs.insert(ctx->refs.end(), ids->begin(), ids->end());
+      return idx;
+   }
+
+   /* Boxes are clipped to the voxel; flat ones lying in the plane go below it. */
+   std::vector<uint> below, above;
+   for (uint k : *ids)
+   {
+      const AABB &box = ctx->boxes[k];
+      real lo = std::max(box.min[axis], voxel.min[axis]);
+      real hi = std::min(box.max[axis], voxel.max[axis]);
+      if (lo < plane || (lo == plane && hi == plane))
+         below.push_back(k);
+      if (hi > plane)
+         above.push_back(k);
+   }
+   std::vector<uint>().swap(*ids);
+
+   buildRecursive(ctx, &below, childVoxel(voxel, axis, plane, false), depth + 1, nodes);
+   uint right = buildRecursive(ctx, &above, childVoxel(voxel, axis, plane, true), depth + 1,
+                               nodes);
+   (*nodes)[idx].split = plane;
+   (*nodes)[idx].data = right << 2 | axis;
+   return idx;
+}
+
+/*
+ * Binned SAH over the voxel: a triangle is counted below a bin plane if its
+ * clipped box starts in a lower bin and above it if it ends in that bin or
+ * higher. Returns false when a leaf is cheaper.
+ */
+bool findSplit(const KdBuildContext *ctx, const std::vector<uint> &ids, const AABB &voxel,
+               int *axis, real *plane)
+{
+   uint count = static_cast<uint>(ids.size());
+   real area = voxel.area();
+   if (count == 0 || area <= 0)
+      return false;
+
+   real best_cost = BLOCK_INTERSECTION_COST * blockCount(count);
+   bool found = false;
+   vec3 extent = voxel.max - voxel.min;
+   for (int a = 0; a < 3; ++a)
+   {
+      if (extent[a] <= 0)
+         continue;
+      KdBin bins[KD_BIN_COUNT] = {};
+      real scale = KD_BIN_COUNT / extent[a];
+      auto binOf = [&](real p) {
+         return std::clamp(static_cast<int>((p - voxel.min[a]) * scale), 0, KD_BIN_COUNT - 1);
+      };
+      for (uint k : ids)
+      {
+         const AABB &box = ctx->boxes[k];
+         bins[binOf(std::max(box.min[a], voxel.min[a]))].starts++;
+         bins[binOf(std::min(box.max[a], voxel.max[a]))].ends++;
+      }
+
+      uint below = 0, ended = 0;
+      for (int b = 1; b < KD_BIN_COUNT; ++b)
+      {
+         below += bins[b - 1].starts;
+         ended += bins[b - 1].ends;
+         uint above = count - ended;
+         if (below == count && above == count)
+            continue;
+         real p = voxel.min[a] + b * (extent[a] / KD_BIN_COUNT);
+         if (p <= voxel.min[a] || p >= voxel.max[a])
+            continue;
+         real area_below = childVoxel(voxel, a, p, false).area();
+         real area_above = childVoxel(voxel, a, p, true).area();
+         real cost = TRAVERSAL_COST +
+                     INTERSECTION_COST * (area_below * below + area_above * above) / area;
+         if (below == 0 || above == 0)
+            cost *= EMPTY_BONUS;
+         if (cost < best_cost)
+         {
+            best_cost = cost;
+            *axis = a;
+            *plane = p;
+            found = true;
+         }
+      }
+   }
+   return found;
+}
+
+AABB childVoxel(const AABB &voxel, int axis, real plane, bool above)
+{
+   AABB child = voxel;
+   (above ? child.min : child.max)[axis] = plane;
+   return child;
+}
+
+/*
+ * Front to back walk over the leaves the ray crosses before tmax. leaf(node,
+ * t) tests a leaf the ray leaves at t and returns true to stop; the walk also
+ * stops once the next leaf starts beyond *limit. Only the KD_STACK_SIZE
+ * latest far children are kept; past an empty stack the rest of the ray is
+ * walked again from the push-down node.
+ */
+template<class Leaf>
+void KdTree::traverse(const Ray &ray, real tmax, const real *limit, Leaf leaf) const
+{
+   struct StackEntry
+   {
+      uint node;
+      real tmin, tmax;
+   };
+
+   if (nodes.empty())
+      return;
+   vec3 inv_d = real(1) / ray.d;
+   vec3 t0 = (m_Bounds.min - ray.o) * inv_d;
+   vec3 t1 = (m_Bounds.max - ray.o) * inv_d;
+   vec3 tn = glm::min(t0, t1), tf = glm::max(t0, t1);
+   real seg_min = glm::max(glm::max(tn.x, tn.y), glm::max(tn.z, real(0)));
+   real t_end = glm::min(glm::min(glm::min(tf.x, tf.y), tf.z) * BOX_EXIT_SCALE, tmax);
+   if (!(seg_min <= t_end))
+      return;
+
+   StackEntry stack[KD_STACK_SIZE];
+   int top = 0, size = 0;
+   real seg_max = t_end;
+   uint idx = 0, restart = 0;
+   bool pushdown = true;
+   for (;;)
+   {
+      for (;;)
+      {
+         const KdNode &node = nodes[idx];
+         RAY_STAT(node_visits, 1);
+         int axis = node.data & 3;
+         if (axis == KD_LEAF)
+            break;
+         /* A ray along the plane has d = +-inf or NaN and stays on its side, as
+          * does one starting on the plane, which is below it if going down. */
+         real d = (node.split - ray.o[axis]) * inv_d[axis];
+         bool below = ray.o[axis] < node.split ||
+                      (ray.o[axis] == node.split && ray.d[axis] <= 0);
+         uint near = below ? idx + 1 : node.data >> 2;
+         uint far = below ? node.data >> 2 : idx + 1;
+         if (!(d > 0) || d > seg_max)
+            idx = near;
+         else if (d < seg_min)
+            idx = far;
+         else
+         {
+            stack[top] = StackEntry { far, d, seg_max };
+            top = (top + 1) & (KD_STACK_SIZE - 1);
+            size = std::min(size + 1, KD_STACK_SIZE);
+            idx = near;
+            seg_max = d;
+            pushdown = false;
+         }
+         if (pushdown)
+            restart = idx;
+      }
+
+      if (leaf(nodes[idx], seg_max))
+         return;
+      if (size > 0)
+      {
+         top = (top - 1) & (KD_STACK_SIZE - 1);
+         --size;
+         idx = stack[top].node;
+         seg_min = stack[top].tmin;
+         seg_max = stack[top].tmax;
+      }
+      else
+      {
+         if (seg_max >= t_end)
+            return;
+         idx = restart;
+         seg_min = seg_max;
+         seg_max = t_end;
+         pushdown = true;
+      }
+      if (seg_min > *limit)
+         return;
+   }
+}
+
+/* A hit inside the leaf's stretch of the ray is final. The exit distance
+ * is rounded like the BVH slab test, so hits on the far plane go on. */
+size_t KdTree::closestHit(const Ray &ray, real *ct) const
+{
+   size_t ck = -1;
+   *ct = inf;
+   traverse(ray, inf, ct, [&](const KdNode &node, real t) {
+      intersectLeaf(ray, node, ct, &ck);
+      return *ct * BOX_EXIT_SCALE <= t;
+   });
+   return ck == static_cast<size_t>(-1) ? ck : worldHitId(m_InstanceFirst, ck);
+}
+
+/* Rays are traced one by one; the walk has no use for a shared origin. */
+void KdTree::closestHitPacket(RayPacket *packet) const
+{
+   for (int i = 0; i < packet->count; ++i)
+      packet->k[i] = closestHit(Ray { .o = packet->o, .d = packet->d[i] }, &packet->t[i]);
+}
+
+bool KdTree::occluded(const Ray &ray, real tmax, size_t skip) const
+{
+   bool hit = false;
+   size_t local = worldTriangle(m_InstanceFirst, skip);
+   traverse(ray, tmax, &tmax, [&](const KdNode &node, real) {
+      hit = occludedLeaf(ray, node, tmax, local);
+      return hit;
+   });
+   return hit;
+}
+
+void KdTree::intersectLeaf(const Ray &ray, const KdNode &node, real *ct, size_t *ck) const
+{
+   uint count = node.data >> 2;
+   RAY_STAT(triangle_tests, count);
+   uint end = node.first + blockCount(count);
+   switch (m_TriangleTest)
+   {
+      case TriangleTest::MollerTrumbore:
+         for (uint b = node.first; b < end; ++b)
+            m_Kernel->closestHit(ray, blocks[b], ct, ck);
+         break;
+      case TriangleTest::BaldwinWeber:
+         for (uint b = node.first; b < end; ++b)
+            m_Kernel->closestHitTransform(ray, transform_blocks[b], ct, ck);
+         break;
+      case TriangleTest::Watertight:
+         for (uint b = node.first; b < end; ++b)
+            m_Kernel->closestHitWatertight(ray, vertex_blocks[b], ct, ck);
+         break;
+   }
+}
+
+bool KdTree::occludedLeaf(const Ray &ray, const KdNode &node, real tmax, size_t skip) const
+{
+   uint count = node.data >> 2;
+   RAY_STAT(triangle_tests, count);
+   uint end = node.first + blockCount(count);
+   switch (m_TriangleTest)
+   {
+      case TriangleTest::MollerTrumbore:
+         for (uint b = node.first; b < end; ++b)
+            if (m_Kernel->anyHit(ray, blocks[b], tmax, skip))
+               return true;
+         break;
+      case TriangleTest::BaldwinWeber:
+         for (uint b = node.first; b < end; ++b)
+            if (m_Kernel->anyHitTransform(ray, transform_blocks[b], tmax, skip))
+               return true;
+         break;
+      case TriangleTest::Watertight:
+         for (uint b = node.first; b < end; ++b)
+            if (m_Kernel->anyHitWatertight(ray, vertex_blocks[b], tmax))
+               return true;
+         break;
+   }
+   return false;
+}
+
+TriangleTest KdTree::triangleTest() const
+{
+   return m_TriangleTest;
+}
+
+KdTreeStats KdTree::stats() const
+{
+   KdTreeStats stats {};
+   stats.build_ms = m_BuildMs;
+   if (nodes.empty())
+      return stats;
+   stats.depth = statsRecursive(nodes, 0, m_Bounds, m_Bounds.area(), &stats);
+   stats.node_bytes = nodes.size() * sizeof(KdNode);
+   stats.leaf_bytes = blocks.size() * sizeof(TriangleBlock) +
+                      transform_blocks.size() * sizeof(TransformBlock) +
+                      vertex_blocks.size() * sizeof(VertexBlock);
+   return stats;
+}
+
+/* SAH cost in the units of BVHStats, relative to the scene bounds. */
+int statsRecursive(const std::vector<KdNode> &nodes, uint idx, const AABB &voxel,
+                   real root_area, KdTreeStats *stats)
+{
+   const KdNode &node = nodes[idx];
+   real rel_area = root_area > 0 ? voxel.area() / root_area : 1;
+   stats->nodes++;
+   int axis = node.data & 3;
+   if (axis == KD_LEAF)
+   {
+      uint count = node.data >> 2;
+      stats->leaves++;
+      stats->references += count;
+      stats->sah_cost += BLOCK_INTERSECTION_COST * blockCount(count) * rel_area;
+      return 1;
+   }
+   stats->sah_cost += TRAVERSAL_COST * rel_area;
+   int l = statsRecursive(nodes, idx + 1, childVoxel(voxel, axis, node.split, false),
+                          root_area, stats);
+   int r = statsRecursive(nodes, node.data >> 2, childVoxel(voxel, axis, node.split, true),
+                          root_area, stats);
+   return 1 + std::max(l, r);
+}
+
+void KdTree::report() const
+{
+   KdTreeStats s = stats();
+   constexpr float MB = 1024 * 1024;
+   print("[Kd-tree] triangles: ", m_TriangleCount, ", references: ", s.references,
+         ", nodes: ", s.nodes, ", leaves: ", s.leaves, ", depth: ", s.depth,
+         ", SAH cost: ", s.sah_cost);
+   print("[Kd-tree] node data: ", s.node_bytes / MB, " MB, leaf data: ", s.leaf_bytes / MB,
+         " MB, triangle test: ", triangleTestName(m_TriangleTest));
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+
+#include "Raytracer.h"
+#include "Accel/Accelerator.h"
+#include "Accel/BVH.h"
+
+/*
+ * Nodes are stored in depth-first order like BVHNode: the child below the
+ * split directly follows its parent. `data` holds the split axis, or
+ * KD_LEAF, in its low two bits and the index of the child above the split,
+ * or the leaf's triangle count, in the rest.
+ */
+struct KdNode
+{
+   union
+   {
+      float split; // inner nodes
+      uint first;  // leaves, first entry in KdTree::blocks
+   };
+   uint data;
+};
+
+static constexpr uint KD_LEAF = 3;
+
+struct KdTreeStats
+{
+   size_t nodes;
+   size_t leaves;
+   size_t references; // triangles in leaves, counting every leaf they straddle
+   int depth;
+   real sah_cost;
+   float build_ms;
+   size_t node_bytes;
+   size_t leaf_bytes;
+};
+
+/*
+ * SAH kd-tree over the world space triangles of all instances, the
+ * alternative to TopLevelBVH. Splits are binned over the voxel and a
+ * triangle is referenced from every leaf its clipped box reaches. Rays walk
+ * the leaves front to back with a short stack: when pushed entries have
+ * been dropped, the walk restarts past the last leaf from the push-down
+ * node, the deepest node whose voxel still holds the rest of the ray.
+ */
+struct KdTree : Accelerator
+{
+   std::vector<KdNode> nodes;
+   std::vector<TriangleBlock> blocks;
+   std::vector<TransformBlock> transform_blocks; // leaves for TriangleTest::BaldwinWeber
+   std::vector<VertexBlock> vertex_blocks; // leaves for TriangleTest::Watertight
+
+   void build(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+              TriangleTest test = TriangleTest::MollerTrumbore);
+   size_t closestHit(const Ray &ray, real *ct) const override;
+   void closestHitPacket(RayPacket *packet) const override;
+   bool occluded(const Ray &ray, real tmax, size_t skip = -1) const override;
+   TriangleTest triangleTest() const override;
+   KdTreeStats stats() const;
+   void report() const;
+
+private:
+   template<class Leaf>
+   void traverse(const Ray &ray, real tmax, const real *limit, Leaf leaf) const;
+   void intersectLeaf(const Ray &ray, const KdNode &node, real *ct, size_t *ck) const;
+   bool occludedLeaf(const Ray &ray, const KdNode &node, real tmax, size_t skip) const;
+
+   AABB m_Bounds;
+   std::vector<uint> m_InstanceFirst; // first world triangle of every instance
+   const TriangleKernel *m_Kernel = nullptr;
+   TriangleTest m_TriangleTest = TriangleTest::MollerTrumbore;
+   size_t m_TriangleCount = 0;
+   float m_BuildMs = 0;
+};
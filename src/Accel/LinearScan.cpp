@@ -0,0 +1,105 @@
+#include "LinearScan.h"
+
+#include <limits>
+
+#include "RayStats.h"
+#include "Utils/Timer.h"
+
+void LinearScan::build(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+                       TriangleTest test)
+{
+   Timer timer("Linear Scan Build");
+   m_Instances = instances;
+   m_Kernel = &triangleKernel();
+   m_TriangleTest = test;
+   blocks.assign(meshes.size(), {});
+   transform_blocks.assign(meshes.size(), {});
+   vertex_blocks.assign(meshes.size(), {});
+   for (size_t m = 0; m < meshes.size(); ++m)
+   {
+      packTriangleBlocks(meshes[m], nullptr, meshes[m].triangleCount(), &blocks[m]);
+      if (test == TriangleTest::BaldwinWeber)
+         packTransformBlocks(blocks[m], &transform_blocks[m]);
+      else if (test == TriangleTest::Watertight)
+         packVertexBlocks(meshes[m], blocks[m], &vertex_blocks[m]);
+   }
+   m_BuildMs = timer.elapsed();
+}
+
+size_t LinearScan::closestHit(const Ray &ray, real *ct) const
+{
+   size_t ck = -1;
+   *ct = std::numeric_limits<real>::infinity();
+   for (uint i = 0; i < m_Instances.size(); ++i)
+   {
+      uint m = m_Instances[i].mesh;
+      Ray oray = m_Instances[i].toObject(ray);
+      real t = *ct;
+      size_t k = -1;
+      switch (m_TriangleTest)
+      {
+         case TriangleTest::MollerTrumbore:
+            for (const TriangleBlock &block : blocks[m])
+               m_Kernel->closestHit(oray, block, &t, &k);
+            break;
+         case TriangleTest::BaldwinWeber:
+            for (const TransformBlock &block : transform_blocks[m])
+               m_Kernel->closestHitTransform(oray, block, &t, &k);
+            break;
+         case TriangleTest::Watertight:
+            for (const VertexBlock &block : vertex_blocks[m])
+               m_Kernel->closestHitWatertight(oray, block, &t, &k);
+            break;
+      }
+      RAY_STAT(triangle_tests, blocks[m].size() * TRI_BLOCK_SIZE);
+      if (k != static_cast<size_t>(-1) && t < *ct)
+         *ct = t, ck = hitId(i, hitTriangle(k));
+   }
+   return ck;
+}
+
+void LinearScan::closestHitPacket(RayPacket *packet) const
+{
+   for (int i = 0; i < packet->count; ++i)
+      packet->k[i] = closestHit(Ray { .o = packet->o, .d = packet->d[i] }, &packet->t[i]);
+}
+
+bool LinearScan::occluded(const Ray &ray, real tmax, size_t skip) const
+{
+   for (uint i = 0; i < m_Instances.size(); ++i)
+   {
+      uint m = m_Instances[i].mesh;
+      Ray oray = m_Instances[i].toObject(ray);
+      size_t local = hitInstance(skip) == i ? hitTriangle(skip) : static_cast<size_t>(-1);
+      for (size_t b = 0; b < blocks[m].size(); ++b)
+      {
+         RAY_STAT(triangle_tests, TRI_BLOCK_SIZE);
+         bool hit = false;
+         switch (m_TriangleTest)
+         {
+            case TriangleTest::MollerTrumbore:
+               hit = m_Kernel->anyHit(oray, blocks[m][b], tmax, local);
+               break;
+            case TriangleTest::BaldwinWeber:
+               hit = m_Kernel->anyHitTransform(oray, transform_blocks[m][b], tmax, local);
+               break;
+            case TriangleTest::Watertight:
+               hit = m_Kernel->anyHitWatertight(oray, vertex_blocks[m][b], tmax);
+               break;
+         }
+         if (hit)
+            return true;
+      }
+   }
+   return false;
+}
+
+TriangleTest LinearScan::triangleTest() const
+{
+   return m_TriangleTest;
+}
+
+float LinearScan::buildMs() const
+{
+   return m_BuildMs;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+
+#include "Raytracer.h"
+#include "Accel/Accelerator.h"
+
+/*
+ * Tests every triangle of every instance, in id order: the reference the
+ * other structures are checked against. Rays are moved into object space
+ * per instance like in TopLevelBVH.
+ */
+struct LinearScan : Accelerator
+{
+   /* Per mesh, all its triangles in order. */
+   std::vector<std::vector<TriangleBlock>> blocks;
+   std::vector<std::vector<TransformBlock>> transform_blocks; // for TriangleTest::BaldwinWeber
+   std::vector<std::vector<VertexBlock>> vertex_blocks; // for TriangleTest::Watertight
+
+   void build(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+              TriangleTest test = TriangleTest::MollerTrumbore);
+   size_t closestHit(const Ray &ray, real *ct) const override;
+   void closestHitPacket(RayPacket *packet) const override;
+   bool occluded(const Ray &ray, real tmax, size_t skip = -1) const override;
+   TriangleTest triangleTest() const override;
+   float buildMs() const;
+
+private:
+   std::vector<Instance> m_Instances;
+   const TriangleKernel *m_Kernel = nullptr;
+   TriangleTest m_TriangleTest = TriangleTest::MollerTrumbore;
+   float m_BuildMs = 0;
+};
@@ -0,0 +1,209 @@
+#include "NodeKernel.h"
+
+#include <limits>
+
+#include "Intersection.h"
+#include "Utils/Log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static int intersectScalar(const vec3 &o, const vec3 &inv_d, const WideBVHNode &node,
+                           real tmax, float *t);
+static int intersectQuantizedScalar(const vec3 &o, const vec3 &inv_d,
+                                    const QuantizedBVHNode &node, real tmax, float *t);
+
+int intersectScalar(const vec3 &o, const vec3 &inv_d, const WideBVHNode &node, real tmax,
+                    float *t)
+{
+   int mask = 0;
+   for (uint i = 0; i < node.size; ++i)
+   {
+      vec3 bmin(node.min_x[i], node.min_y[i], node.min_z[i]);
+      vec3 bmax(node.max_x[i], node.max_y[i], node.max_z[i]);
+      t[i] = rayBoxIntersection(o, inv_d, bmin, bmax, tmax);
+      if (t[i] != std::numeric_limits<real>::infinity())
+         mask |= 1 << i;
+   }
+   return mask;
+}
+
+/* Decodes each lane exactly as the SIMD kernels do: q * scale is exact, so
+ * the sum is the only rounding. */
+int intersectQuantizedScalar(const vec3 &o, const vec3 &inv_d, const QuantizedBVHNode &node,
+                             real tmax, float *t)
+{
+   vec3 scale(quantizedScale(node.exponent[0]), quantizedScale(node.exponent[1]),
+              quantizedScale(node.exponent[2]));
+   int mask = 0;
+   for (int used = usedLanes(node); used; used &= used - 1)
+   {
+      int i = __builtin_ctz(used);
+      vec3 bmin = node.origin + vec3(node.lo_x[i], node.lo_y[i], node.lo_z[i]) * scale;
+      vec3 bmax = node.origin + vec3(node.hi_x[i], node.hi_y[i], node.hi_z[i]) * scale;
+      t[i] = rayBoxIntersection(o, inv_d, bmin, bmax, tmax);
+      if (t[i] != std::numeric_limits<real>::infinity())
+         mask |= 1 << i;
+   }
+   return mask;
+}
+
+#ifdef HAS_X86_SIMD
+
+/*
+ * The slab test of rayBoxIntersection. glm::min(a, b) is `b < a ? b : a` and
+ * glm::max(a, b) is `a < b ? b : a`, which are _mm_min_ps(b, a) and
+ * _mm_max_ps(b, a) including their NaN behaviour, hence the operand order.
+ */
+static inline int slabSSE(const vec3 &o, const vec3 &inv_d, __m128 min_x, __m128 min_y,
+                          __m128 min_z, __m128 max_x, __m128 max_y, __m128 max_z, real tmax,
+                          float *t)
+{
+   __m128 ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y), oz = _mm_set1_ps(o.z);
+   __m128 ix = _mm_set1_ps(inv_d.x), iy = _mm_set1_ps(inv_d.y), iz = _mm_set1_ps(inv_d.z);
+   __m128 t0x = _mm_mul_ps(_mm_sub_ps(min_x, ox), ix);
+   __m128 t0y = _mm_mul_ps(_mm_sub_ps(min_y, oy), iy);
+   __m128 t0z = _mm_mul_ps(_mm_sub_ps(min_z, oz), iz);
+   __m128 t1x = _mm_mul_ps(_mm_sub_ps(max_x, ox), ix);
+   __m128 t1y = _mm_mul_ps(_mm_sub_ps(max_y, oy), iy);
+   __m128 t1z = _mm_mul_ps(_mm_sub_ps(max_z, oz), iz);
+   __m128 tnx = _mm_min_ps(t1x, t0x), tny = _mm_min_ps(t1y, t0y), tnz = _mm_min_ps(t1z, t0z);
+   __m128 tfx = _mm_max_ps(t1x, t0x), tfy = _mm_max_ps(t1y, t0y), tfz = _mm_max_ps(t1z, t0z);
+   __m128 enter = _mm_max_ps(_mm_max_ps(_mm_setzero_ps(), tnz), _mm_max_ps(tny, tnx));
+   __m128 far = _mm_mul_ps(_mm_min_ps(tfz, _mm_min_ps(tfy, tfx)), _mm_set1_ps(BOX_EXIT_SCALE));
+   __m128 exit = _mm_min_ps(_mm_set1_ps(tmax), far);
+   _mm_storeu_ps(t, enter);
+   return _mm_movemask_ps(_mm_cmple_ps(enter, exit));
+}
+
+static inline int intersectHalfSSE(const vec3 &o, const vec3 &inv_d, const WideBVHNode &node,
+                                   real tmax, int h, float *t)
+{
+   return slabSSE(o, inv_d, _mm_load_ps(node.min_x + h), _mm_load_ps(node.min_y + h),
+                  _mm_load_ps(node.min_z + h), _mm_load_ps(node.max_x + h),
+                  _mm_load_ps(node.max_y + h), _mm_load_ps(node.max_z + h), tmax, t + h) << h;
+}
+
+static int intersectSSE(const vec3 &o, const vec3 &inv_d, const WideBVHNode &node, real tmax,
+                        float *t)
+{
+   int mask = intersectHalfSSE(o, inv_d, node, tmax, 0, t);
+   if (node.size > 4)
+      mask |= intersectHalfSSE(o, inv_d, node, tmax, 4, t);
+   return mask & ((1 << node.size) - 1);
+}
+
+/* Lanes of q widened to floats, low (h = 0) or high (h = 4) half. */
+static inline __m128 laneFloatsSSE(const uint8_t *q, int h)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(q)), zero);
+   __m128i dwords = h ? _mm_unpackhi_epi16(words, zero) : _mm_unpacklo_epi16(words, zero);
+   return _mm_cvtepi32_ps(dwords);
+}
+
+static inline __m128 decodeSSE(const uint8_t *q, int h, real origin, real scale)
+{
+   return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(laneFloatsSSE(q, h), _mm_set1_ps(scale)));
+}
+
+static int intersectQuantizedSSE(const vec3 &o, const vec3 &inv_d, const QuantizedBVHNode &node,
+                                 real tmax, float *t)
+{
+   vec3 scale(quantizedScale(node.exponent[0]), quantizedScale(node.exponent[1]),
+              quantizedScale(node.exponent[2]));
+   const vec3 &p = node.origin;
+   int used = usedLanes(node);
+   int mask = 0;
+   for (int h = 0; h < WIDE_BVH_WIDTH && (used >> h); h += 4)
+      mask |= slabSSE(o, inv_d, decodeSSE(node.lo_x, h, p.x, scale.x),
+                      decodeSSE(node.lo_y, h, p.y, scale.y), decodeSSE(node.lo_z, h, p.z, scale.z),
+                      decodeSSE(node.hi_x, h, p.x, scale.x), decodeSSE(node.hi_y, h, p.y, scale.y),
+                      decodeSSE(node.hi_z, h, p.z, scale.z), tmax, t + h) << h;
+   return mask & used;
+}
+
+__attribute__((target("avx2")))
+static inline int slabAVX2(const vec3 &o, const vec3 &inv_d, __m256 min_x, __m256 min_y,
+                           __m256 min_z, __m256 max_x, __m256 max_y, __m256 max_z, real tmax,
+                           float *t)
+{
+   __m256 ox = _mm256_set1_ps(o.x), oy = _mm256_set1_ps(o.y), oz = _mm256_set1_ps(o.z);
+   __m256 ix = _mm256_set1_ps(inv_d.x), iy = _mm256_set1_ps(inv_d.y), iz = _mm256_set1_ps(inv_d.z);
+   __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(min_x, ox), ix);
+   __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(min_y, oy), iy);
+   __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(min_z, oz), iz);
+   __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(max_x, ox), ix);
+   __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(max_y, oy), iy);
+   __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(max_z, oz), iz);
+   __m256 tnx = _mm256_min_ps(t1x, t0x), tny = _mm256_min_ps(t1y, t0y);
+   __m256 tnz = _mm256_min_ps(t1z, t0z);
+   __m256 tfx = _mm256_max_ps(t1x, t0x), tfy = _mm256_max_ps(t1y, t0y);
+   __m256 tfz = _mm256_max_ps(t1z, t0z);
+   __m256 enter = _mm256_max_ps(_mm256_max_ps(_mm256_setzero_ps(), tnz),
+                                _mm256_max_ps(tny, tnx));
+   __m256 far = _mm256_mul_ps(_mm256_min_ps(tfz, _mm256_min_ps(tfy, tfx)),
+                              _mm256_set1_ps(BOX_EXIT_SCALE));
+   __m256 exit = _mm256_min_ps(_mm256_set1_ps(tmax), far);
+   _mm256_storeu_ps(t, enter);
+   return _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+}
+
+__attribute__((target("avx2")))
+static int intersectAVX2(const vec3 &o, const vec3 &inv_d, const WideBVHNode &node, real tmax,
+                         float *t)
+{
+   return slabAVX2(o, inv_d, _mm256_load_ps(node.min_x), _mm256_load_ps(node.min_y),
+                   _mm256_load_ps(node.min_z), _mm256_load_ps(node.max_x),
+                   _mm256_load_ps(node.max_y), _mm256_load_ps(node.max_z), tmax, t) &
+          ((1 << node.size) - 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 decodeAVX2(const uint8_t *q, real origin, real scale)
+{
+   __m256i lanes = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(q)));
+   return _mm256_add_ps(_mm256_set1_ps(origin),
+                        _mm256_mul_ps(_mm256_cvtepi32_ps(lanes), _mm256_set1_ps(scale)));
+}
+
+__attribute__((target("avx2")))
+static int intersectQuantizedAVX2(const vec3 &o, const vec3 &inv_d,
+                                  const QuantizedBVHNode &node, real tmax, float *t)
+{
+   vec3 scale(quantizedScale(node.exponent[0]), quantizedScale(node.exponent[1]),
+              quantizedScale(node.exponent[2]));
+   const vec3 &p = node.origin;
+   return slabAVX2(o, inv_d, decodeAVX2(node.lo_x, p.x, scale.x),
+                   decodeAVX2(node.lo_y, p.y, scale.y), decodeAVX2(node.lo_z, p.z, scale.z),
+                   decodeAVX2(node.hi_x, p.x, scale.x), decodeAVX2(node.hi_y, p.y, scale.y),
+                   decodeAVX2(node.hi_z, p.z, scale.z), tmax, t) &
+          usedLanes(node);
+}
+
+#endif
+
+static const NodeKernel SCALAR_KERNEL = { "scalar", intersectScalar, intersectQuantizedScalar };
+#ifdef HAS_X86_SIMD
+static const NodeKernel SSE_KERNEL = { "SSE", intersectSSE, intersectQuantizedSSE };
+static const NodeKernel AVX2_KERNEL = { "AVX2", intersectAVX2, intersectQuantizedAVX2 };
+#endif
+
+const NodeKernel &nodeKernel()
+{
+   static const NodeKernel &kernel = []() -> const NodeKernel & {
+      const NodeKernel *selected = &SCALAR_KERNEL;
+#ifdef HAS_X86_SIMD
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2"))
+         selected = &AVX2_KERNEL;
+      else if (__builtin_cpu_supports("sse2"))
+         selected = &SSE_KERNEL;
+#endif
+      print("[Node Kernel] ", selected->name);
+      return *selected;
+   }();
+   return kernel;
+}
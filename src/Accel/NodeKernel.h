@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Accel/BVH.h"
+
+/*
+ * Ray versus all children of a WideBVHNode or QuantizedBVHNode, picked at
+ * runtime like the triangle kernels. Every implementation returns the same
+ * entry distances as rayBoxIntersection on the (decoded) child boxes, so
+ * wide traversal culls exactly like binary.
+ */
+struct NodeKernel
+{
+   const char *name;
+   /* Returns the mask of children entered before tmax and stores their entry
+    * distances in t. */
+   int (*intersect)(const vec3 &o, const vec3 &inv_d, const WideBVHNode &node, real tmax,
+                    float *t);
+   int (*intersectQuantized)(const vec3 &o, const vec3 &inv_d, const QuantizedBVHNode &node,
+                             real tmax, float *t);
+};
+
+/* Grid step of a QuantizedBVHNode axis. */
+inline real quantizedScale(int8_t exponent)
+{
+   return glm::intBitsToFloat((exponent + 127) << 23);
+}
+
+/* Lanes of the node that hold a child. */
+inline int usedLanes(const WideBVHNode &node)
+{
+   return (1 << node.size) - 1;
+}
+
+inline int usedLanes(const QuantizedBVHNode &node)
+{
+   int used = node.inner_mask;
+   for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+      if (node.count[i])
+         used |= 1 << i;
+   return used;
+}
+
+const NodeKernel &nodeKernel();
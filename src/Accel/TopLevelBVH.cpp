@@ -0,0 +1,325 @@
+#include "TopLevelBVH.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <limits>
+
+#include "Intersection.h"
+#include "RayStats.h"
+#include "Utils/Binary.h"
+#include "Utils/Log.h"
+#include "Utils/Timer.h"
+
+static constexpr int MAX_DEPTH = 64;
+static constexpr uint MAX_LEAF_INSTANCES = 2;
+static constexpr real inf = std::numeric_limits<real>::infinity();
+
+static AABB instanceBounds(const BVH &bvh, const Instance &inst);
+static uint buildRecursive(const std::vector<AABB> &boxes, std::vector<uint> *ids, uint begin,
+                           uint end, int depth, std::vector<BVHNode> *nodes);
+
+void TopLevelBVH::build(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+                        const BVHBuildOptions &opts)
+{
+   mesh_bvhs.clear();
+   mesh_bvhs.resize(meshes.size());
+   for (size_t m = 0; m < meshes.size(); ++m)
+      mesh_bvhs[m].build(meshes[m], opts);
+   buildTopLevel(instances);
+   report();
+}
+
+/* World bounds of the mesh BVH's root box corners, padded by a few ulps for
+ * the rounding of the transform. */
+AABB instanceBounds(const BVH &bvh, const Instance &inst)
+{
+   const BVHNode &root = bvh.nodes[0];
+   if (inst.identity)
+      return AABB { .min = root.min, .max = root.max };
+   AABB box { .min = vec3(inf), .max = vec3(-inf) };
+   for (int c = 0; c < 8; ++c)
+   {
+      vec3 p(c & 1 ? root.max.x : root.min.x, c & 2 ? root.max.y : root.min.y,
+             c & 4 ? root.max.z : root.min.z);
+      box.grow(vec3(inst.to_world * glm::vec4(p, 1)));
+   }
+   vec3 pad = 4 * FLT_EPSILON * glm::max(glm::abs(box.min), glm::abs(box.max));
+   box.min -= pad;
+   box.max += pad;
+   return box;
+}
+
+/*
+ * The top level is small next to the meshes, so it is split at the centroid
+ * median of the longest axis rather than by SAH. Same layout as BVH::nodes,
+ * with leaves holding ranges of instance_ids.
+ */
+void TopLevelBVH::buildTopLevel(const std::vector<Instance> &instances)
+{
+   this->instances = instances;
+   nodes.clear();
+   instance_ids.clear();
+
+   std::vector<AABB> boxes(instances.size());
+   for (uint i = 0; i < instances.size(); ++i)
+   {
+      const BVH &bvh = mesh_bvhs[instances[i].mesh];
+      if (bvh.nodes.empty())
+         continue;
+      boxes[i] = instanceBounds(bvh, instances[i]);
+      instance_ids.push_back(i);
+   }
+   if (!instance_ids.empty())
+      buildRecursive(boxes, &instance_ids, 0, static_cast<uint>(instance_ids.size()), 0, &nodes);
+}
+
+uint buildRecursive(const std::vector<AABB> &boxes, std::vector<uint> *ids, uint begin,
+                    uint end, int depth, std::vector<BVHNode> *nodes)
+{
+   AABB bounds { .min = vec3(inf), .max = vec3(-inf) };
+   AABB cbounds = bounds;
+   for (uint i = begin; i < end; ++i)
+   {
+      const AABB &box = boxes[(*ids)[i]];
+      bounds.grow(box);
+      cbounds.grow((box.min + box.max) * real(0.5));
+   }
+
+   uint idx = static_cast<uint>(nodes->size());
+   nodes->push_back(BVHNode { .min = bounds.min, .offset = begin, .max = bounds.max,
+                              .count = end - begin });
+   vec3 extent = cbounds.max - cbounds.min;
+   int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+   if (end - begin <= MAX_LEAF_INSTANCES || depth == MAX_DEPTH - 1 || extent[axis] <= 0)
+      return idx;
+
+   uint mid = begin + (end - begin) / 2;
+   std::nth_element(ids->begin() + begin, ids->begin() + mid, ids->begin() + end,
+                    [&](uint a, uint b) {
+                       return boxes[a].min[axis] + boxes[a].max[axis] <
+                              boxes[b].min[axis] + boxes[b].max[axis];
+                    });
+   buildRecursive(boxes, ids, begin, mid, depth + 1, nodes);
+   uint right = buildRecursive(boxes, ids, mid, end, depth + 1, nodes);
+   (*nodes)[idx].offset = right;
+   (*nodes)[idx].count = 0;
+   return idx;
+}
+
+void TopLevelBVH::collapse(int width, bool quantize)
+{
+   for (BVH &bvh : mesh_bvhs)
+      bvh.collapse(width, quantize);
+}
+
+void TopLevelBVH::useTriangleTest(const std::vector<Mesh> &meshes, TriangleTest test)
+{
+   for (size_t m = 0; m < mesh_bvhs.size(); ++m)
+      mesh_bvhs[m].useTriangleTest(meshes[m], test);
+}
+
+/* Refits are not reported one by one; a degraded mesh BVH reports its rebuild. */
+float TopLevelBVH::update(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+                          const std::vector<uint> &moved, const BVHBuildOptions &opts)
+{
+   Timer timer("BVH Update");
+   for (uint m : moved)
+      mesh_bvhs[m].update(meshes[m], opts);
+   buildTopLevel(instances);
+   return timer.elapsed();
+}
+
+/* A lone untransformed instance, the usual OBJ scene: rays go straight to its BVH
+ * and the hit ids are its triangle ids. */
+bool TopLevelBVH::single() const
+{
+   return instance_ids.size() == 1 && instances[instance_ids[0]].identity &&
+          instance_ids[0] == 0;
+}
+
+void TopLevelBVH::closerHitInstance(const Ray &ray, uint id, real *ct, size_t *ck) const
+{
+   const Instance &inst = instances[id];
+   real t = *ct;
+   size_t k = -1;
+   mesh_bvhs[inst.mesh].closerHit(inst.toObject(ray), &t, &k);
+   if (k == static_cast<size_t>(-1))
+      return;
+   size_t hk = hitId(id, hitTriangle(k));
+   if (t < *ct || hk < *ck)
+      *ct = t, *ck = hk;
+}
+
+size_t TopLevelBVH::closestHit(const Ray &ray, real *ct) const
+{
+   struct StackEntry
+   {
+      uint node;
+      real t;
+   };
+
+   size_t ck = -1;
+   *ct = inf;
+   if (single())
+   {
+      mesh_bvhs[instances[0].mesh].closerHit(ray, ct, &ck);
+      return ck;
+   }
+   if (nodes.empty())
+      return ck;
+
+   vec3 inv_d = real(1) / ray.d;
+   StackEntry stack[MAX_DEPTH];
+   int sp = 0;
+   real troot = rayBoxIntersection(ray.o, inv_d, nodes[0].min, nodes[0].max, inf);
+   if (troot == inf)
+      return ck;
+   stack[sp++] = StackEntry { 0, troot };
+
+   while (sp > 0)
+   {
+      StackEntry entry = stack[--sp];
+      if (entry.t > *ct)
+         continue;
+      uint idx = entry.node;
+      for (;;)
+      {
+         const BVHNode &node = nodes[idx];
+         RAY_STAT(node_visits, 1);
+         if (node.count)
+         {
+            for (uint i = node.offset; i < node.offset + node.count; ++i)
+               closerHitInstance(ray, instance_ids[i], ct, &ck);
+            break;
+         }
+
+         uint l = idx + 1, r = node.offset;
+         real tl = rayBoxIntersection(ray.o, inv_d, nodes[l].min, nodes[l].max, *ct);
+         real tr = rayBoxIntersection(ray.o, inv_d, nodes[r].min, nodes[r].max, *ct);
+         if (tl > tr)
+            std::swap(l, r), std::swap(tl, tr);
+         if (tl == inf)
+            break;
+         if (tr != inf)
+            stack[sp++] = StackEntry { r, tr };
+         idx = l;
+      }
+   }
+   return ck;
+}
+
+/* Instance transforms break up the shared origin, so only a single instance
+ * traces packets; otherwise the rays go one by one. */
+void TopLevelBVH::closestHitPacket(RayPacket *packet) const
+{
+   if (single())
+   {
+      mesh_bvhs[instances[0].mesh].closestHitPacket(packet);
+      return;
+   }
+   for (int i = 0; i < packet->count; ++i)
+      packet->k[i] = closestHit(Ray { .o = packet->o, .d = packet->d[i] }, &packet->t[i]);
+}
+
+bool TopLevelBVH::occluded(const Ray &ray, real tmax, size_t skip) const
+{
+   if (single())
+      return mesh_bvhs[instances[0].mesh].occluded(ray, tmax, skip);
+   if (nodes.empty())
+      return false;
+
+   vec3 inv_d = real(1) / ray.d;
+   uint stack[MAX_DEPTH];
+   int sp = 0;
+   stack[sp++] = 0;
+
+   while (sp > 0)
+   {
+      const BVHNode &node = nodes[stack[--sp]];
+      RAY_STAT(node_visits, 1);
+      if (rayBoxIntersection(ray.o, inv_d, node.min, node.max, tmax) == inf)
+         continue;
+      if (!node.count)
+      {
+         stack[sp++] = node.offset;
+         stack[sp++] = static_cast<uint>(&node - nodes.data()) + 1;
+         continue;
+      }
+      for (uint i = node.offset; i < node.offset + node.count; ++i)
+      {
+         uint id = instance_ids[i];
+         const Instance &inst = instances[id];
+         size_t local = hitInstance(skip) == id ? hitTriangle(skip) : static_cast<size_t>(-1);
+         if (mesh_bvhs[inst.mesh].occluded(inst.toObject(ray), tmax, local))
+            return true;
+      }
+   }
+   return false;
+}
+
+bool TopLevelBVH::builtWith(const BVHBuildOptions &opts) const
+{
+   for (const BVH &bvh : mesh_bvhs)
+      if (!bvh.builtWith(opts))
+         return false;
+   return true;
+}
+
+TriangleTest TopLevelBVH::triangleTest() const
+{
+   return mesh_bvhs.empty() ? TriangleTest::MollerTrumbore : mesh_bvhs[0].triangleTest();
+}
+
+BVHStats TopLevelBVH::stats() const
+{
+   BVHStats total {};
+   for (const BVH &bvh : mesh_bvhs)
+   {
+      BVHStats s = bvh.stats();
+      total.nodes += s.nodes;
+      total.leaves += s.leaves;
+      total.depth = std::max(total.depth, s.depth);
+      total.sah_cost += s.sah_cost;
+      total.build_ms += s.build_ms;
+   }
+   return total;
+}
+
+void TopLevelBVH::report() const
+{
+   if (single())
+      return;
+   size_t placed = 0, stored = 0;
+   for (uint id : instance_ids)
+      placed += mesh_bvhs[instances[id].mesh].triangleCount();
+   for (const BVH &bvh : mesh_bvhs)
+      stored += bvh.triangleCount();
+   print("[Top Level] instances: ", instances.size(), " of ", mesh_bvhs.size(),
+         " meshes, nodes: ", nodes.size(), ", triangles: ", placed, " placed, ", stored,
+         " stored");
+}
+
+/* Only the mesh BVHs are stored; the top level is rebuilt from the instances. */
+void TopLevelBVH::write(BinaryWriter *out) const
+{
+   out->write<uint64_t>(mesh_bvhs.size());
+   for (const BVH &bvh : mesh_bvhs)
+      bvh.write(out);
+}
+
+bool TopLevelBVH::read(BinaryReader *in)
+{
+   uint64_t count;
+   if (!in->read(&count) || count > UINT32_MAX)
+      return false;
+   std::vector<BVH> bvhs(count);
+   for (BVH &bvh : bvhs)
+      if (!bvh.read(in))
+         return false;
+   mesh_bvhs = std::move(bvhs);
+   instances.clear();
+   nodes.clear();
+   instance_ids.clear();
+   return true;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+
+#include "Raytracer.h"
+#include "Accel/Accelerator.h"
+#include "Accel/BVH.h"
+
+/*
+ * Two-level acceleration structure: a BVH per mesh over its object space
+ * triangles, and a binary BVH over the world bounds of the instances on top.
+ * Rays are moved into object space per instance, so a mesh placed by many
+ * nodes is stored and built once. Hit ids are hitId(instance, triangle).
+ */
+struct TopLevelBVH : Accelerator
+{
+   std::vector<BVH> mesh_bvhs; // bottom level, one per mesh
+   std::vector<Instance> instances;
+   std::vector<BVHNode> nodes; // top level, leaves index instance_ids
+   std::vector<uint> instance_ids;
+
+   void build(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+              const BVHBuildOptions &opts = {});
+   /* Rebuilds the top level over instances of the current mesh BVHs. */
+   void buildTopLevel(const std::vector<Instance> &instances);
+   /* Per frame of an animation: updates the BVHs of the meshes whose vertices
+    * moved (see BVH::update) and rebuilds the top level for the instances.
+    * Returns the time it took. */
+   float update(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+               const std::vector<uint> &moved, const BVHBuildOptions &opts);
+   void collapse(int width, bool quantize = false);
+   void useTriangleTest(const std::vector<Mesh> &meshes, TriangleTest test);
+   size_t closestHit(const Ray &ray, real *ct) const override;
+   void closestHitPacket(RayPacket *packet) const override;
+   bool occluded(const Ray &ray, real tmax, size_t skip = -1) const override;
+   bool builtWith(const BVHBuildOptions &opts) const;
+   TriangleTest triangleTest() const override;
+   /* Totals over the mesh BVHs, depth of the deepest one. */
+   BVHStats stats() const;
+   void report() const;
+   void write(BinaryWriter *out) const;
+   bool read(BinaryReader *in);
+
+private:
+   bool single() const;
+   void closerHitInstance(const Ray &ray, uint id, real *ct, size_t *ck) const;
+};
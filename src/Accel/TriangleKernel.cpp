@@ -0,0 +1,737 @@
+#include "TriangleKernel.h"
+
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include "Intersection.h"
+#include "Utils/Log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static_assert(sizeof(real) == sizeof(float), "SIMD kernels assume single precision");
+
+static void closestHitScalar(const Ray &ray, const TriangleBlock &block, real *ct, size_t *ck);
+static bool anyHitScalar(const Ray &ray, const TriangleBlock &block, real tmax, size_t skip);
+static void closestHitTransformScalar(const Ray &ray, const TransformBlock &block, real *ct,
+                                      size_t *ck);
+static bool anyHitTransformScalar(const Ray &ray, const TransformBlock &block, real tmax,
+                                  size_t skip);
+static void closestHitWatertightScalar(const Ray &ray, const VertexBlock &block, real *ct,
+                                       size_t *ck);
+static bool anyHitWatertightScalar(const Ray &ray, const VertexBlock &block, real tmax);
+static float epsilonFloat();
+
+/* Smallest float not below EPS, so `t >= eps` matches the scalar `t > EPS` exactly. */
+float epsilonFloat()
+{
+   float eps = static_cast<float>(EPS);
+   if (static_cast<double>(eps) <= EPS)
+      eps = std::nextafter(eps, std::numeric_limits<float>::infinity());
+   return eps;
+}
+
+static const float EPS_F = epsilonFloat();
+
+static inline Triangle laneTriangle(const TriangleBlock &block, int i)
+{
+   Triangle tri;
+   tri.bar.P = vec3(block.px[i], block.py[i], block.pz[i]);
+   tri.bar.u = vec3(block.ux[i], block.uy[i], block.uz[i]);
+   tri.bar.v = vec3(block.vx[i], block.vy[i], block.vz[i]);
+   return tri;
+}
+
+static inline void pickClosest(const float *t, int mask, const uint *ids, real *ct, size_t *ck)
+{
+   for (; mask; mask &= mask - 1)
+   {
+      int i = __builtin_ctz(mask);
+      size_t k = ids[i];
+      if (t[i] < *ct || (t[i] == *ct && k < *ck))
+         *ct = t[i], *ck = k;
+   }
+}
+
+void closestHitScalar(const Ray &ray, const TriangleBlock &block, real *ct, size_t *ck)
+{
+   for (int i = 0; i < TRI_BLOCK_SIZE; ++i)
+   {
+      real t;
+      size_t k = block.ids[i];
+      if (rayTriangleIntersection(ray, laneTriangle(block, i), &t) && t > EPS &&
+          (t < *ct || (t == *ct && k < *ck)))
+         *ct = t, *ck = k;
+   }
+}
+
+bool anyHitScalar(const Ray &ray, const TriangleBlock &block, real tmax, size_t skip)
+{
+   for (int i = 0; i < TRI_BLOCK_SIZE; ++i)
+   {
+      real t;
+      if (block.ids[i] != skip && rayTriangleIntersection(ray, laneTriangle(block, i), &t) &&
+          t > EPS && t < tmax)
+         return true;
+   }
+   return false;
+}
+
+/*
+ * Baldwin–Weber: the ray is moved into the triangle's barycentric frame,
+ * where it hits the plane at -oz / dz and u and v follow from there. With
+ * TEST_CULL only rays entering the front side (dz < 0) are hit.
+ */
+static inline bool transformLaneHit(const Ray &ray, const TransformBlock &block, int i, real *t)
+{
+   auto row = [&](int r, const vec3 &p, real w) {
+      return block.m[r][0][i] * p.x + block.m[r][1][i] * p.y + block.m[r][2][i] * p.z + w;
+   };
+   real dz = row(2, ray.d, 0);
+#ifdef TEST_CULL
+   if (!(dz < 0))
+      return false;
+#else
+   if (dz == 0)
+      return false;
+#endif
+   real tt = -row(2, ray.o, block.m[2][3][i]) / dz;
+   real u = row(0, ray.o, block.m[0][3][i]) + tt * row(0, ray.d, 0);
+   real v = row(1, ray.o, block.m[1][3][i]) + tt * row(1, ray.d, 0);
+   if (u < 0 || v < 0 || u + v > 1)
+      return false;
+   *t = tt;
+   return true;
+}
+
+void closestHitTransformScalar(const Ray &ray, const TransformBlock &block, real *ct, size_t *ck)
+{
+   for (int i = 0; i < TRI_BLOCK_SIZE; ++i)
+   {
+      real t;
+      size_t k = block.ids[i];
+      if (transformLaneHit(ray, block, i, &t) && t > EPS && (t < *ct || (t == *ct && k < *ck)))
+         *ct = t, *ck = k;
+   }
+}
+
+bool anyHitTransformScalar(const Ray &ray, const TransformBlock &block, real tmax, size_t skip)
+{
+   for (int i = 0; i < TRI_BLOCK_SIZE; ++i)
+   {
+      real t;
+      if (block.ids[i] != skip && transformLaneHit(ray, block, i, &t) && t > EPS && t < tmax)
+         return true;
+   }
+   return false;
+}
+
+/*
+ * Per-ray part of the watertight test (Woop, Benthin and Wald): the axes
+ * permuted so the direction is largest along kz, and the shear taking the
+ * direction to +z. Swapping kx and ky for a negative direction keeps the
+ * winding, so front faces still have all edge functions non-negative.
+ */
+struct ShearedRay
+{
+   int kx, ky, kz;
+   real sx, sy, sz;
+   vec3 o;
+};
+
+static inline ShearedRay shearRay(const Ray &ray)
+{
+   vec3 ad = glm::abs(ray.d);
+   ShearedRay s;
+   s.kz = ad.x > ad.y ? (ad.x > ad.z ? 0 : 2) : (ad.y > ad.z ? 1 : 2);
+   s.kx = (s.kz + 1) % 3;
+   s.ky = (s.kx + 1) % 3;
+   if (ray.d[s.kz] < 0)
+      std::swap(s.kx, s.ky);
+   s.sz = 1 / ray.d[s.kz];
+   s.sx = ray.d[s.kx] * s.sz;
+   s.sy = ray.d[s.ky] * s.sz;
+   s.o = ray.o;
+   return s;
+}
+
+/*
+ * The vertices are moved to the ray origin and sheared, so the ray runs
+ * along +z through (0, 0) and the hit test is the signs of three 2D edge
+ * functions. Neighbours compute a shared edge from the same vertices with
+ * the same operations, so a ray cannot slip between them. Edge functions
+ * that round to exactly zero are redone in double, where they are exact.
+ */
+static inline bool watertightLaneHit(const ShearedRay &s, const VertexBlock &block, int i,
+                                     real *t)
+{
+   real x[3], y[3], z[3];
+   for (int j = 0; j < 3; ++j)
+   {
+      real ax = block.v[j][s.kx][i] - s.o[s.kx];
+      real ay = block.v[j][s.ky][i] - s.o[s.ky];
+      real az = block.v[j][s.kz][i] - s.o[s.kz];
+      x[j] = ax - s.sx * az;
+      y[j] = ay - s.sy * az;
+      z[j] = s.sz * az;
+   }
+   real u = x[2] * y[1] - y[2] * x[1];
+   real v = x[0] * y[2] - y[0] * x[2];
+   real w = x[1] * y[0] - y[1] * x[0];
+   if (u == 0 || v == 0 || w == 0)
+   {
+      u = static_cast<real>(double(x[2]) * double(y[1]) - double(y[2]) * double(x[1]));
+      v = static_cast<real>(double(x[0]) * double(y[2]) - double(y[0]) * double(x[2]));
+      w = static_cast<real>(double(x[1]) * double(y[0]) - double(y[1]) * double(x[0]));
+   }
+#ifdef TEST_CULL
+   if (!(u >= 0 && v >= 0 && w >= 0))
+      return false;
+#else
+   if (!(u >= 0 && v >= 0 && w >= 0) && !(u <= 0 && v <= 0 && w <= 0))
+      return false;
+#endif
+   real det = u + v + w;
+   if (det == 0)
+      return false;
+   real tt = (u * z[0] + v * z[1] + w * z[2]) / det;
+   if (!(tt > 0))
+      return false;
+   *t = tt;
+   return true;
+}
+
+void closestHitWatertightScalar(const Ray &ray, const VertexBlock &block, real *ct, size_t *ck)
+{
+   ShearedRay s = shearRay(ray);
+   for (int i = 0; i < TRI_BLOCK_SIZE; ++i)
+   {
+      real t;
+      size_t k = block.ids[i];
+      if (watertightLaneHit(s, block, i, &t) && (t < *ct || (t == *ct && k < *ck)))
+         *ct = t, *ck = k;
+   }
+}
+
+bool anyHitWatertightScalar(const Ray &ray, const VertexBlock &block, real tmax)
+{
+   ShearedRay s = shearRay(ray);
+   for (int i = 0; i < TRI_BLOCK_SIZE; ++i)
+   {
+      real t;
+      if (watertightLaneHit(s, block, i, &t) && t < tmax)
+         return true;
+   }
+   return false;
+}
+
+#if defined(HAS_X86_SIMD) && defined(TEST_CULL)
+
+/*
+ * Möller–Trumbore with backface culling, mirroring rayTriangleIntersection
+ * operation for operation so the SIMD kernels return the same distances.
+ * Returns the bitmask of hit lanes and stores their distances in t.
+ */
+static inline int intersectSSE(const Ray &ray, const TriangleBlock &block, int h, float *t)
+{
+   __m128 dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y), dz = _mm_set1_ps(ray.d.z);
+   __m128 ux = _mm_load_ps(block.ux + h), uy = _mm_load_ps(block.uy + h), uz = _mm_load_ps(block.uz + h);
+   __m128 vx = _mm_load_ps(block.vx + h), vy = _mm_load_ps(block.vy + h), vz = _mm_load_ps(block.vz + h);
+
+   __m128 px = _mm_sub_ps(_mm_mul_ps(dy, vz), _mm_mul_ps(vy, dz));
+   __m128 py = _mm_sub_ps(_mm_mul_ps(dz, vx), _mm_mul_ps(vz, dx));
+   __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, vy), _mm_mul_ps(vx, dy));
+   __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ux, px), _mm_mul_ps(uy, py)), _mm_mul_ps(uz, pz));
+
+   __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.o.x), _mm_load_ps(block.px + h));
+   __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.o.y), _mm_load_ps(block.py + h));
+   __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.o.z), _mm_load_ps(block.pz + h));
+   __m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz));
+
+   __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, uz), _mm_mul_ps(uy, tz));
+   __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, ux), _mm_mul_ps(uz, tx));
+   __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, uy), _mm_mul_ps(ux, ty));
+   __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz));
+   __m128 tt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, qx), _mm_mul_ps(vy, qy)), _mm_mul_ps(vz, qz));
+   tt = _mm_div_ps(tt, det);
+
+   __m128 zero = _mm_setzero_ps(), eps = _mm_set1_ps(EPS_F);
+   __m128 ok = _mm_cmpge_ps(det, eps);
+   ok = _mm_and_ps(ok, _mm_cmpge_ps(u, zero));
+   ok = _mm_and_ps(ok, _mm_cmple_ps(u, det));
+   ok = _mm_and_ps(ok, _mm_cmpge_ps(v, zero));
+   ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_add_ps(u, v), det));
+   ok = _mm_and_ps(ok, _mm_cmpge_ps(tt, eps));
+   _mm_storeu_ps(t + h, tt);
+   return _mm_movemask_ps(ok) << h;
+}
+
+static void closestHitSSE(const Ray &ray, const TriangleBlock &block, real *ct, size_t *ck)
+{
+   float t[TRI_BLOCK_SIZE];
+   int mask = 0;
+   for (int h = 0; h < TRI_BLOCK_SIZE; h += 4)
+      mask |= intersectSSE(ray, block, h, t);
+   pickClosest(t, mask, block.ids, ct, ck);
+}
+
+static bool anyHitSSE(const Ray &ray, const TriangleBlock &block, real tmax, size_t skip)
+{
+   float t[TRI_BLOCK_SIZE];
+   for (int h = 0; h < TRI_BLOCK_SIZE; h += 4)
+      for (int mask = intersectSSE(ray, block, h, t); mask; mask &= mask - 1)
+      {
+         int i = __builtin_ctz(mask);
+         if (t[i] < tmax && block.ids[i] != skip)
+            return true;
+      }
+   return false;
+}
+
+static inline __m128 transformRowSSE(const TransformBlock &block, int r, int h, __m128 x,
+                                     __m128 y, __m128 z, __m128 w)
+{
+   __m128 s = _mm_mul_ps(_mm_load_ps(block.m[r][0] + h), x);
+   s = _mm_add_ps(s, _mm_mul_ps(_mm_load_ps(block.m[r][1] + h), y));
+   s = _mm_add_ps(s, _mm_mul_ps(_mm_load_ps(block.m[r][2] + h), z));
+   return _mm_add_ps(s, w);
+}
+
+/* transformLaneHit on four lanes; returns the mask of hits with t >= EPS. */
+static inline int intersectTransformSSE(const Ray &ray, const TransformBlock &block, int h,
+                                        float *t)
+{
+   __m128 dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y), dz = _mm_set1_ps(ray.d.z);
+   __m128 ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y), oz = _mm_set1_ps(ray.o.z);
+   __m128 zero = _mm_setzero_ps();
+   __m128 tdz = transformRowSSE(block, 2, h, dx, dy, dz, zero);
+   __m128 toz = transformRowSSE(block, 2, h, ox, oy, oz, _mm_load_ps(block.m[2][3] + h));
+   __m128 tt = _mm_div_ps(_mm_sub_ps(zero, toz), tdz);
+   __m128 u = _mm_add_ps(transformRowSSE(block, 0, h, ox, oy, oz, _mm_load_ps(block.m[0][3] + h)),
+                         _mm_mul_ps(tt, transformRowSSE(block, 0, h, dx, dy, dz, zero)));
+   __m128 v = _mm_add_ps(transformRowSSE(block, 1, h, ox, oy, oz, _mm_load_ps(block.m[1][3] + h)),
+                         _mm_mul_ps(tt, transformRowSSE(block, 1, h, dx, dy, dz, zero)));
+
+   __m128 ok = _mm_cmplt_ps(tdz, zero);
+   ok = _mm_and_ps(ok, _mm_cmpge_ps(u, zero));
+   ok = _mm_and_ps(ok, _mm_cmpge_ps(v, zero));
+   ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1)));
+   ok = _mm_and_ps(ok, _mm_cmpge_ps(tt, _mm_set1_ps(EPS_F)));
+   _mm_storeu_ps(t + h, tt);
+   return _mm_movemask_ps(ok) << h;
+}
+
+static void closestHitTransformSSE(const Ray &ray, const TransformBlock &block, real *ct,
+                                   size_t *ck)
+{
+   float t[TRI_BLOCK_SIZE];
+   int mask = 0;
+   for (int h = 0; h < TRI_BLOCK_SIZE; h += 4)
+      mask |= intersectTransformSSE(ray, block, h, t);
+   pickClosest(t, mask, block.ids, ct, ck);
+}
+
+static bool anyHitTransformSSE(const Ray &ray, const TransformBlock &block, real tmax,
+                               size_t skip)
+{
+   float t[TRI_BLOCK_SIZE];
+   for (int h = 0; h < TRI_BLOCK_SIZE; h += 4)
+      for (int mask = intersectTransformSSE(ray, block, h, t); mask; mask &= mask - 1)
+      {
+         int i = __builtin_ctz(mask);
+         if (t[i] < tmax && block.ids[i] != skip)
+            return true;
+      }
+   return false;
+}
+
+/*
+ * watertightLaneHit on four lanes. Lanes with an edge function of exactly
+ * zero are rare and redone by the scalar test, which has the double
+ * fallback; the rest match it operation for operation.
+ */
+static inline int intersectWatertightSSE(const ShearedRay &s, const VertexBlock &block, int h,
+                                         float *t)
+{
+   __m128 sx = _mm_set1_ps(s.sx), sy = _mm_set1_ps(s.sy), sz = _mm_set1_ps(s.sz);
+   __m128 x[3], y[3], z[3];
+   for (int j = 0; j < 3; ++j)
+   {
+      __m128 ax = _mm_sub_ps(_mm_load_ps(block.v[j][s.kx] + h), _mm_set1_ps(s.o[s.kx]));
+      __m128 ay = _mm_sub_ps(_mm_load_ps(block.v[j][s.ky] + h), _mm_set1_ps(s.o[s.ky]));
+      __m128 az = _mm_sub_ps(_mm_load_ps(block.v[j][s.kz] + h), _mm_set1_ps(s.o[s.kz]));
+      x[j] = _mm_sub_ps(ax, _mm_mul_ps(sx, az));
+      y[j] = _mm_sub_ps(ay, _mm_mul_ps(sy, az));
+      z[j] = _mm_mul_ps(sz, az);
+   }
+   __m128 u = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+   __m128 v = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+   __m128 w = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+   __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+   __m128 tt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, z[0]), _mm_mul_ps(v, z[1])),
+                          _mm_mul_ps(w, z[2]));
+   tt = _mm_div_ps(tt, det);
+
+   __m128 zero = _mm_setzero_ps();
+   __m128 edge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)),
+                           _mm_cmpeq_ps(w, zero));
+   __m128 ok = _mm_cmpge_ps(u, zero);
+   ok = _mm_and_ps(ok, _mm_cmpge_ps(v, zero));
+   ok = _mm_and_ps(ok, _mm_cmpge_ps(w, zero));
+   ok = _mm_and_ps(ok, _mm_cmpneq_ps(det, zero));
+   ok = _mm_and_ps(ok, _mm_cmpgt_ps(tt, zero));
+   _mm_storeu_ps(t + h, tt);
+   int mask = _mm_movemask_ps(_mm_andnot_ps(edge, ok)) << h;
+   for (int redo = _mm_movemask_ps(edge) << h; redo; redo &= redo - 1)
+   {
+      int i = __builtin_ctz(redo);
+      if (watertightLaneHit(s, block, i, t + i))
+         mask |= 1 << i;
+   }
+   return mask;
+}
+
+static void closestHitWatertightSSE(const Ray &ray, const VertexBlock &block, real *ct,
+                                    size_t *ck)
+{
+   ShearedRay s = shearRay(ray);
+   float t[TRI_BLOCK_SIZE];
+   int mask = 0;
+   for (int h = 0; h < TRI_BLOCK_SIZE; h += 4)
+      mask |= intersectWatertightSSE(s, block, h, t);
+   pickClosest(t, mask, block.ids, ct, ck);
+}
+
+static bool anyHitWatertightSSE(const Ray &ray, const VertexBlock &block, real tmax)
+{
+   ShearedRay s = shearRay(ray);
+   float t[TRI_BLOCK_SIZE];
+   for (int h = 0; h < TRI_BLOCK_SIZE; h += 4)
+      for (int mask = intersectWatertightSSE(s, block, h, t); mask; mask &= mask - 1)
+         if (t[__builtin_ctz(mask)] < tmax)
+            return true;
+   return false;
+}
+
+__attribute__((target("avx2")))
+static inline int intersectAVX2(const Ray &ray, const TriangleBlock &block, float *t)
+{
+   __m256 dx = _mm256_set1_ps(ray.d.x), dy = _mm256_set1_ps(ray.d.y), dz = _mm256_set1_ps(ray.d.z);
+   __m256 ux = _mm256_load_ps(block.ux), uy = _mm256_load_ps(block.uy), uz = _mm256_load_ps(block.uz);
+   __m256 vx = _mm256_load_ps(block.vx), vy = _mm256_load_ps(block.vy), vz = _mm256_load_ps(block.vz);
+
+   __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, vz), _mm256_mul_ps(vy, dz));
+   __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, vx), _mm256_mul_ps(vz, dx));
+   __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, vy), _mm256_mul_ps(vx, dy));
+   __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ux, px), _mm256_mul_ps(uy, py)),
+                              _mm256_mul_ps(uz, pz));
+
+   __m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray.o.x), _mm256_load_ps(block.px));
+   __m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray.o.y), _mm256_load_ps(block.py));
+   __m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray.o.z), _mm256_load_ps(block.pz));
+   __m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+                            _mm256_mul_ps(tz, pz));
+
+   __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, uz), _mm256_mul_ps(uy, tz));
+   __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, ux), _mm256_mul_ps(uz, tx));
+   __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, uy), _mm256_mul_ps(ux, ty));
+   __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                            _mm256_mul_ps(dz, qz));
+   __m256 tt = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, qx), _mm256_mul_ps(vy, qy)),
+                             _mm256_mul_ps(vz, qz));
+   tt = _mm256_div_ps(tt, det);
+
+   __m256 zero = _mm256_setzero_ps(), eps = _mm256_set1_ps(EPS_F);
+   __m256 ok = _mm256_cmp_ps(det, eps, _CMP_GE_OQ);
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(u, det, _CMP_LE_OQ));
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_add_ps(u, v), det, _CMP_LE_OQ));
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(tt, eps, _CMP_GE_OQ));
+   _mm256_storeu_ps(t, tt);
+   return _mm256_movemask_ps(ok);
+}
+
+__attribute__((target("avx2")))
+static void closestHitAVX2(const Ray &ray, const TriangleBlock &block, real *ct, size_t *ck)
+{
+   float t[TRI_BLOCK_SIZE];
+   int mask = intersectAVX2(ray, block, t);
+   pickClosest(t, mask, block.ids, ct, ck);
+}
+
+__attribute__((target("avx2")))
+static bool anyHitAVX2(const Ray &ray, const TriangleBlock &block, real tmax, size_t skip)
+{
+   float t[TRI_BLOCK_SIZE];
+   for (int mask = intersectAVX2(ray, block, t); mask; mask &= mask - 1)
+   {
+      int i = __builtin_ctz(mask);
+      if (t[i] < tmax && block.ids[i] != skip)
+         return true;
+   }
+   return false;
+}
+
+__attribute__((target("avx2")))
+static inline __m256 transformRowAVX2(const TransformBlock &block, int r, __m256 x, __m256 y,
+                                      __m256 z, __m256 w)
+{
+   __m256 s = _mm256_mul_ps(_mm256_load_ps(block.m[r][0]), x);
+   s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_load_ps(block.m[r][1]), y));
+   s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_load_ps(block.m[r][2]), z));
+   return _mm256_add_ps(s, w);
+}
+
+__attribute__((target("avx2")))
+static inline int intersectTransformAVX2(const Ray &ray, const TransformBlock &block, float *t)
+{
+   __m256 dx = _mm256_set1_ps(ray.d.x), dy = _mm256_set1_ps(ray.d.y), dz = _mm256_set1_ps(ray.d.z);
+   __m256 ox = _mm256_set1_ps(ray.o.x), oy = _mm256_set1_ps(ray.o.y), oz = _mm256_set1_ps(ray.o.z);
+   __m256 zero = _mm256_setzero_ps();
+   __m256 tdz = transformRowAVX2(block, 2, dx, dy, dz, zero);
+   __m256 toz = transformRowAVX2(block, 2, ox, oy, oz, _mm256_load_ps(block.m[2][3]));
+   __m256 tt = _mm256_div_ps(_mm256_sub_ps(zero, toz), tdz);
+   __m256 u = _mm256_add_ps(transformRowAVX2(block, 0, ox, oy, oz, _mm256_load_ps(block.m[0][3])),
+                            _mm256_mul_ps(tt, transformRowAVX2(block, 0, dx, dy, dz, zero)));
+   __m256 v = _mm256_add_ps(transformRowAVX2(block, 1, ox, oy, oz, _mm256_load_ps(block.m[1][3])),
+                            _mm256_mul_ps(tt, transformRowAVX2(block, 1, dx, dy, dz, zero)));
+
+   __m256 ok = _mm256_cmp_ps(tdz, zero, _CMP_LT_OQ);
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1), _CMP_LE_OQ));
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(tt, _mm256_set1_ps(EPS_F), _CMP_GE_OQ));
+   _mm256_storeu_ps(t, tt);
+   return _mm256_movemask_ps(ok);
+}
+
+__attribute__((target("avx2")))
+static void closestHitTransformAVX2(const Ray &ray, const TransformBlock &block, real *ct,
+                                    size_t *ck)
+{
+   float t[TRI_BLOCK_SIZE];
+   int mask = intersectTransformAVX2(ray, block, t);
+   pickClosest(t, mask, block.ids, ct, ck);
+}
+
+__attribute__((target("avx2")))
+static bool anyHitTransformAVX2(const Ray &ray, const TransformBlock &block, real tmax,
+                                size_t skip)
+{
+   float t[TRI_BLOCK_SIZE];
+   for (int mask = intersectTransformAVX2(ray, block, t); mask; mask &= mask - 1)
+   {
+      int i = __builtin_ctz(mask);
+      if (t[i] < tmax && block.ids[i] != skip)
+         return true;
+   }
+   return false;
+}
+
+__attribute__((target("avx2")))
+static inline int intersectWatertightAVX2(const ShearedRay &s, const VertexBlock &block,
+                                          float *t)
+{
+   __m256 sx = _mm256_set1_ps(s.sx), sy = _mm256_set1_ps(s.sy), sz = _mm256_set1_ps(s.sz);
+   __m256 x[3], y[3], z[3];
+   for (int j = 0; j < 3; ++j)
+   {
+      __m256 ax = _mm256_sub_ps(_mm256_load_ps(block.v[j][s.kx]), _mm256_set1_ps(s.o[s.kx]));
+      __m256 ay = _mm256_sub_ps(_mm256_load_ps(block.v[j][s.ky]), _mm256_set1_ps(s.o[s.ky]));
+      __m256 az = _mm256_sub_ps(_mm256_load_ps(block.v[j][s.kz]), _mm256_set1_ps(s.o[s.kz]));
+      x[j] = _mm256_sub_ps(ax, _mm256_mul_ps(sx, az));
+      y[j] = _mm256_sub_ps(ay, _mm256_mul_ps(sy, az));
+      z[j] = _mm256_mul_ps(sz, az);
+   }
+   __m256 u = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]), _mm256_mul_ps(y[2], x[1]));
+   __m256 v = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]), _mm256_mul_ps(y[0], x[2]));
+   __m256 w = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]), _mm256_mul_ps(y[1], x[0]));
+   __m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+   __m256 tt = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, z[0]), _mm256_mul_ps(v, z[1])),
+                             _mm256_mul_ps(w, z[2]));
+   tt = _mm256_div_ps(tt, det);
+
+   __m256 zero = _mm256_setzero_ps();
+   __m256 edge = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ),
+                                           _mm256_cmp_ps(v, zero, _CMP_EQ_OQ)),
+                              _mm256_cmp_ps(w, zero, _CMP_EQ_OQ));
+   __m256 ok = _mm256_cmp_ps(u, zero, _CMP_GE_OQ);
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(w, zero, _CMP_GE_OQ));
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+   ok = _mm256_and_ps(ok, _mm256_cmp_ps(tt, zero, _CMP_GT_OQ));
+   _mm256_storeu_ps(t, tt);
+   int mask = _mm256_movemask_ps(_mm256_andnot_ps(edge, ok));
+   for (int redo = _mm256_movemask_ps(edge); redo; redo &= redo - 1)
+   {
+      int i = __builtin_ctz(redo);
+      if (watertightLaneHit(s, block, i, t + i))
+         mask |= 1 << i;
+   }
+   return mask;
+}
+
+__attribute__((target("avx2")))
+static void closestHitWatertightAVX2(const Ray &ray, const VertexBlock &block, real *ct,
+                                     size_t *ck)
+{
+   ShearedRay s = shearRay(ray);
+   float t[TRI_BLOCK_SIZE];
+   int mask = intersectWatertightAVX2(s, block, t);
+   pickClosest(t, mask, block.ids, ct, ck);
+}
+
+__attribute__((target("avx2")))
+static bool anyHitWatertightAVX2(const Ray &ray, const VertexBlock &block, real tmax)
+{
+   ShearedRay s = shearRay(ray);
+   float t[TRI_BLOCK_SIZE];
+   for (int mask = intersectWatertightAVX2(s, block, t); mask; mask &= mask - 1)
+      if (t[__builtin_ctz(mask)] < tmax)
+         return true;
+   return false;
+}
+
+#endif
+
+static const TriangleKernel SCALAR_KERNEL = {
+   "scalar", closestHitScalar, anyHitScalar, closestHitTransformScalar, anyHitTransformScalar,
+   closestHitWatertightScalar, anyHitWatertightScalar
+};
+#if defined(HAS_X86_SIMD) && defined(TEST_CULL)
+static const TriangleKernel SSE_KERNEL = {
+   "SSE", closestHitSSE, anyHitSSE, closestHitTransformSSE, anyHitTransformSSE,
+   closestHitWatertightSSE, anyHitWatertightSSE
+};
+static const TriangleKernel AVX2_KERNEL = {
+   "AVX2", closestHitAVX2, anyHitAVX2, closestHitTransformAVX2, anyHitTransformAVX2,
+   closestHitWatertightAVX2, anyHitWatertightAVX2
+};
+#endif
+
+const char *triangleTestName(TriangleTest test)
+{
+   switch (test)
+   {
+      case TriangleTest::MollerTrumbore: return "Moller-Trumbore";
+      case TriangleTest::BaldwinWeber: return "Baldwin-Weber";
+      case TriangleTest::Watertight: return "watertight";
+   }
+   return "unknown";
+}
+
+const TriangleKernel &triangleKernel()
+{
+   static const TriangleKernel &kernel = []() -> const TriangleKernel & {
+      const TriangleKernel *selected = &SCALAR_KERNEL;
+#if defined(HAS_X86_SIMD) && defined(TEST_CULL)
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2"))
+         selected = &AVX2_KERNEL;
+      else if (__builtin_cpu_supports("sse2"))
+         selected = &SSE_KERNEL;
+#endif
+      print("[Triangle Kernel] ", selected->name);
+      return *selected;
+   }();
+   return kernel;
+}
+
+void packTriangleBlocks(const Mesh &mesh, const uint *ids, size_t count,
+                        std::vector<TriangleBlock> *blocks)
+{
+   for (size_t first = 0; first < count; first += TRI_BLOCK_SIZE)
+   {
+      TriangleBlock &block = blocks->emplace_back();
+      for (size_t i = 0; i < TRI_BLOCK_SIZE; ++i)
+      {
+         if (first + i < count)
+         {
+            uint k = ids ? ids[first + i] : static_cast<uint>(first + i);
+            Triangle tri = mesh.triangle(k);
+            block.px[i] = tri.bar.P.x, block.py[i] = tri.bar.P.y, block.pz[i] = tri.bar.P.z;
+            block.ux[i] = tri.bar.u.x, block.uy[i] = tri.bar.u.y, block.uz[i] = tri.bar.u.z;
+            block.vx[i] = tri.bar.v.x, block.vy[i] = tri.bar.v.y, block.vz[i] = tri.bar.v.z;
+            block.ids[i] = k;
+         }
+         else
+         {
+            block.px[i] = block.py[i] = block.pz[i] = 0;
+            block.ux[i] = block.uy[i] = block.uz[i] = 0;
+            block.vx[i] = block.vy[i] = block.vz[i] = 0;
+            block.ids[i] = static_cast<uint>(-1);
+         }
+      }
+   }
+}
+
+void refitTriangleBlocks(const Mesh &mesh, std::vector<TriangleBlock> *blocks)
+{
+   for (TriangleBlock &block : *blocks)
+      for (int i = 0; i < TRI_BLOCK_SIZE; ++i)
+      {
+         if (block.ids[i] == static_cast<uint>(-1))
+            continue;
+         Triangle tri = mesh.triangle(block.ids[i]);
+         block.px[i] = tri.bar.P.x, block.py[i] = tri.bar.P.y, block.pz[i] = tri.bar.P.z;
+         block.ux[i] = tri.bar.u.x, block.uy[i] = tri.bar.u.y, block.uz[i] = tri.bar.u.z;
+         block.vx[i] = tri.bar.v.x, block.vy[i] = tri.bar.v.y, block.vz[i] = tri.bar.v.z;
+      }
+}
+
+/* Inverts [e1 e2 n | P] in double precision, n being the unnormalized normal. */
+void packTransformBlocks(const std::vector<TriangleBlock> &blocks,
+                         std::vector<TransformBlock> *transforms)
+{
+   using dvec3 = glm::dvec3;
+   transforms->assign(blocks.size(), TransformBlock {});
+   for (size_t b = 0; b < blocks.size(); ++b)
+   {
+      const TriangleBlock &block = blocks[b];
+      TransformBlock &out = (*transforms)[b];
+      for (int i = 0; i < TRI_BLOCK_SIZE; ++i)
+      {
+         out.ids[i] = block.ids[i];
+         dvec3 p(block.px[i], block.py[i], block.pz[i]);
+         dvec3 e1(block.ux[i], block.uy[i], block.uz[i]);
+         dvec3 e2(block.vx[i], block.vy[i], block.vz[i]);
+         dvec3 n = glm::cross(e1, e2);
+         double nn = glm::dot(n, n);
+         if (block.ids[i] == static_cast<uint>(-1) || nn == 0)
+            continue;
+         dvec3 rows[3] = { glm::cross(e2, n) / nn, glm::cross(n, e1) / nn, n / nn };
+         for (int r = 0; r < 3; ++r)
+         {
+            for (int c = 0; c < 3; ++c)
+               out.m[r][c][i] = static_cast<real>(rows[r][c]);
+            out.m[r][3][i] = static_cast<real>(-glm::dot(rows[r], p));
+         }
+      }
+   }
+}
+
+void packVertexBlocks(const Mesh &mesh, const std::vector<TriangleBlock> &blocks,
+                      std::vector<VertexBlock> *vertices)
+{
+   vertices->resize(blocks.size());
+   for (size_t b = 0; b < blocks.size(); ++b)
+   {
+      VertexBlock &out = (*vertices)[b];
+      for (int i = 0; i < TRI_BLOCK_SIZE; ++i)
+      {
+         uint k = blocks[b].ids[i];
+         out.ids[i] = k;
+         for (int j = 0; j < 3; ++j)
+         {
+            vec3 p = k != static_cast<uint>(-1) ? mesh.vertices[mesh.indices[3 * k + j]]
+                                                : vec3(std::numeric_limits<real>::quiet_NaN());
+            for (int axis = 0; axis < 3; ++axis)
+               out.v[j][axis][i] = p[axis];
+         }
+      }
+   }
+}
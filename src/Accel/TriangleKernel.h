@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Raytracer.h"
+
+/* How leaves store and test their triangles. */
+enum class TriangleTest : uint32_t
+{
+   MollerTrumbore, // TriangleBlock, edges and the first vertex
+   BaldwinWeber,   // TransformBlock, a precomputed world to barycentric map
+   Watertight,     // VertexBlock, Woop et al.; no cracks on shared edges
+};
+
+const char *triangleTestName(TriangleTest test);
+
+/*
+ * Ray versus TriangleBlock and TransformBlock tests. The implementation is picked once at
+ * runtime from what the CPU supports, so the same binary runs on machines
+ * without AVX2.
+ */
+struct TriangleKernel
+{
+   const char *name;
+   /* Updates *ct and *ck when a lane is hit closer than *ct. Equal distances
+    * go to the lower triangle id, like a linear scan over the mesh. */
+   void (*closestHit)(const Ray &ray, const TriangleBlock &block, real *ct, size_t *ck);
+   /* Returns true if any lane other than skip is hit at EPS < t < tmax. */
+   bool (*anyHit)(const Ray &ray, const TriangleBlock &block, real tmax, size_t skip);
+   /* The same queries on the precomputed transforms. */
+   void (*closestHitTransform)(const Ray &ray, const TransformBlock &block, real *ct,
+                               size_t *ck);
+   bool (*anyHitTransform)(const Ray &ray, const TransformBlock &block, real tmax, size_t skip);
+   /* Watertight queries, hitting at 0 < t. Callers offset ray origins off the
+    * surface they leave instead of skipping its triangle. */
+   void (*closestHitWatertight)(const Ray &ray, const VertexBlock &block, real *ct, size_t *ck);
+   bool (*anyHitWatertight)(const Ray &ray, const VertexBlock &block, real tmax);
+};
+
+const TriangleKernel &triangleKernel();
+
+/* Appends ceil(count / TRI_BLOCK_SIZE) blocks holding triangles ids[0..count)
+ * of the mesh, or the first count triangles when ids is null. */
+void packTriangleBlocks(const Mesh &mesh, const uint *ids, size_t count,
+                        std::vector<TriangleBlock> *blocks);
+/* Reloads every used lane of the blocks from the mesh by its id. */
+void refitTriangleBlocks(const Mesh &mesh, std::vector<TriangleBlock> *blocks);
+/* Replaces transforms with one TransformBlock per block, lane for lane. */
+void packTransformBlocks(const std::vector<TriangleBlock> &blocks,
+                         std::vector<TransformBlock> *transforms);
+/* Replaces vertices with one VertexBlock per block, read from the mesh by lane id. */
+void packVertexBlocks(const Mesh &mesh, const std::vector<TriangleBlock> &blocks,
+                      std::vector<VertexBlock> *vertices);
@@ -0,0 +1,35 @@
+#include "WorldMesh.h"
+
+#include <algorithm>
+
+Mesh bakeInstances(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+                   std::vector<uint> *instance_first)
+{
+   Mesh world;
+   instance_first->clear();
+   for (const Instance &inst : instances)
+   {
+      const Mesh &mesh = meshes[inst.mesh];
+      instance_first->push_back(static_cast<uint>(world.triangleCount()));
+      uint base = static_cast<uint>(world.vertices.size());
+      for (const vec3 &v : mesh.vertices)
+         world.vertices.push_back(inst.identity ? v : vec3(inst.to_world * glm::vec4(v, 1)));
+      for (uint i : mesh.indices)
+         world.indices.push_back(base + i);
+   }
+   return world;
+}
+
+size_t worldHitId(const std::vector<uint> &instance_first, size_t triangle)
+{
+   auto it = std::upper_bound(instance_first.begin(), instance_first.end(), triangle);
+   uint inst = static_cast<uint>(it - instance_first.begin() - 1);
+   return hitId(inst, static_cast<uint>(triangle - instance_first[inst]));
+}
+
+size_t worldTriangle(const std::vector<uint> &instance_first, size_t id)
+{
+   if (id == static_cast<size_t>(-1))
+      return id;
+   return instance_first[hitInstance(id)] + hitTriangle(id);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <vector>
+
+#include "Raytracer.h"
+
+/*
+ * Bakes the triangles of every instance into one world space mesh, for the
+ * structures built over the whole scene. Triangles are numbered instance
+ * after instance, so their order is the order of the hit ids; instance_first
+ * receives the first triangle of every instance.
+ */
+Mesh bakeInstances(const std::vector<Mesh> &meshes, const std::vector<Instance> &instances,
+                   std::vector<uint> *instance_first);
+/* Hit id of a baked triangle. */
+size_t worldHitId(const std::vector<uint> &instance_first, size_t triangle);
+/* Baked triangle of a hit id, -1 for none. */
+size_t worldTriangle(const std::vector<uint> &instance_first, size_t id);
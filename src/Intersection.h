@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+
+#include "Raytracer.h"
+
+#define TEST_CULL
+
+inline int rayTriangleIntersection(const Ray &ray, const Triangle &tri, real *t)
+{
+   vec3 pvec = glm::cross(ray.d, tri.bar.v);
+   real det = glm::dot(tri.bar.u, pvec);
+#ifdef TEST_CULL
+   if (det < EPS)
+      return 0;
+   vec3 tvec = ray.o - tri.bar.P;
+   real u = glm::dot(tvec, pvec);
+   if (u < 0 || u > det)
+      return 0;
+   vec3 qvec = glm::cross(tvec, tri.bar.u);
+   real v = glm::dot(ray.d, qvec);
+   if (v < 0 || u + v > det)
+      return 0;
+   *t = glm::dot(tri.bar.v, qvec);
+   *t /= det;
+#else
+   if (det > -EPS && det < EPS)
+      return 0;
+   real inv_det = 1 / det;
+   vec3 tvec = ray.o - tri.bar.P;
+   real u = glm::dot(tvec, pvec) * inv_det;
+   if (u < 0 || u > 1)
+      return 0;
+   vec3 qvec = glm::cross(tvec, tri.bar.u);
+   real v = glm::dot(ray.d, qvec) * inv_det;
+   if (v < 0 || u + v > 1)
+      return 0;
+   *t = glm::dot(tri.bar.v, qvec) * inv_det;
+#endif
+   return 1;
+}
+
+/*
+ * Barycentric weights of tri.p[1] and tri.p[2] at p, a hit on the triangle,
+ * from its projection onto the triangle's plane. Nothing is rejected: hits
+ * a triangle test accepted just outside the edges are clamped onto them.
+ * Degenerate triangles give the centroid.
+ */
+inline void triangleBarycentrics(const Triangle &tri, const vec3 &p, real *bu, real *bv)
+{
+   vec3 d = p - tri.bar.P;
+   real uu = glm::dot(tri.bar.u, tri.bar.u), uv = glm::dot(tri.bar.u, tri.bar.v);
+   real vv = glm::dot(tri.bar.v, tri.bar.v);
+   real du = glm::dot(d, tri.bar.u), dv = glm::dot(d, tri.bar.v);
+   real det = uu * vv - uv * uv;
+   if (!(det > 0))
+   {
+      *bu = *bv = real(1) / 3;
+      return;
+   }
+   real u = glm::max((vv * du - uv * dv) / det, real(0));
+   real v = glm::max((uu * dv - uv * du) / det, real(0));
+   if (u + v > 1)
+   {
+      real sum = u + v;
+      u /= sum, v /= sum;
+   }
+   *bu = u, *bv = v;
+}
+
+/*
+ * Moves a hit point off its surface to the side ng points to (Wächter and
+ * Binder, "A Fast and Robust Method for Avoiding Self-Intersection"), so
+ * rays leaving it cannot hit that surface again. The offset is a number of
+ * ulps, which grows with the rounding error of p, except near the origin
+ * where ulps get tiny and a small absolute offset is used instead.
+ */
+inline vec3 offsetRayOrigin(const vec3 &p, const vec3 &ng)
+{
+   constexpr real ORIGIN = 1.0f / 32, FLOAT_SCALE = 1.0f / 65536, INT_SCALE = 256;
+   vec3 out;
+   for (int i = 0; i < 3; ++i)
+   {
+      int of = static_cast<int>(INT_SCALE * ng[i]);
+      real moved = glm::intBitsToFloat(glm::floatBitsToInt(p[i]) + (p[i] < 0 ? -of : of));
+      out[i] = std::fabs(p[i]) < ORIGIN ? p[i] + FLOAT_SCALE * ng[i] : moved;
+   }
+   return out;
+}
+
+/*
+ * Slab exits are scaled by 1 + 2 gamma(3) (Ize, "Robust BVH Ray Traversal"):
+ * each slab distance carries up to three roundings, and without the margin a
+ * ray through a vertex or edge on a box face can miss the box of the
+ * triangles it hits.
+ */
+static constexpr real BOX_EXIT_SCALE = 1 + 2 * (3 * 0x1p-24f / (1 - 3 * 0x1p-24f));
+
+/* Slab test, returns entry distance or infinity on a miss. */
+inline real rayBoxIntersection(const vec3 &o, const vec3 &inv_d, const vec3 &bmin,
+                               const vec3 &bmax, real tmax)
+{
+   vec3 t0 = (bmin - o) * inv_d;
+   vec3 t1 = (bmax - o) * inv_d;
+   vec3 tn = glm::min(t0, t1);
+   vec3 tf = glm::max(t0, t1);
+   real enter = glm::max(glm::max(tn.x, tn.y), glm::max(tn.z, real(0)));
+   real far = glm::min(glm::min(tf.x, tf.y), tf.z) * BOX_EXIT_SCALE;
+   real exit = glm::min(far, tmax);
+   return enter <= exit ? enter : std::numeric_limits<real>::infinity();
+}
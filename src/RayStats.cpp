@@ -0,0 +1,163 @@
+#include "RayStats.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Utils/Log.h"
+
+thread_local RayStats t_ray_stats;
+
+static double perRay(uint64_t count, uint64_t rays);
+static double mraysPerSecond(const RenderStats &stats);
+static double mraysPerSecond(uint64_t rays, float ms);
+static std::string jsonString(const std::string &str);
+
+struct TimingStats
+{
+   float median, min, max, mean, stddev;
+};
+static TimingStats timingStats(const std::vector<RenderStats> &runs);
+
+uint64_t RayStats::rays() const
+{
+   return primary_rays + shadow_rays + reflection_rays;
+}
+
+RayStats &RayStats::operator+=(const RayStats &other)
+{
+   primary_rays += other.primary_rays;
+   shadow_rays += other.shadow_rays;
+   reflection_rays += other.reflection_rays;
+   triangle_tests += other.triangle_tests;
+   node_visits += other.node_visits;
+   hits += other.hits;
+   misses += other.misses;
+   occluded += other.occluded;
+   return *this;
+}
+
+double perRay(uint64_t count, uint64_t rays)
+{
+   return rays ? static_cast<double>(count) / rays : 0;
+}
+
+double mraysPerSecond(const RenderStats &stats)
+{
+   return mraysPerSecond(stats.rays.rays(), stats.render_ms);
+}
+
+double mraysPerSecond(uint64_t rays, float ms)
+{
+   return ms > 0 ? rays / (ms * 1000.0) : 0;
+}
+
+std::string jsonString(const std::string &str)
+{
+   std::string out = "\"";
+   for (char c : str)
+   {
+      if (c == '"' || c == '\\')
+         out += '\\';
+      out += c;
+   }
+   return out + '"';
+}
+
+TimingStats timingStats(const std::vector<RenderStats> &runs)
+{
+   std::vector<float> ms;
+   for (const RenderStats &run : runs)
+      ms.push_back(run.render_ms);
+   std::sort(ms.begin(), ms.end());
+
+   TimingStats t {};
+   if (ms.empty())
+      return t;
+   size_t n = ms.size();
+   t.median = n % 2 ? ms[n / 2] : (ms[n / 2 - 1] + ms[n / 2]) / 2;
+   t.min = ms.front();
+   t.max = ms.back();
+   for (float m : ms)
+      t.mean += m / n;
+   for (float m : ms)
+      t.stddev += (m - t.mean) * (m - t.mean) / n;
+   t.stddev = std::sqrt(t.stddev);
+   return t;
+}
+
+void printRenderStats(const RenderStats &stats)
+{
+   const RayStats &r = stats.rays;
+   print("[Ray Stats] ", r.rays(), " rays (primary: ", r.primary_rays, ", shadow: ",
+         r.shadow_rays, ", reflection: ", r.reflection_rays, ") on ", stats.threads,
+         " threads");
+   print("[Ray Stats] ", mraysPerSecond(stats), " Mrays/s, ",
+         perRay(r.triangle_tests, r.rays()), " triangle tests/ray, ",
+         perRay(r.node_visits, r.rays()), " node visits/ray");
+   print("[Ray Stats] hit rate: ", 100 * perRay(r.hits, r.hits + r.misses),
+         "%, shadow rays occluded: ", 100 * perRay(r.occluded, r.shadow_rays), "%");
+}
+
+void printBenchStats(const BenchStats &bench)
+{
+   if (bench.runs.empty())
+      return;
+   TimingStats t = timingStats(bench.runs);
+   print("[Bench] ", bench.runs.size(), " runs, median: ", t.median, " ms, min: ", t.min,
+         " ms, stddev: ", t.stddev, " ms, ",
+         mraysPerSecond(bench.runs.back().rays.rays(), t.median), " Mrays/s");
+}
+
+/*
+ * Ray counters do not change between repeats of the same frame, so they are
+ * written once, from the last run; Mrays/s is taken at the median time.
+ */
+void writeBenchJson(const BenchStats &bench, std::ostream &out)
+{
+   if (bench.runs.empty())
+      return;
+   const RenderStats &last = bench.runs.back();
+   const RayStats &r = last.rays;
+   TimingStats t = timingStats(bench.runs);
+   out << "{\n"
+       << "  \"config\": " << jsonString(bench.config) << ",\n"
+       << "  \"args\": " << jsonString(bench.args) << ",\n"
+       << "  \"accel\": " << jsonString(bench.accel) << ",\n";
+   if (bench.frame >= 0)
+      out << "  \"frame\": " << bench.frame << ",\n";
+   out << "  \"xres\": " << last.xres << ",\n"
+       << "  \"yres\": " << last.yres << ",\n"
+       << "  \"k\": " << last.k << ",\n"
+       << "  \"threads\": " << last.threads << ",\n"
+       << "  \"load_ms\": " << bench.load_ms << ",\n"
+       << "  \"build_ms\": " << bench.build_ms << ",\n"
+       << "  \"repeat\": " << bench.runs.size() << ",\n"
+       << "  \"render_ms\": { \"median\": " << t.median << ", \"min\": " << t.min
+       << ", \"max\": " << t.max << ", \"mean\": " << t.mean
+       << ", \"stddev\": " << t.stddev << " },\n"
+       << "  \"mrays_per_s\": " << mraysPerSecond(r.rays(), t.median) << ",\n"
+       << "  \"rays\": " << r.rays() << ",\n"
+       << "  \"primary_rays\": " << r.primary_rays << ",\n"
+       << "  \"shadow_rays\": " << r.shadow_rays << ",\n"
+       << "  \"reflection_rays\": " << r.reflection_rays << ",\n"
+       << "  \"triangle_tests\": " << r.triangle_tests << ",\n"
+       << "  \"node_visits\": " << r.node_visits << ",\n"
+       << "  \"hits\": " << r.hits << ",\n"
+       << "  \"misses\": " << r.misses << ",\n"
+       << "  \"occluded\": " << r.occluded << ",\n"
+       << "  \"triangle_tests_per_ray\": " << perRay(r.triangle_tests, r.rays()) << ",\n"
+       << "  \"node_visits_per_ray\": " << perRay(r.node_visits, r.rays()) << "\n"
+       << "}\n";
+}
+
+void writeBenchJson(const std::vector<BenchStats> &frames, std::ostream &out)
+{
+   out << "[\n";
+   for (size_t i = 0; i < frames.size(); ++i)
+   {
+      if (i > 0)
+         out << ",\n";
+      writeBenchJson(frames[i], out);
+   }
+   out << "]\n";
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct RayStats
+{
+   uint64_t primary_rays;
+   uint64_t shadow_rays;
+   uint64_t reflection_rays;
+   uint64_t triangle_tests;
+   uint64_t node_visits;
+   uint64_t hits; // primary and reflection rays that hit the scene
+   uint64_t misses;
+   uint64_t occluded; // shadow rays that found a blocker
+
+   uint64_t rays() const;
+   RayStats &operator+=(const RayStats &other);
+};
+
+/*
+ * Counters of the calling thread. Hot loops bump these without any
+ * synchronization; the renderer folds them into per-thread totals once per
+ * tile. Build with -DNO_RAY_STATS to compile the counting out.
+ */
+extern thread_local RayStats t_ray_stats;
+
+#ifndef NO_RAY_STATS
+#define RAY_STAT(field, n) (t_ray_stats.field += (n))
+#else
+#define RAY_STAT(field, n)
+#endif
+
+struct RenderStats
+{
+   RayStats rays;
+   float render_ms;
+   int threads;
+   int xres, yres, k;
+};
+
+/* Repeated renders of one configuration, as reported by --stats-json. */
+struct BenchStats
+{
+   std::string config;
+   std::string args;
+   std::string accel; // the structure that answered the rays
+   float load_ms; // scene import or cache read, including the BVH
+   float build_ms; // of frames past the first, the update for the frame
+   int frame = -1; // in a --frames sequence
+   std::vector<RenderStats> runs;
+};
+
+void printRenderStats(const RenderStats &stats);
+void printBenchStats(const BenchStats &bench);
+void writeBenchJson(const BenchStats &bench, std::ostream &out);
+/* One record per frame of a sequence, as a JSON array. */
+void writeBenchJson(const std::vector<BenchStats> &frames, std::ostream &out);
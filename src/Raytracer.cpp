@@ -1,147 +1,442 @@
 #include "Raytracer.h"
 
+#include <algorithm>
+#include <memory>
+
+#include "Accel/Accelerator.h"
+#include "Accel/BVH.h"
+#include "Intersection.h"
+#include "Render.h"
 #include "Utils/Timer.h"
 #include "Const.h"
 
-#define TEST_CULL
 static constexpr float REFLECT_DAMP_FACTOR = 0.1f;
+static constexpr int SHADOW_BATCH_SIZE = 16;
+static constexpr int MORTON_BITS = 10;
+
+static col3 primaryColor(const Ray &ray, RayTracerData *rtdata, size_t ck, real ct, int k,
+                         const RenderOptions &opts, uint seed);
+static col3 rayTrace(const Ray &ray, RayTracerData *rtdata, size_t ck, real ct, int depth,
+                     const RenderOptions &opts, uint seed);
+static col3 shade(const Ray &ray, RayTracerData *rtdata, size_t ck, real ct,
+                  const RenderOptions &opts, Ray *next, col3 *weight);
+static void traceReflectionStreams(RayTracerData *rtdata, int k, const RenderOptions &opts,
+                                   ThreadPool &pool, std::vector<ThreadStats> *thread_stats,
+                                   RayStream *stream, col3 *output);
+static vec3 shadingNormal(const Ray &ray, real t, const Mesh &mesh, uint tri, bool smooth);
 
-static int rayTriangleIntersection(const Ray &ray, const Triangle &tri, real *t);
-static col3 rayTrace(const Ray &ray, RayTracerData *rtdata, int depth);
-static size_t firstIntersection(const Ray &ray, RayTracerData *rtdata, real *ct);
-
-int rayTriangleIntersection(const Ray &ray, const Triangle &tri, real *t)
-{
-   vec3 pvec = glm::cross(ray.d, tri.bar.v);
-   real det = glm::dot(tri.bar.u, pvec);
-#ifdef TEST_CULL
-   if (det < EPS)
-      return 0;
-   vec3 tvec = ray.o - tri.bar.P;
-   real u = glm::dot(tvec, pvec);
-   if (u < 0 || u > det)
-      return 0;
-   vec3 qvec = glm::cross(tvec, tri.bar.u);
-   real v = glm::dot(ray.d, qvec);
-   if (v < 0 || u + v > det)
-      return 0;
-   *t = glm::dot(tri.bar.v, qvec);
-   *t /= det;
-#else
-   if (det > -EPS && det < EPS)
-      return 0;
-   real inv_det = 1 / det;
-   vec3 tvec = ray.o - tri.bar.P;
-   real u = glm::dot(tvec, pvec) * inv_det;
-   if (u < 0 || u > 1)
-      return 0;
-   vec3 qvec = glm::cross(tvec, tri.bar.u);
-   real v = glm::dot(ray.d, qvec) * inv_det;
-   if (v < 0 || u + v > 1)
-      return 0;
-   *t = glm::dot(tri.bar.v, qvec) * inv_det;
-#endif
-   return 1;
-}
-
-void rayTrace(RayTracerData *rtdata, int xres, int yres, real focal_length,
-              vec3 origin, vec3 forward, vec3 right, int k, col3 *output)
+RenderStats rayTrace(RayTracerData *rtdata, int xres, int yres, real focal_length,
+                     vec3 origin, vec3 forward, vec3 right, int k,
+                     const RenderOptions &opts, col3 *output)
 {
-   Timer timer("Ray Tracing");
+   CameraRays camera { .dir = focal_length * forward, .right = right,
+                       .up = glm::cross(forward, right), .xres = xres, .yres = yres };
+   if (opts.wavefront)
+      return rayTraceWavefront(rtdata, xres, yres, camera, origin, k, opts, output);
 
-   vec3 up = glm::cross(forward, right);
-   vec3 dir = focal_length * forward;
+   Timer timer("Ray Tracing");
+   ThreadPool &pool = renderPool(opts.threads);
 
-   real y = -(yres - 1);
-   for (int i = 0; i < yres; ++i)
-   {
-      real x = -(xres - 1);
-      for (int j = 0; j < xres; ++j)
+   int packet = glm::clamp(opts.packet_size, 0, MAX_PACKET_SIZE);
+   /* Breadth first, the tiles only record the primary hits. */
+   bool streams = opts.sort_reflections && k > 0;
+   RayStream first;
+   if (streams)
+      first.resize(static_cast<size_t>(xres) * yres);
+   auto finish = [&](int i, int j, const Ray &ray, size_t ck, real ct) {
+      uint pixel = static_cast<uint>(i * xres + j);
+      if (!streams)
       {
-         vec3 d = glm::normalize(dir + x * right + y * up);
-         Ray ray { .o = origin, .d = d };
-         col3 &out_color = output[i * xres + j];
-         if (k == 0)
-         {
-            real ct;
-            size_t ck = firstIntersection(ray, rtdata, &ct);
-            if (ck == static_cast<size_t>(-1))
-               out_color = col3(0);
-            else
+         output[pixel] = primaryColor(ray, rtdata, ck, ct, k, opts, hash(pixel));
+         return;
+      }
+      RAY_STAT(hits, ck != static_cast<size_t>(-1));
+      RAY_STAT(misses, ck == static_cast<size_t>(-1));
+      output[pixel] = col3(0);
+      first.rays[pixel] = ray;
+      first.t[pixel] = ct;
+      first.k[pixel] = ck;
+      first.pixels[pixel] = pixel;
+   };
+   int xtiles = (xres + TILE_SIZE - 1) / TILE_SIZE;
+   int ytiles = (yres + TILE_SIZE - 1) / TILE_SIZE;
+   auto renderTile = [&](int tile) {
+      int i0 = tile / xtiles * TILE_SIZE;
+      int j0 = tile % xtiles * TILE_SIZE;
+      int i1 = std::min(i0 + TILE_SIZE, yres);
+      int j1 = std::min(j0 + TILE_SIZE, xres);
+      if (packet == 0)
+      {
+         for (int i = i0; i < i1; ++i)
+            for (int j = j0; j < j1; ++j)
             {
-               const Material &mat = rtdata->materials[rtdata->mat_indices[ck]];
-               out_color = mat.ka + mat.kd;
+               Ray ray { .o = origin, .d = camera.direction(i, j) };
+               real ct;
+               size_t ck = rtdata->accel->closestHit(ray, &ct);
+               RAY_STAT(primary_rays, 1);
+               finish(i, j, ray, ck, ct);
             }
-         }
-         else
-            out_color = rayTrace(ray, rtdata, k);
-         x += 2;
+         return;
       }
-      y += 2;
-   }
+
+      for (int pi = i0; pi < i1; pi += packet)
+         for (int pj = j0; pj < j1; pj += packet)
+         {
+            int pi1 = std::min(pi + packet, i1), pj1 = std::min(pj + packet, j1);
+            RayPacket rp;
+            rp.o = origin;
+            rp.count = 0;
+            for (int i = pi; i < pi1; ++i)
+               for (int j = pj; j < pj1; ++j)
+                  rp.d[rp.count++] = camera.direction(i, j);
+            rtdata->accel->closestHitPacket(&rp);
+            RAY_STAT(primary_rays, rp.count);
+            int r = 0;
+            for (int i = pi; i < pi1; ++i)
+               for (int j = pj; j < pj1; ++j, ++r)
+                  finish(i, j, Ray { .o = origin, .d = rp.d[r] }, rp.k[r], rp.t[r]);
+         }
+   };
+
+   std::vector<ThreadStats> thread_stats(pool.size());
+   parallelStats(pool, xtiles * ytiles, &thread_stats,
+                 [&](uint tile) { renderTile(static_cast<int>(tile)); });
+   if (streams)
+      traceReflectionStreams(rtdata, k, opts, pool, &thread_stats, &first, output);
+
+   RenderStats stats {};
+   for (const ThreadStats &ts : thread_stats)
+      stats.rays += ts.rays;
+   stats.render_ms = timer.elapsed();
+   stats.threads = pool.size();
+   stats.xres = xres;
+   stats.yres = yres;
+   stats.k = k;
+   printRenderStats(stats);
+   return stats;
 }
 
-col3 rayTrace(const Ray &ray, RayTracerData *rtdata, int depth)
+ThreadPool &renderPool(int threads)
 {
-   if (depth == 0)
-      return col3(0);
+   static std::unique_ptr<ThreadPool> pool;
+   if (!pool || (threads > 0 && pool->size() != threads))
+      pool = std::make_unique<ThreadPool>(threads);
+   return *pool;
+}
 
-   real ct;
-   size_t ck = firstIntersection(ray, rtdata, &ct);
+col3 primaryColor(const Ray &ray, RayTracerData *rtdata, size_t ck, real ct, int k,
+                  const RenderOptions &opts, uint seed)
+{
+   RAY_STAT(hits, ck != static_cast<size_t>(-1));
+   RAY_STAT(misses, ck == static_cast<size_t>(-1));
+   if (k > 0)
+      return rayTrace(ray, rtdata, ck, ct, k, opts, seed);
    if (ck == static_cast<size_t>(-1))
       return col3(0);
+   const Material &mat = hitMaterial(rtdata, ck);
+   return mat.ka + mat.kd;
+}
 
-   size_t len = rtdata->tris.size();
-   vec3 cp = ray.o + ct * ray.d;
-   vec3 n = rtdata->normals[ck];
-   vec3 r = glm::reflect(ray.d, n);
-   const Material &mdata = rtdata->materials[rtdata->mat_indices[ck]];
-   col3 diffuse(0), specular(0);
+const Material &hitMaterial(const RayTracerData *rtdata, size_t ck)
+{
+   const Mesh &mesh = rtdata->meshes[rtdata->instances[hitInstance(ck)].mesh];
+   return rtdata->materials[mesh.mat_indices[hitTriangle(ck)]];
+}
 
-   for (const Light& light : rtdata->lights)
+/*
+ * Follows the mirror reflection chain from the hit (ck, ct) for up to `depth`
+ * hits, carrying the product of reflection weights. Once that throughput
+ * drops below opts.min_throughput the chain either stops or, with Russian
+ * roulette, survives with probability proportional to it and is reweighted.
+ */
+col3 rayTrace(const Ray &ray, RayTracerData *rtdata, size_t ck, real ct, int depth,
+              const RenderOptions &opts, uint seed)
+{
+   col3 color(0), throughput(1);
+   Ray cur = ray;
+   uint rng = seed;
+   while (ck != static_cast<size_t>(-1))
    {
-      vec3 l = light.position - cp;
-      Ray lr = { .o = cp, .d = l };
-      bool block = false;
+      Ray next;
+      col3 weight;
+      color += throughput * shade(cur, rtdata, ck, ct, opts, &next, &weight);
+      if (--depth == 0 || !continuePath(weight, opts, &throughput, &rng))
+         break;
 
-      for (size_t k = 0; k < len; ++k)
-      {
-         real t;
-         if (k != ck && rayTriangleIntersection(lr, rtdata->tris[k], &t) && t > EPS && t < 1-EPS)
+      cur = next;
+      ck = rtdata->accel->closestHit(cur, &ct);
+      RAY_STAT(reflection_rays, 1);
+      RAY_STAT(hits, ck != static_cast<size_t>(-1));
+      RAY_STAT(misses, ck == static_cast<size_t>(-1));
+   }
+   return color;
+}
+
+bool continuePath(const col3 &weight, const RenderOptions &opts, col3 *throughput, uint *rng)
+{
+   *throughput *= weight;
+   if (opts.min_throughput <= 0)
+      return true;
+   /* Weights go negative where the shading normal faces away from the mirror ray. */
+   col3 a = glm::abs(*throughput);
+   float w = glm::max(a.r, glm::max(a.g, a.b));
+   if (w >= opts.min_throughput)
+      return true;
+   if (!opts.russian_roulette)
+      return false;
+   float survive = w / opts.min_throughput;
+   *rng = hash(*rng);
+   if (static_cast<float>(*rng >> 8) * 0x1p-24f >= survive)
+      return false;
+   *throughput /= survive;
+   return true;
+}
+
+/*
+ * Reflections breadth first, from the primary hits of every pixel in the
+ * stream. Each bounce shades all paths, then sorts the reflection rays left
+ * into coherent order and traces them in batches. A path takes the same
+ * decisions as in rayTrace, so the image does not change.
+ */
+void traceReflectionStreams(RayTracerData *rtdata, int k, const RenderOptions &opts,
+                            ThreadPool &pool, std::vector<ThreadStats> *thread_stats,
+                            RayStream *stream, col3 *output)
+{
+   size_t pixels = stream->size();
+   std::vector<col3> throughput(pixels, col3(1));
+   std::vector<uint> rng(pixels);
+   std::vector<char> alive(pixels);
+   for (size_t p = 0; p < pixels; ++p)
+   {
+      rng[p] = hash(static_cast<uint>(p));
+      alive[p] = stream->k[p] != static_cast<size_t>(-1);
+   }
+   sortStream(stream, alive);
+
+   for (int depth = k; stream->size() > 0; --depth)
+   {
+      uint n = static_cast<uint>(stream->size());
+      RayStream next;
+      next.resize(n);
+      alive.assign(n, false);
+      parallelStats(pool, (n + STREAM_BATCH_SIZE - 1) / STREAM_BATCH_SIZE, thread_stats,
+                    [&](uint batch) {
+         uint end = std::min(n, (batch + 1) * STREAM_BATCH_SIZE);
+         for (uint i = batch * STREAM_BATCH_SIZE; i < end; ++i)
          {
-            block = true;
-            break;
+            uint p = stream->pixels[i];
+            col3 weight;
+            output[p] += throughput[p] * shade(stream->rays[i], rtdata, stream->k[i],
+                                              stream->t[i], opts, &next.rays[i], &weight);
+            next.pixels[i] = p;
+            alive[i] = depth > 1 && continuePath(weight, opts, &throughput[p], &rng[p]);
          }
+      });
+      sortStream(&next, alive);
+
+      n = static_cast<uint>(next.size());
+      parallelStats(pool, (n + STREAM_BATCH_SIZE - 1) / STREAM_BATCH_SIZE, thread_stats,
+                    [&](uint batch) {
+         uint begin = batch * STREAM_BATCH_SIZE;
+         uint count = std::min(n - begin, STREAM_BATCH_SIZE);
+         rtdata->accel->closestHitBatch(&next.rays[begin], static_cast<int>(count),
+                                        &next.t[begin], &next.k[begin]);
+         RAY_STAT(reflection_rays, count);
+         for (uint i = begin; i < begin + count; ++i)
+         {
+            RAY_STAT(hits, next.k[i] != static_cast<size_t>(-1));
+            RAY_STAT(misses, next.k[i] == static_cast<size_t>(-1));
+         }
+      });
+
+      /* Misses end their paths; the order of the rest holds. */
+      uint hits = 0;
+      for (uint i = 0; i < n; ++i)
+      {
+         if (next.k[i] == static_cast<size_t>(-1))
+            continue;
+         next.rays[hits] = next.rays[i];
+         next.t[hits] = next.t[i];
+         next.k[hits] = next.k[i];
+         next.pixels[hits++] = next.pixels[i];
       }
-      if (block)
+      next.resize(hits);
+      *stream = std::move(next);
+   }
+}
+
+/*
+ * Drops the rays not alive and orders the rest by direction octant, then
+ * along a Morton curve through their origins, so that the rays of a batch
+ * start close together and head the same way.
+ */
+void sortStream(RayStream *stream, const std::vector<char> &alive)
+{
+   AABB bounds { .min = vec3(std::numeric_limits<real>::infinity()),
+                 .max = vec3(-std::numeric_limits<real>::infinity()) };
+   for (size_t i = 0; i < stream->size(); ++i)
+      if (alive[i])
+         bounds.grow(stream->rays[i].o);
+   vec3 extent = bounds.max - bounds.min;
+   vec3 scale;
+   for (int axis = 0; axis < 3; ++axis)
+      scale[axis] = extent[axis] > 0 ? ((1 << MORTON_BITS) - 1) / extent[axis] : 0;
+
+   /* Octant in the top 3 bits, the Morton code in the next 30, the entry below. */
+   std::vector<uint64_t> keys;
+   for (size_t i = 0; i < stream->size(); ++i)
+   {
+      if (!alive[i])
          continue;
+      const Ray &ray = stream->rays[i];
+      vec3 q = (ray.o - bounds.min) * scale;
+      uint64_t code = expandBits(static_cast<uint>(q.x)) << 2 |
+                      expandBits(static_cast<uint>(q.y)) << 1 |
+                      expandBits(static_cast<uint>(q.z));
+      uint64_t octant = (ray.d.x < 0) | (ray.d.y < 0) << 1 | (ray.d.z < 0) << 2;
+      keys.push_back(octant << 61 | code << 31 | i);
+   }
+   std::sort(keys.begin(), keys.end());
+
+   RayStream sorted;
+   sorted.resize(keys.size());
+   for (size_t j = 0; j < keys.size(); ++j)
+   {
+      size_t i = keys[j] & 0x7FFFFFFF;
+      sorted.rays[j] = stream->rays[i];
+      sorted.t[j] = stream->t[i];
+      sorted.k[j] = stream->k[i];
+      sorted.pixels[j] = stream->pixels[i];
+   }
+   *stream = std::move(sorted);
+}
+
+/* Phong lighting at the hit, plus the mirror ray and the weight it is added with. */
+col3 shade(const Ray &ray, RayTracerData *rtdata, size_t ck, real ct,
+           const RenderOptions &opts, Ray *next, col3 *weight)
+{
+   SurfacePoint sp = surfacePoint(ray, rtdata, ck, ct, opts);
+   col3 diffuse(0), specular(0);
+
+   /* The shadow rays of all lights go out in batches. */
+   const std::vector<Light> &lights = rtdata->lights;
+   for (size_t first = 0; first < lights.size(); first += SHADOW_BATCH_SIZE)
+   {
+      int count = static_cast<int>(std::min<size_t>(SHADOW_BATCH_SIZE, lights.size() - first));
+      Ray rays[SHADOW_BATCH_SIZE];
+      real tmax[SHADOW_BATCH_SIZE];
+      size_t skip[SHADOW_BATCH_SIZE];
+      bool hit[SHADOW_BATCH_SIZE];
+      for (int i = 0; i < count; ++i)
+         rays[i] = shadowRay(sp, lights[first + i], ck, &tmax[i], &skip[i]);
+      RAY_STAT(shadow_rays, count);
+      rtdata->accel->occludedBatch(rays, tmax, skip, count, hit);
+
+      for (int i = 0; i < count; ++i)
+      {
+         if (hit[i])
+            RAY_STAT(occluded, 1);
+         else
+            addLight(sp, lights[first + i], &diffuse, &specular);
+      }
+   }
+
+   *next = reflectedRay(sp, weight);
+   return surfaceColor(sp, diffuse, specular);
+}
+
+SurfacePoint surfacePoint(const Ray &ray, const RayTracerData *rtdata, size_t ck, real ct,
+                          const RenderOptions &opts)
+{
+   const Instance &inst = rtdata->instances[hitInstance(ck)];
+   const Mesh &mesh = rtdata->meshes[inst.mesh];
+   uint tri = hitTriangle(ck);
+   SurfacePoint sp;
+   sp.p = ray.o + ct * ray.d;
+   sp.n = inst.normalToWorld(shadingNormal(inst.toObject(ray), ct, mesh, tri,
+                                           opts.smooth_normals));
+   sp.r = glm::reflect(ray.d, sp.n);
+   sp.mat = &hitMaterial(rtdata, ck);
 
-      real d = glm::length(l);
-      l /= d;
-      float diff = glm::max(glm::dot(l, n), real(0));
-      float d_coeff = 1 / (A*d*d + B*d + C);
-      col3 coeff = d_coeff * light.intensity * light.color;
-      diffuse += diff * coeff;
-      float spec = glm::pow(glm::max(glm::dot(r, l), real(0)), SPECULAR_POW_FACTOR);
-      specular += spec * coeff;
+   /* With the watertight test, rays leave from origins offset off the
+    * triangle, to the side they head to, rather than skipping it. */
+   sp.offset = rtdata->accel->triangleTest() == TriangleTest::Watertight;
+   sp.ng = vec3(0);
+   if (sp.offset)
+   {
+      Triangle t = mesh.triangle(tri);
+      sp.ng = inst.normalToWorld(glm::normalize(glm::cross(t.bar.u, t.bar.v)));
+      if (glm::dot(sp.ng, ray.d) > 0)
+         sp.ng = -sp.ng;
    }
+   return sp;
+}
 
-   Ray nray = { .o = cp, .d = r };
-   col3 color = mdata.ka + diffuse * mdata.kd + specular * mdata.ks;
-   float diff = glm::dot(n, r);
-   col3 rtcolor = REFLECT_DAMP_FACTOR * (diff * mdata.kd + mdata.ks) * rayTrace(nray, rtdata, depth-1);
-   return color + rtcolor;
+/*
+ * Vertex normals of triangle tri interpolated at the hit t along the object
+ * space ray, or the face normal when not smooth. The block kernels only
+ * report distances, so the barycentrics are worked out here for the one
+ * triangle that won, from the hit point rather than by testing again: the
+ * triangle tests agree on where the hit is, not on which edge hits count.
+ */
+vec3 shadingNormal(const Ray &ray, real t, const Mesh &mesh, uint tri, bool smooth)
+{
+   Triangle face = mesh.triangle(tri);
+   if (!smooth)
+      return glm::normalize(glm::cross(face.bar.u, face.bar.v));
+   const uint *idx = &mesh.indices[3 * tri];
+   real u, v;
+   triangleBarycentrics(face, ray.o + t * ray.d, &u, &v);
+   vec3 n = (1 - u - v) * mesh.normals[idx[0]] + u * mesh.normals[idx[1]] +
+            v * mesh.normals[idx[2]];
+   return glm::normalize(n);
 }
 
-size_t firstIntersection(const Ray &ray, RayTracerData *rtdata, real *ct)
+Ray shadowRay(const SurfacePoint &sp, const Light &light, size_t ck, real *tmax, size_t *skip)
 {
-   size_t len = rtdata->tris.size(), ck = -1;
-   *ct = std::numeric_limits<real>::infinity();
-   for (size_t k = 0; k < len; ++k)
+   *tmax = 1-EPS;
+   if (!sp.offset)
    {
-      real t;
-      if (rayTriangleIntersection(ray, rtdata->tris[k], &t) && t > EPS && t < *ct)
-         *ct = t, ck = k;
+      *skip = ck;
+      return Ray { .o = sp.p, .d = light.position - sp.p };
    }
-   return ck;
+   vec3 l = light.position - sp.p;
+   vec3 o = offsetRayOrigin(sp.p, glm::dot(sp.ng, l) < 0 ? -sp.ng : sp.ng);
+   *skip = -1;
+   return Ray { .o = o, .d = light.position - o };
+}
+
+void addLight(const SurfacePoint &sp, const Light &light, col3 *diffuse, col3 *specular)
+{
+   vec3 l = light.position - sp.p;
+   real d = glm::length(l);
+   l /= d;
+   float diff = glm::max(glm::dot(l, sp.n), real(0));
+   float d_coeff = 1 / (A*d*d + B*d + C);
+   col3 coeff = d_coeff * light.intensity * light.color;
+   *diffuse += diff * coeff;
+   float spec = glm::pow(glm::max(glm::dot(sp.r, l), real(0)), SPECULAR_POW_FACTOR);
+   *specular += spec * coeff;
+}
+
+col3 surfaceColor(const SurfacePoint &sp, const col3 &diffuse, const col3 &specular)
+{
+   return sp.mat->ka + diffuse * sp.mat->kd + specular * sp.mat->ks;
+}
+
+Ray reflectedRay(const SurfacePoint &sp, col3 *weight)
+{
+   float diff = glm::dot(sp.n, sp.r);
+   *weight = REFLECT_DAMP_FACTOR * (diff * sp.mat->kd + sp.mat->ks);
+   return Ray { .o = sp.offset ? offsetRayOrigin(sp.p, sp.ng) : sp.p, .d = sp.r };
+}
+
+uint hash(uint x)
+{
+   x ^= x >> 16;
+   x *= 0x7feb352dU;
+   x ^= x >> 15;
+   x *= 0x846ca68bU;
+   x ^= x >> 16;
+   return x;
 }
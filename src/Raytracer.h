@@ -4,6 +4,8 @@
 
 #include <vector>
 
+#include "RayStats.h"
+
 #define EPS 0.000001
 
 using uint = unsigned int;
@@ -27,6 +29,44 @@ struct Triangle
    };
 };
 
+static constexpr int TRI_BLOCK_SIZE = 8;
+
+/*
+ * Structure-of-arrays pack of TRI_BLOCK_SIZE triangles, tested against one ray
+ * at a time by the SIMD kernels. Unused lanes hold degenerate triangles with
+ * id -1, which never pass the determinant test.
+ */
+struct alignas(32) TriangleBlock
+{
+   real px[TRI_BLOCK_SIZE], py[TRI_BLOCK_SIZE], pz[TRI_BLOCK_SIZE];
+   real ux[TRI_BLOCK_SIZE], uy[TRI_BLOCK_SIZE], uz[TRI_BLOCK_SIZE];
+   real vx[TRI_BLOCK_SIZE], vy[TRI_BLOCK_SIZE], vz[TRI_BLOCK_SIZE];
+   uint ids[TRI_BLOCK_SIZE];
+};
+
+/*
+ * The same triangles as affine maps into their barycentric frame (Baldwin and
+ * Weber): row r takes a point p to m[r][0..2] . p + m[r][3], giving the
+ * barycentric u and v for rows 0 and 1 and the offset from the plane along
+ * the normal for row 2. Unused or degenerate lanes are all zeros.
+ */
+struct alignas(32) TransformBlock
+{
+   real m[3][4][TRI_BLOCK_SIZE];
+   uint ids[TRI_BLOCK_SIZE];
+};
+
+/*
+ * The same triangles by their exact mesh vertices, v[vertex][axis][lane],
+ * for the watertight test: shared edges are then evaluated from bit-equal
+ * inputs on both sides. Unused lanes are NaN, which fails every comparison.
+ */
+struct alignas(32) VertexBlock
+{
+   real v[3][3][TRI_BLOCK_SIZE];
+   uint ids[TRI_BLOCK_SIZE];
+};
+
 struct Material
 {
    col3 ka;
@@ -47,14 +87,114 @@ struct Ray
    vec3 d;
 };
 
+static constexpr int MAX_PACKET_SIZE = 8;
+static constexpr int MAX_PACKET_RAYS = MAX_PACKET_SIZE * MAX_PACKET_SIZE;
+
+/* Coherent rays sharing an origin, traced through the BVH together. */
+struct RayPacket
+{
+   vec3 o;
+   int count;
+   vec3 d[MAX_PACKET_RAYS];
+   real t[MAX_PACKET_RAYS]; // closest hit distances, filled by the query
+   size_t k[MAX_PACKET_RAYS]; // closest hit ids or -1
+};
+
+/* Hits name the instance and the triangle of its mesh in one id, -1 for none.
+ * Ids order like a scan over the instances and then their triangles. */
+inline size_t hitId(uint instance, uint triangle)
+{
+   return static_cast<size_t>(instance) << 32 | triangle;
+}
+
+inline uint hitInstance(size_t id)
+{
+   return static_cast<uint>(id >> 32);
+}
+
+inline uint hitTriangle(size_t id)
+{
+   return static_cast<uint>(id);
+}
+
+/*
+ * Triangles as a shared vertex buffer and one index triple per triangle,
+ * the layout Assimp hands out after aiProcess_JoinIdenticalVertices. It is
+ * read to build the acceleration structure and for the vertex attributes
+ * of shaded hits; intersection runs on the precomputed TriangleBlocks.
+ */
+struct Mesh
+{
+   std::vector<vec3> vertices;
+   std::vector<vec3> normals; // per vertex
+   std::vector<uint> indices; // 3 per triangle
+   std::vector<uint> mat_indices; // per triangle
+
+   size_t triangleCount() const
+   {
+      return indices.size() / 3;
+   }
+
+   Triangle triangle(size_t i) const
+   {
+      Triangle tri;
+      tri.bar.P = vertices[indices[3 * i]];
+      tri.bar.u = vertices[indices[3 * i + 1]] - tri.bar.P;
+      tri.bar.v = vertices[indices[3 * i + 2]] - tri.bar.P;
+      return tri;
+   }
+};
+
+/*
+ * A mesh placed in the scene by a node of the Assimp hierarchy. Meshes are
+ * stored once, in their own object space, however many nodes use them.
+ */
+struct Instance
+{
+   uint mesh;
+   bool identity; // to_world is the identity, rays need no transform
+   glm::mat4 to_world;
+   glm::mat4 to_object;
+
+   Ray toObject(const Ray &ray) const
+   {
+      if (identity)
+         return ray;
+      return Ray { .o = vec3(to_object * glm::vec4(ray.o, 1)),
+                   .d = vec3(to_object * glm::vec4(ray.d, 0)) };
+   }
+
+   /* Object space normals go to world space by the inverse transpose. */
+   vec3 normalToWorld(const vec3 &n) const
+   {
+      if (identity)
+         return n;
+      return glm::normalize(vec3(glm::vec4(n, 0) * to_object));
+   }
+};
+
+struct Accelerator;
+
 struct RayTracerData
 {
-   std::vector<Triangle> tris;
-   std::vector<vec3> normals;
-   std::vector<uint> mat_indices;
+   std::vector<Mesh> meshes;
+   std::vector<Instance> instances;
    std::vector<Material> materials;
    std::vector<Light> lights;
+   const Accelerator *accel = nullptr; // answers the ray queries, must be set to trace
+};
+
+struct RenderOptions
+{
+   int threads = 0; // 0 = one per hardware thread
+   int packet_size = 8; // primary rays are traced in NxN packets, 0 = single rays
+   float min_throughput = 0.001f; // reflections weighted below this are cut off
+   bool russian_roulette = false; // randomly continue cut off reflections instead
+   bool smooth_normals = true; // interpolate vertex normals, else use the first vertex's
+   bool sort_reflections = false; // trace reflections a bounce at a time, in sorted batches
+   bool wavefront = false; // render in separate generate, extend, shade and shadow stages
 };
 
-void rayTrace(RayTracerData *rtdata, int xres, int yres, real focal_length,
-              vec3 origin, vec3 forward, vec3 right, int k, col3 *output);
+RenderStats rayTrace(RayTracerData *rtdata, int xres, int yres, real focal_length,
+                     vec3 origin, vec3 forward, vec3 right, int k,
+                     const RenderOptions &opts, col3 *output);
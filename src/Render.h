@@ -0,0 +1,96 @@
+#pragma once
+
+#include <vector>
+
+#include "Raytracer.h"
+#include "Utils/ThreadPool.h"
+
+/* Internals the depth-first renderer shares with the wavefront one. */
+
+static constexpr int TILE_SIZE = 16;
+static constexpr uint STREAM_BATCH_SIZE = 256; // rays per task of a bounce
+
+/* Per-thread slots padded to a cache line, so folding in counters never contends. */
+struct alignas(64) ThreadStats
+{
+   RayStats rays;
+};
+
+/* Rays of one bounce, with their hits and the pixels they add to. */
+struct RayStream
+{
+   std::vector<Ray> rays;
+   std::vector<real> t;
+   std::vector<size_t> k;
+   std::vector<uint> pixels;
+
+   size_t size() const
+   {
+      return rays.size();
+   }
+
+   void resize(size_t n)
+   {
+      rays.resize(n);
+      t.resize(n);
+      k.resize(n);
+      pixels.resize(n);
+   }
+};
+
+/* Primary ray directions through pixel row i and column j. */
+struct CameraRays
+{
+   vec3 dir; // to the image center, focal length long
+   vec3 right, up;
+   int xres, yres;
+
+   vec3 direction(int i, int j) const
+   {
+      real x = static_cast<real>(2 * j - (xres - 1));
+      real y = static_cast<real>(2 * i - (yres - 1));
+      return glm::normalize(dir + x * right + y * up);
+   }
+};
+
+/* What shading a hit needs, worked out once for all of its lights. */
+struct SurfacePoint
+{
+   vec3 p;
+   vec3 n; // shading normal, world space
+   vec3 r; // mirror direction
+   vec3 ng; // geometric normal facing the ray, only with offset origins
+   bool offset; // secondary rays leave from origins offset off the surface
+   const Material *mat;
+};
+
+ThreadPool &renderPool(int threads);
+uint hash(uint x);
+
+const Material &hitMaterial(const RayTracerData *rtdata, size_t ck);
+SurfacePoint surfacePoint(const Ray &ray, const RayTracerData *rtdata, size_t ck, real ct,
+                          const RenderOptions &opts);
+/* The ray to occlusion test towards light from the hit ck. */
+Ray shadowRay(const SurfacePoint &sp, const Light &light, size_t ck, real *tmax, size_t *skip);
+/* Phong terms of a light the hit sees. */
+void addLight(const SurfacePoint &sp, const Light &light, col3 *diffuse, col3 *specular);
+col3 surfaceColor(const SurfacePoint &sp, const col3 &diffuse, const col3 &specular);
+/* The mirror ray and the weight its color is added with. */
+Ray reflectedRay(const SurfacePoint &sp, col3 *weight);
+/* Applies the weight of the next reflection to the path; false if it ends here. */
+bool continuePath(const col3 &weight, const RenderOptions &opts, col3 *throughput, uint *rng);
+void sortStream(RayStream *stream, const std::vector<char> &alive);
+
+RenderStats rayTraceWavefront(RayTracerData *rtdata, int xres, int yres, const CameraRays &camera,
+                              vec3 origin, int k, const RenderOptions &opts, col3 *output);
+
+/* Runs job(task) for every task on the pool, folding in the ray counters of each thread. */
+template<class Job>
+void parallelStats(ThreadPool &pool, uint count, std::vector<ThreadStats> *thread_stats, Job job)
+{
+   pool.parallelFor(count, [&](uint task, int thread) {
+      t_ray_stats = {};
+      job(task);
+      (*thread_stats)[thread].rays += t_ray_stats;
+   });
+}
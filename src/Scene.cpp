@@ -0,0 +1,437 @@
+#include "Scene.h"
+
+#include <cassert>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+
+#include <assimp/config.h>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+#include <assimp/Importer.hpp>
+#include <assimp/material.h>
+
+#include "Accel/TopLevelBVH.h"
+#include "Utils/Binary.h"
+#include "Utils/Log.h"
+#include "Utils/Timer.h"
+
+namespace fs = std::filesystem;
+
+static constexpr char SCENE_CACHE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+static constexpr uint32_t SCENE_CACHE_VERSION = 6;
+/* Generated vertex normals are not averaged across sharper edges than this. */
+static constexpr float MAX_SMOOTHING_ANGLE = 80;
+
+struct FileStamp
+{
+   uint64_t size;
+   int64_t mtime;
+   uint64_t hash;
+};
+
+/* A mesh as placed by one node of the hierarchy. */
+struct MeshRef
+{
+   uint mesh;
+   aiMatrix4x4 transform;
+};
+
+static std::string cachePath(const std::string &path);
+static std::vector<std::string> sceneDependencies(const std::string &path);
+static bool fileStamp(const std::string &path, bool with_hash, FileStamp *stamp);
+static void rewriteStamps(const std::string &path, size_t offset,
+                          const std::vector<FileStamp> &stamps);
+static void collectMeshRefs(const aiNode *node, const aiMatrix4x4 &parent,
+                            std::vector<MeshRef> *refs);
+static glm::mat4 toGlm(const aiMatrix4x4 &m);
+static Instance makeInstance(uint mesh, const glm::mat4 &to_world);
+static void reportScene(const RayTracerData &rtdata);
+
+/*
+ * Meshes placed by a single node are baked into world space and merged into
+ * one static mesh, so a plain OBJ file becomes a single untransformed
+ * instance. Meshes placed by several nodes are kept once in object space
+ * with an instance per node.
+ */
+void loadScene(const std::string &path, RayTracerData *rtdata, RenderData *rdata,
+               float *dist_bound)
+{
+   Timer timer("Scene Import");
+
+   Assimp::Importer importer;
+   importer.SetPropertyFloat(AI_CONFIG_PP_GSN_MAX_SMOOTHING_ANGLE, MAX_SMOOTHING_ANGLE);
+   const aiScene *scene = importer.ReadFile(path.c_str(),
+                                            aiProcess_Triangulate | aiProcess_GenSmoothNormals |
+                                            aiProcess_FlipUVs | aiProcess_JoinIdenticalVertices);
+   if (!scene)
+      ERROR(importer.GetErrorString());
+
+   std::vector<MeshRef> refs;
+   collectMeshRefs(scene->mRootNode, aiMatrix4x4(), &refs);
+   std::vector<uint> ref_counts(scene->mNumMeshes, 0);
+   for (const MeshRef &ref : refs)
+      ref_counts[ref.mesh]++;
+
+   // Precalculate some values from objects in the scene.
+   {
+      constexpr float inf = std::numeric_limits<float>::infinity();
+      glm::vec3 min_point(inf);
+      glm::vec3 max_point(-inf);
+      for (const MeshRef &ref : refs)
+      {
+         const aiMesh *mesh = scene->mMeshes[ref.mesh];
+         const aiVector3D *verts = mesh->mVertices;
+         bool identity = ref.transform.IsIdentity();
+
+         for (uint j = 0; j < mesh->mNumVertices; ++j)
+         {
+            aiVector3D v = identity ? verts[j] : ref.transform * verts[j];
+            max_point.x = std::max(max_point.x, v.x);
+            max_point.y = std::max(max_point.y, v.y);
+            max_point.z = std::max(max_point.z, v.z);
+            min_point.x = std::min(min_point.x, v.x);
+            min_point.y = std::min(min_point.y, v.y);
+            min_point.z = std::min(min_point.z, v.z);
+         }
+      }
+      *dist_bound = glm::length(max_point - min_point);
+   }
+
+   rtdata->materials.reserve(scene->mNumMeshes);
+   for (uint i = 0; i < scene->mNumMeshes; ++i)
+   {
+      const aiMaterial *mat = scene->mMaterials[scene->mMeshes[i]->mMaterialIndex];
+      aiColor3D ka, kd, ks;
+      mat->Get(AI_MATKEY_COLOR_AMBIENT, ka);
+      mat->Get(AI_MATKEY_COLOR_DIFFUSE, kd);
+      mat->Get(AI_MATKEY_COLOR_SPECULAR, ks);
+
+      Material material {
+         col3(ka.r, ka.g, ka.b),
+         col3(kd.r, kd.g, kd.b),
+         col3(ks.r, ks.g, ks.b)
+      };
+      rtdata->materials.push_back(material);
+   }
+
+   /* Appends aiMesh i to out, moved by transform or else only scaled down. */
+   auto appendMesh = [&](uint i, const aiMatrix4x4 *transform, Mesh *out) {
+      const aiMesh *mesh = scene->mMeshes[i];
+      const Material &material = rtdata->materials[i];
+      aiMatrix3x3 normal_transform;
+      bool flip = false;
+      if (transform)
+      {
+         normal_transform = aiMatrix3x3(*transform).Inverse().Transpose();
+         flip = transform->Determinant() < 0;
+      }
+      uint index_offset = static_cast<uint>(out->vertices.size());
+
+      for (uint j = 0; j < mesh->mNumVertices; ++j)
+      {
+         aiVector3D v = transform ? *transform * mesh->mVertices[j] : mesh->mVertices[j];
+         aiVector3D n = mesh->mNormals[j];
+         if (transform)
+            n = (normal_transform * n).Normalize();
+         else
+            v /= *dist_bound;
+
+         out->vertices.push_back(vec3(v.x, v.y, v.z));
+         out->normals.push_back(vec3(n.x, n.y, n.z));
+         rdata->kas.push_back(material.ka);
+         rdata->kds.push_back(material.kd);
+         rdata->kss.push_back(material.ks);
+      }
+
+      for (uint j = 0; j < mesh->mNumFaces; ++j)
+      {
+         aiFace face = mesh->mFaces[j];
+         assert(face.mNumIndices == 3);
+
+         for (uint k = 0; k < face.mNumIndices; ++k)
+            out->indices.push_back(index_offset + face.mIndices[flip && k ? 3 - k : k]);
+         out->mat_indices.push_back(i);
+      }
+   };
+
+   /* Baked meshes go to world space and are scaled down with it. */
+   aiMatrix4x4 scale;
+   aiMatrix4x4::Scaling(aiVector3D(1 / *dist_bound), scale);
+   Mesh baked;
+   for (const MeshRef &ref : refs)
+   {
+      if (ref_counts[ref.mesh] != 1)
+         continue;
+      if (ref.transform.IsIdentity())
+      {
+         appendMesh(ref.mesh, nullptr, &baked);
+         continue;
+      }
+      aiMatrix4x4 to_world = scale * ref.transform;
+      appendMesh(ref.mesh, &to_world, &baked);
+   }
+   if (!baked.vertices.empty())
+   {
+      rtdata->meshes.push_back(std::move(baked));
+      rtdata->instances.push_back(makeInstance(0, glm::mat4(1)));
+   }
+
+   /* Shared meshes are scaled down in object space, which leaves only the
+    * translation of their transforms to scale. */
+   std::vector<uint> shared(scene->mNumMeshes, static_cast<uint>(-1));
+   for (const MeshRef &ref : refs)
+   {
+      if (ref_counts[ref.mesh] == 1)
+         continue;
+      if (shared[ref.mesh] == static_cast<uint>(-1))
+      {
+         shared[ref.mesh] = static_cast<uint>(rtdata->meshes.size());
+         appendMesh(ref.mesh, nullptr, &rtdata->meshes.emplace_back());
+      }
+      glm::mat4 to_world = toGlm(ref.transform);
+      to_world[3] = glm::vec4(glm::vec3(to_world[3]) / *dist_bound, 1);
+      rtdata->instances.push_back(makeInstance(shared[ref.mesh], to_world));
+   }
+   reportScene(*rtdata);
+}
+
+void collectMeshRefs(const aiNode *node, const aiMatrix4x4 &parent, std::vector<MeshRef> *refs)
+{
+   aiMatrix4x4 transform = parent * node->mTransformation;
+   for (uint i = 0; i < node->mNumMeshes; ++i)
+      refs->push_back(MeshRef { node->mMeshes[i], transform });
+   for (uint i = 0; i < node->mNumChildren; ++i)
+      collectMeshRefs(node->mChildren[i], transform, refs);
+}
+
+/* Assimp matrices are row-major, glm ones column-major. */
+glm::mat4 toGlm(const aiMatrix4x4 &m)
+{
+   glm::mat4 out;
+   for (int r = 0; r < 4; ++r)
+      for (int c = 0; c < 4; ++c)
+         out[c][r] = m[r][c];
+   return out;
+}
+
+Instance makeInstance(uint mesh, const glm::mat4 &to_world)
+{
+   return Instance { .mesh = mesh, .identity = to_world == glm::mat4(1),
+                     .to_world = to_world, .to_object = glm::inverse(to_world) };
+}
+
+void reportScene(const RayTracerData &rtdata)
+{
+   constexpr float MB = 1024 * 1024;
+   size_t triangles = 0, vertices = 0, bytes = 0, placed = 0;
+   for (const Mesh &mesh : rtdata.meshes)
+   {
+      triangles += mesh.triangleCount();
+      vertices += mesh.vertices.size();
+      bytes += mesh.vertices.size() * sizeof(vec3) + mesh.indices.size() * sizeof(uint);
+   }
+   for (const Instance &inst : rtdata.instances)
+      placed += rtdata.meshes[inst.mesh].triangleCount();
+   print("[Scene] triangles: ", triangles, ", vertices: ", vertices, ", mesh: ", bytes / MB,
+         " MB (", placed * sizeof(Triangle) / MB, " MB as triangle copies)");
+   if (rtdata.instances.size() > 1)
+      print("[Scene] meshes: ", rtdata.meshes.size(), ", instances: ", rtdata.instances.size(),
+            ", placed triangles: ", placed);
+}
+
+std::string cachePath(const std::string &path)
+{
+   return path + ".rtcache";
+}
+
+/* The model itself and every material library it references. */
+std::vector<std::string> sceneDependencies(const std::string &path)
+{
+   std::vector<std::string> deps = { path };
+   std::string dir = fs::path(path).parent_path().string();
+   std::ifstream in(path);
+   std::string line;
+   while (std::getline(in, line))
+   {
+      if (line.rfind("mtllib ", 0) != 0)
+         continue;
+      std::string name = line.substr(7);
+      while (!name.empty() && std::isspace(static_cast<unsigned char>(name.back())))
+         name.pop_back();
+      deps.push_back((fs::path(dir) / name).string());
+   }
+   return deps;
+}
+
+bool fileStamp(const std::string &path, bool with_hash, FileStamp *stamp)
+{
+   std::error_code ec;
+   stamp->size = fs::file_size(path, ec);
+   if (ec)
+      return false;
+   stamp->mtime = fs::last_write_time(path, ec).time_since_epoch().count();
+   if (ec)
+      return false;
+   stamp->hash = with_hash ? hashFile(path) : 0;
+   return true;
+}
+
+bool readSceneCache(const std::string &path, RayTracerData *rtdata, RenderData *rdata,
+                    TopLevelBVH *bvh, float *dist_bound)
+{
+   Timer timer("Scene Cache Read");
+
+   BinaryReader in(cachePath(path));
+   if (!in.good())
+      return false;
+
+   char magic[8];
+   uint32_t version;
+   if (!in.read(&magic) || std::memcmp(magic, SCENE_CACHE_MAGIC, sizeof(magic)) != 0 ||
+       !in.read(&version) || version != SCENE_CACHE_VERSION)
+   {
+      print("[Scene Cache] ", cachePath(path), " has an unknown format, ignoring it.");
+      return false;
+   }
+
+   std::vector<char> dep_names;
+   std::vector<FileStamp> stamps;
+   if (!in.readVector(&dep_names))
+      return false;
+   size_t stamps_offset = in.position() + sizeof(uint64_t);
+   if (!in.readVector(&stamps))
+      return false;
+   std::vector<std::string> deps;
+   std::string name;
+   for (char c : dep_names)
+   {
+      if (c)
+         name += c;
+      else
+         deps.push_back(name), name.clear();
+   }
+   if (deps.size() != stamps.size() || deps.empty() || deps[0] != path)
+      return false;
+   /* Unchanged size and mtime are trusted, otherwise fall back to the content hash.
+    * Files only touched get their new mtime stored, so later runs trust it again. */
+   bool touched = false;
+   for (size_t i = 0; i < deps.size(); ++i)
+   {
+      FileStamp cur;
+      bool same = fileStamp(deps[i], false, &cur) && cur.size == stamps[i].size;
+      if (same && cur.mtime != stamps[i].mtime)
+      {
+         same = hashFile(deps[i]) == stamps[i].hash;
+         stamps[i].mtime = cur.mtime;
+         touched = true;
+      }
+      if (!same)
+      {
+         print("[Scene Cache] ", deps[i], " changed, rebuilding the cache.");
+         return false;
+      }
+   }
+
+   /* Read into temporaries, so a truncated cache leaves the outputs untouched. */
+   float bound;
+   uint64_t mesh_count;
+   RayTracerData scene;
+   RenderData render;
+   TopLevelBVH tree;
+   bool ok = in.read(&bound) && in.read(&mesh_count) && mesh_count <= UINT32_MAX;
+   if (ok)
+      scene.meshes.resize(mesh_count);
+   for (Mesh &mesh : scene.meshes)
+      ok = ok && in.readVector(&mesh.vertices) &&
+           in.readVector(&mesh.normals) &&
+           in.readVector(&mesh.indices) &&
+           in.readVector(&mesh.mat_indices);
+   ok = ok && in.readVector(&scene.instances) &&
+        in.readVector(&scene.materials) &&
+        in.readVector(&render.kas) &&
+        in.readVector(&render.kds) &&
+        in.readVector(&render.kss) &&
+        tree.read(&in) && tree.mesh_bvhs.size() == scene.meshes.size();
+   if (!ok)
+   {
+      print("[Scene Cache] ", cachePath(path), " is truncated, ignoring it.");
+      return false;
+   }
+   *dist_bound = bound;
+   rtdata->meshes = std::move(scene.meshes);
+   rtdata->instances = std::move(scene.instances);
+   rtdata->materials = std::move(scene.materials);
+   *rdata = std::move(render);
+   *bvh = std::move(tree);
+   bvh->buildTopLevel(rtdata->instances);
+   bvh->report();
+   if (touched)
+      rewriteStamps(cachePath(path), stamps_offset, stamps);
+   print("[Scene Cache] Loaded ", cachePath(path), ".");
+   reportScene(*rtdata);
+   return true;
+}
+
+/* Overwrites the stamps stored at offset in the cache file, leaving the rest as it is. */
+void rewriteStamps(const std::string &path, size_t offset, const std::vector<FileStamp> &stamps)
+{
+   std::fstream out(path, std::ios::in | std::ios::out | std::ios::binary);
+   out.seekp(offset);
+   out.write(reinterpret_cast<const char*>(stamps.data()), stamps.size() * sizeof(FileStamp));
+   if (!out)
+      print("[Scene Cache] Failed to update the file stamps in ", path, ".");
+}
+
+void writeSceneCache(const std::string &path, const RayTracerData &rtdata,
+                     const RenderData &rdata, const TopLevelBVH &bvh, float dist_bound)
+{
+   Timer timer("Scene Cache Write");
+
+   std::vector<std::string> deps = sceneDependencies(path);
+   std::vector<char> dep_names;
+   std::vector<FileStamp> stamps(deps.size());
+   for (size_t i = 0; i < deps.size(); ++i)
+   {
+      if (!fileStamp(deps[i], true, &stamps[i]))
+         return;
+      dep_names.insert(dep_names.end(), deps[i].begin(), deps[i].end());
+      dep_names.push_back(0);
+   }
+
+   /* Write to a temporary file first, so readers never see a partial cache. */
+   std::string tmp_path = cachePath(path) + ".tmp";
+   {
+      BinaryWriter out(tmp_path);
+      out.write(SCENE_CACHE_MAGIC);
+      out.write(SCENE_CACHE_VERSION);
+      out.writeVector(dep_names);
+      out.writeVector(stamps);
+      out.write(dist_bound);
+      out.write<uint64_t>(rtdata.meshes.size());
+      for (const Mesh &mesh : rtdata.meshes)
+      {
+         out.writeVector(mesh.vertices);
+         out.writeVector(mesh.normals);
+         out.writeVector(mesh.indices);
+         out.writeVector(mesh.mat_indices);
+      }
+      out.writeVector(rtdata.instances);
+      out.writeVector(rtdata.materials);
+      out.writeVector(rdata.kas);
+      out.writeVector(rdata.kds);
+      out.writeVector(rdata.kss);
+      bvh.write(&out);
+      if (!out.good())
+      {
+         print("[Scene Cache] Failed to write ", tmp_path, ".");
+         return;
+      }
+   }
+   std::error_code ec;
+   fs::rename(tmp_path, cachePath(path), ec);
+   if (ec)
+      print("[Scene Cache] Failed to write ", cachePath(path), ": ", ec.message());
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Raytracer.h"
+
+struct TopLevelBVH;
+
+/* Per-vertex data for the OpenGL preview, over RayTracerData::meshes in
+ * order. Positions, normals and indices are shared with the meshes. */
+struct RenderData
+{
+   std::vector<col3> kas;
+   std::vector<col3> kds;
+   std::vector<col3> kss;
+};
+
+/* Imports the model at path scaled down by its bounding box diagonal, which
+ * is returned in dist_bound, with a mesh per geometry used by several nodes
+ * of its hierarchy and one for the rest. Lights are left untouched. */
+void loadScene(const std::string &path, RayTracerData *rtdata, RenderData *rdata,
+               float *dist_bound);
+
+/*
+ * Binary cache of an imported model and its mesh BVHs, kept next to it as
+ * `path.rtcache`. The cache records size, mtime and hash of the model and
+ * its material libraries and is ignored once any of them changed.
+ */
+bool readSceneCache(const std::string &path, RayTracerData *rtdata, RenderData *rdata,
+                    TopLevelBVH *bvh, float *dist_bound);
+void writeSceneCache(const std::string &path, const RayTracerData &rtdata,
+                     const RenderData &rdata, const TopLevelBVH &bvh, float dist_bound);
@@ -0,0 +1,58 @@
+#include "Binary.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+BinaryWriter::BinaryWriter(const std::string &path)
+   : m_Out(path, std::ios::binary | std::ios::trunc) {}
+
+bool BinaryWriter::good() const
+{
+   return m_Out.good();
+}
+
+BinaryReader::BinaryReader(const std::string &path)
+{
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0)
+      return;
+   struct stat st;
+   if (fstat(fd, &st) == 0 && st.st_size > 0)
+   {
+      void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED)
+      {
+         m_Data = static_cast<const char*>(data);
+         m_Size = st.st_size;
+      }
+   }
+   close(fd);
+}
+
+BinaryReader::~BinaryReader()
+{
+   if (m_Data)
+      munmap(const_cast<char*>(m_Data), m_Size);
+}
+
+bool BinaryReader::good() const
+{
+   return m_Data != nullptr;
+}
+
+uint64_t hashFile(const std::string &path)
+{
+   BinaryReader file(path);
+   if (!file.good())
+      return 0;
+   uint64_t hash = 0xcbf29ce484222325ULL;
+   unsigned char byte;
+   while (file.read(&byte))
+   {
+      hash ^= byte;
+      hash *= 0x100000001b3ULL;
+   }
+   return hash;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/* Sequential writer of trivially copyable values and vectors of them. */
+struct BinaryWriter
+{
+   BinaryWriter(const std::string &path);
+
+   bool good() const;
+
+   template<class T>
+   void write(const T &value)
+   {
+      static_assert(std::is_trivially_copyable_v<T>);
+      m_Out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+   }
+
+   template<class T>
+   void writeVector(const std::vector<T> &values)
+   {
+      static_assert(std::is_trivially_copyable_v<T>);
+      write<uint64_t>(values.size());
+      m_Out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+   }
+
+private:
+   std::ofstream m_Out;
+};
+
+/* Read-only memory mapping of a whole file, consumed front to back. */
+struct BinaryReader
+{
+   BinaryReader(const std::string &path);
+   ~BinaryReader();
+   BinaryReader(const BinaryReader&) = delete;
+   BinaryReader& operator=(const BinaryReader&) = delete;
+
+   bool good() const;
+
+   /* Bytes consumed so far. */
+   size_t position() const
+   {
+      return m_Pos;
+   }
+
+   template<class T>
+   bool read(T *value)
+   {
+      static_assert(std::is_trivially_copyable_v<T>);
+      if (m_Size - m_Pos < sizeof(T))
+         return false;
+      std::memcpy(value, m_Data + m_Pos, sizeof(T));
+      m_Pos += sizeof(T);
+      return true;
+   }
+
+   template<class T>
+   bool readVector(std::vector<T> *values)
+   {
+      static_assert(std::is_trivially_copyable_v<T>);
+      uint64_t count;
+      if (!read(&count) || (m_Size - m_Pos) / sizeof(T) < count)
+         return false;
+      values->resize(count);
+      std::memcpy(values->data(), m_Data + m_Pos, count * sizeof(T));
+      m_Pos += count * sizeof(T);
+      return true;
+   }
+
+private:
+   const char *m_Data = nullptr;
+   size_t m_Size = 0;
+   size_t m_Pos = 0;
+};
+
+/* 64-bit FNV-1a hash of a file's contents, 0 if it cannot be read. */
+uint64_t hashFile(const std::string &path);
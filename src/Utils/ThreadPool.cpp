@@ -0,0 +1,114 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int thread_count /* = 0 */)
+{
+   if (thread_count <= 0)
+      thread_count = std::max(1u, std::thread::hardware_concurrency());
+   m_Size = thread_count;
+   m_Queues = std::make_unique<Queue[]>(m_Size);
+   for (int i = 1; i < m_Size; ++i)
+      m_Threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Quit = true;
+   }
+   m_Wake.notify_all();
+   for (std::thread &thread : m_Threads)
+      thread.join();
+}
+
+int ThreadPool::size() const
+{
+   return m_Size;
+}
+
+void ThreadPool::parallelFor(unsigned count, const Job &job)
+{
+   if (count == 0)
+      return;
+
+   m_Job = &job;
+   m_Remaining = count;
+   /* Hand out contiguous ranges, so neighbouring tasks start on the same thread. */
+   for (int i = 0; i < m_Size; ++i)
+   {
+      unsigned begin = static_cast<unsigned>(static_cast<unsigned long>(count) * i / m_Size);
+      unsigned end = static_cast<unsigned>(static_cast<unsigned long>(count) * (i + 1) / m_Size);
+      std::lock_guard<std::mutex> lock(m_Queues[i].mutex);
+      for (unsigned task = begin; task < end; ++task)
+         m_Queues[i].tasks.push_back(task);
+   }
+   {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      ++m_Generation;
+   }
+   m_Wake.notify_all();
+
+   runTasks(0);
+
+   std::unique_lock<std::mutex> lock(m_Mutex);
+   m_Done.wait(lock, [this]() { return m_Remaining == 0; });
+   m_Job = nullptr;
+}
+
+void ThreadPool::workerLoop(int id)
+{
+   unsigned long seen = 0;
+   for (;;)
+   {
+      {
+         std::unique_lock<std::mutex> lock(m_Mutex);
+         m_Wake.wait(lock, [&]() { return m_Quit || m_Generation != seen; });
+         if (m_Quit)
+            return;
+         seen = m_Generation;
+      }
+      runTasks(id);
+   }
+}
+
+void ThreadPool::runTasks(int id)
+{
+   unsigned task;
+   while (popTask(id, &task))
+   {
+      (*m_Job)(task, id);
+      if (--m_Remaining == 0)
+      {
+         std::lock_guard<std::mutex> lock(m_Mutex);
+         m_Done.notify_all();
+      }
+   }
+}
+
+bool ThreadPool::popTask(int id, unsigned *task)
+{
+   {
+      Queue &own = m_Queues[id];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty())
+      {
+         *task = own.tasks.back();
+         own.tasks.pop_back();
+         return true;
+      }
+   }
+   for (int i = 1; i < m_Size; ++i)
+   {
+      Queue &victim = m_Queues[(id + i) % m_Size];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty())
+      {
+         *task = victim.tasks.front();
+         victim.tasks.pop_front();
+         return true;
+      }
+   }
+   return false;
+}
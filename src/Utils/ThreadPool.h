@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Persistent pool of worker threads. Every worker owns a task deque; it pops
+ * from the back of its own deque and steals from the front of the others
+ * once it runs dry, so uneven task costs balance out on their own.
+ */
+struct ThreadPool
+{
+   using Job = std::function<void(unsigned task, int thread)>;
+
+   ThreadPool(int thread_count = 0); // 0 = one thread per hardware thread
+   ~ThreadPool();
+
+   int size() const;
+   /* Runs job for every task in [0, count) and blocks until all are done.
+    * The calling thread takes part as thread 0. */
+   void parallelFor(unsigned count, const Job &job);
+
+private:
+   struct Queue
+   {
+      std::mutex mutex;
+      std::deque<unsigned> tasks;
+   };
+
+   void workerLoop(int id);
+   void runTasks(int id);
+   bool popTask(int id, unsigned *task);
+
+   int m_Size;
+   std::vector<std::thread> m_Threads;
+   std::unique_ptr<Queue[]> m_Queues;
+   const Job *m_Job = nullptr;
+   std::atomic<unsigned> m_Remaining { 0 };
+
+   std::mutex m_Mutex;
+   std::condition_variable m_Wake;
+   std::condition_variable m_Done;
+   unsigned long m_Generation = 0;
+   bool m_Quit = false;
+};
@@ -0,0 +1,352 @@
+#include "Render.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+
+#include "Accel/Accelerator.h"
+#include "Utils/Log.h"
+#include "Utils/Timer.h"
+
+enum WavefrontStage
+{
+   STAGE_GENERATE,
+   STAGE_EXTEND,
+   STAGE_SHADE,
+   STAGE_SHADOW,
+   STAGE_COUNT,
+};
+
+static const char *STAGE_NAMES[STAGE_COUNT] = { "generate", "extend", "shade", "shadow" };
+static constexpr size_t CHUNK_SHADOW_RAYS = 1 << 16; // in flight between shade and shadow
+
+/*
+ * State of all paths of a frame between the stages. The paths still going
+ * are entries of `rays`, and their reflections entries of `next`. Shade and
+ * shadow take the hits a chunk at a time: the shading buffers hold the hits
+ * of one chunk, and the shadow rays of its hit h are shadows[h * lights,
+ * (h + 1) * lights), so they do not grow with the resolution.
+ */
+struct Wavefront
+{
+   RayTracerData *rtdata;
+   const RenderOptions *opts;
+   ThreadPool *pool;
+   std::vector<ThreadStats> thread_stats;
+   col3 *output;
+
+   /* Per pixel. */
+   std::vector<col3> throughput;
+   std::vector<uint> rng;
+
+   RayStream rays;
+   std::vector<uint> packets; // first ray of every primary packet, then the ray count
+
+   std::vector<SurfacePoint> points;
+   std::vector<col3> weights; // throughput of the path up to the hit
+   RayStream next;
+   std::vector<char> alive; // next ray continues its path
+
+   size_t chunk; // hits per chunk
+   std::vector<Ray> shadows;
+   std::vector<real> shadow_tmax;
+   std::vector<size_t> shadow_skip;
+   std::unique_ptr<bool[]> occluded;
+};
+
+static void generateStage(Wavefront *wf, const CameraRays &camera, vec3 origin);
+static void extendStage(Wavefront *wf, bool primary);
+static void shadeStage(Wavefront *wf, int depth, size_t first, size_t count);
+static void shadowStage(Wavefront *wf, size_t first, size_t count);
+static void countHits(const RayStream &rays, size_t begin, size_t end);
+static void compactStream(RayStream *stream, const std::vector<char> &alive);
+static uint batchCount(size_t n, uint batch);
+
+/*
+ * Renders like rayTrace, but breadth first in stages over the whole frame:
+ * generate writes the primary rays, extend finds their hits, shade works
+ * out the lighting inputs, shadow rays and reflection rays of every hit,
+ * and shadow tests the shadow rays and adds the light. Extend, shade and
+ * shadow repeat per bounce. Paths take the same steps as in rayTrace, so
+ * the image is the same.
+ */
+RenderStats rayTraceWavefront(RayTracerData *rtdata, int xres, int yres, const CameraRays &camera,
+                              vec3 origin, int k, const RenderOptions &opts, col3 *output)
+{
+   Timer timer("Ray Tracing");
+   Wavefront wf;
+   wf.rtdata = rtdata;
+   wf.opts = &opts;
+   wf.pool = &renderPool(opts.threads);
+   wf.thread_stats.resize(wf.pool->size());
+   wf.output = output;
+   size_t lights = rtdata->lights.size();
+   wf.chunk = std::max<size_t>(STREAM_BATCH_SIZE, CHUNK_SHADOW_RAYS / std::max<size_t>(lights, 1));
+   wf.points.resize(wf.chunk);
+   wf.weights.resize(wf.chunk);
+   wf.shadows.resize(wf.chunk * lights);
+   wf.shadow_tmax.resize(wf.chunk * lights);
+   wf.shadow_skip.resize(wf.chunk * lights);
+   wf.occluded = std::make_unique<bool[]>(wf.chunk * lights);
+
+   /* Time since the last lap goes to stage s. */
+   float stage_ms[STAGE_COUNT] = {};
+   Timer::clock_t::time_point last = Timer::clock_t::now();
+   auto lap = [&](WavefrontStage s) {
+      Timer::clock_t::time_point now = Timer::clock_t::now();
+      stage_ms[s] += std::chrono::duration<float>(now - last).count() * 1000;
+      last = now;
+   };
+
+   generateStage(&wf, camera, origin);
+   lap(STAGE_GENERATE);
+   for (int depth = k; wf.rays.size() > 0; --depth)
+   {
+      extendStage(&wf, depth == k);
+      lap(STAGE_EXTEND);
+      if (depth == 0)
+      {
+         /* Without reflections, hits only show their material. */
+         for (size_t i = 0; i < wf.rays.size(); ++i)
+         {
+            const Material &mat = hitMaterial(rtdata, wf.rays.k[i]);
+            output[wf.rays.pixels[i]] = mat.ka + mat.kd;
+         }
+         lap(STAGE_SHADE);
+         break;
+      }
+      size_t n = wf.rays.size();
+      wf.next.resize(n);
+      wf.alive.assign(n, false);
+      for (size_t first = 0; first < n; first += wf.chunk)
+      {
+         size_t count = std::min(wf.chunk, n - first);
+         shadeStage(&wf, depth, first, count);
+         lap(STAGE_SHADE);
+         shadowStage(&wf, first, count);
+         lap(STAGE_SHADOW);
+      }
+
+      /* The reflections left go on to the next bounce. */
+      if (opts.sort_reflections)
+         sortStream(&wf.next, wf.alive);
+      else
+         compactStream(&wf.next, wf.alive);
+      std::swap(wf.rays, wf.next);
+      lap(STAGE_SHADE);
+   }
+
+   RenderStats stats {};
+   for (const ThreadStats &ts : wf.thread_stats)
+      stats.rays += ts.rays;
+   stats.render_ms = timer.elapsed();
+   stats.threads = wf.pool->size();
+   stats.xres = xres;
+   stats.yres = yres;
+   stats.k = k;
+   for (int s = 0; s < STAGE_COUNT; ++s)
+      print("[Wavefront] ", STAGE_NAMES[s], ": ", stage_ms[s], " ms");
+   printRenderStats(stats);
+   return stats;
+}
+
+/*
+ * Primary rays of every pixel, tile by tile and packet by packet within
+ * the tiles, the order rayTrace traces them in. Paths start out black,
+ * with full throughput and the seed rayTrace gives them.
+ */
+void generateStage(Wavefront *wf, const CameraRays &camera, vec3 origin)
+{
+   int xres = camera.xres, yres = camera.yres;
+   int packet = glm::clamp(wf->opts->packet_size, 0, MAX_PACKET_SIZE);
+   int step = packet > 0 ? packet : TILE_SIZE;
+   int xtiles = (xres + TILE_SIZE - 1) / TILE_SIZE;
+   int ytiles = (yres + TILE_SIZE - 1) / TILE_SIZE;
+   uint tiles = static_cast<uint>(xtiles * ytiles);
+
+   /* Where the rays and packets of every tile go. */
+   std::vector<uint> first_ray(tiles + 1), first_packet(tiles + 1);
+   for (uint tile = 0; tile < tiles; ++tile)
+   {
+      int h = std::min(TILE_SIZE, yres - static_cast<int>(tile) / xtiles * TILE_SIZE);
+      int w = std::min(TILE_SIZE, xres - static_cast<int>(tile) % xtiles * TILE_SIZE);
+      first_ray[tile + 1] = first_ray[tile] + w * h;
+      first_packet[tile + 1] = first_packet[tile] +
+                               (packet > 0 ? (h + step - 1) / step * ((w + step - 1) / step) : 0);
+   }
+
+   size_t pixels = static_cast<size_t>(xres) * yres;
+   wf->throughput.assign(pixels, col3(1));
+   wf->rng.resize(pixels);
+   wf->rays.resize(pixels);
+   wf->packets.resize(first_packet[tiles] + 1);
+   wf->packets.back() = static_cast<uint>(pixels);
+
+   parallelStats(*wf->pool, tiles, &wf->thread_stats, [&](uint tile) {
+      int i0 = tile / xtiles * TILE_SIZE;
+      int j0 = tile % xtiles * TILE_SIZE;
+      int i1 = std::min(i0 + TILE_SIZE, yres);
+      int j1 = std::min(j0 + TILE_SIZE, xres);
+      uint r = first_ray[tile], pk = first_packet[tile];
+      for (int pi = i0; pi < i1; pi += step)
+         for (int pj = j0; pj < j1; pj += step)
+         {
+            if (packet > 0)
+               wf->packets[pk++] = r;
+            for (int i = pi; i < std::min(pi + step, i1); ++i)
+               for (int j = pj; j < std::min(pj + step, j1); ++j, ++r)
+               {
+                  uint pixel = static_cast<uint>(i * xres + j);
+                  wf->rays.rays[r] = Ray { .o = origin, .d = camera.direction(i, j) };
+                  wf->rays.pixels[r] = pixel;
+                  wf->output[pixel] = col3(0);
+                  wf->rng[pixel] = hash(pixel);
+               }
+         }
+   });
+}
+
+/* Closest hits of the rays, keeping those that hit. Primary rays go in
+ * their packets. */
+void extendStage(Wavefront *wf, bool primary)
+{
+   RayStream &rays = wf->rays;
+   const Accelerator *accel = wf->rtdata->accel;
+   if (primary && wf->packets.size() > 1)
+   {
+      parallelStats(*wf->pool, static_cast<uint>(wf->packets.size() - 1), &wf->thread_stats,
+                    [&](uint p) {
+         uint first = wf->packets[p];
+         RayPacket rp;
+         rp.o = rays.rays[first].o;
+         rp.count = static_cast<int>(wf->packets[p + 1] - first);
+         for (int r = 0; r < rp.count; ++r)
+            rp.d[r] = rays.rays[first + r].d;
+         accel->closestHitPacket(&rp);
+         RAY_STAT(primary_rays, rp.count);
+         std::copy(rp.t, rp.t + rp.count, &rays.t[first]);
+         std::copy(rp.k, rp.k + rp.count, &rays.k[first]);
+         countHits(rays, first, first + rp.count);
+      });
+   }
+   else
+   {
+      uint n = static_cast<uint>(rays.size());
+      parallelStats(*wf->pool, batchCount(n, STREAM_BATCH_SIZE), &wf->thread_stats,
+                    [&](uint batch) {
+         uint begin = batch * STREAM_BATCH_SIZE;
+         uint count = std::min(n - begin, STREAM_BATCH_SIZE);
+         accel->closestHitBatch(&rays.rays[begin], static_cast<int>(count), &rays.t[begin],
+                                &rays.k[begin]);
+         if (primary)
+            RAY_STAT(primary_rays, count);
+         else
+            RAY_STAT(reflection_rays, count);
+         countHits(rays, begin, begin + count);
+      });
+   }
+
+   wf->alive.resize(rays.size());
+   for (size_t i = 0; i < rays.size(); ++i)
+      wf->alive[i] = rays.k[i] != static_cast<size_t>(-1);
+   compactStream(&rays, wf->alive);
+}
+
+/*
+ * Everything the hits [first, first + count) need from their surfaces: the
+ * lighting inputs, the shadow rays of all lights and the reflection ray,
+ * which is alive if the path goes on past the hit.
+ */
+void shadeStage(Wavefront *wf, int depth, size_t first, size_t count)
+{
+   const RayStream &rays = wf->rays;
+   const std::vector<Light> &lights = wf->rtdata->lights;
+   size_t l = lights.size();
+
+   parallelStats(*wf->pool, batchCount(count, STREAM_BATCH_SIZE), &wf->thread_stats,
+                 [&](uint batch) {
+      size_t end = std::min(count, static_cast<size_t>(batch + 1) * STREAM_BATCH_SIZE);
+      for (size_t h = static_cast<size_t>(batch) * STREAM_BATCH_SIZE; h < end; ++h)
+      {
+         size_t i = first + h;
+         uint p = rays.pixels[i];
+         SurfacePoint sp = surfacePoint(rays.rays[i], wf->rtdata, rays.k[i], rays.t[i],
+                                        *wf->opts);
+         wf->points[h] = sp;
+         wf->weights[h] = wf->throughput[p];
+         for (size_t j = h * l; j < (h + 1) * l; ++j)
+            wf->shadows[j] = shadowRay(sp, lights[j - h * l], rays.k[i], &wf->shadow_tmax[j],
+                                       &wf->shadow_skip[j]);
+
+         col3 weight;
+         wf->next.rays[i] = reflectedRay(sp, &weight);
+         wf->next.pixels[i] = p;
+         wf->alive[i] = depth > 1 && continuePath(weight, *wf->opts, &wf->throughput[p],
+                                                  &wf->rng[p]);
+      }
+   });
+}
+
+/* Occlusion of the shadow rays of the hits [first, first + count), then the
+ * color of every hit from the lights it sees. Tasks take whole hits, so a
+ * hit adds its lights in order. */
+void shadowStage(Wavefront *wf, size_t first, size_t count)
+{
+   const std::vector<Light> &lights = wf->rtdata->lights;
+   size_t l = lights.size();
+   uint per_task = std::max<uint>(1, STREAM_BATCH_SIZE / std::max<size_t>(l, 1));
+   parallelStats(*wf->pool, batchCount(count, per_task), &wf->thread_stats, [&](uint task) {
+      size_t begin = static_cast<size_t>(task) * per_task;
+      size_t end = std::min(count, begin + per_task);
+      int rays = static_cast<int>((end - begin) * l);
+      wf->rtdata->accel->occludedBatch(wf->shadows.data() + begin * l,
+                                       wf->shadow_tmax.data() + begin * l,
+                                       wf->shadow_skip.data() + begin * l, rays,
+                                       wf->occluded.get() + begin * l);
+      RAY_STAT(shadow_rays, rays);
+
+      for (size_t h = begin; h < end; ++h)
+      {
+         col3 diffuse(0), specular(0);
+         for (size_t j = 0; j < l; ++j)
+         {
+            if (wf->occluded[h * l + j])
+               RAY_STAT(occluded, 1);
+            else
+               addLight(wf->points[h], lights[j], &diffuse, &specular);
+         }
+         wf->output[wf->rays.pixels[first + h]] += wf->weights[h] *
+                                           surfaceColor(wf->points[h], diffuse, specular);
+      }
+   });
+}
+
+void countHits(const RayStream &rays, size_t begin, size_t end)
+{
+   for (size_t i = begin; i < end; ++i)
+   {
+      RAY_STAT(hits, rays.k[i] != static_cast<size_t>(-1));
+      RAY_STAT(misses, rays.k[i] == static_cast<size_t>(-1));
+   }
+}
+
+/* Drops the entries not alive, keeping the order of the rest. */
+void compactStream(RayStream *stream, const std::vector<char> &alive)
+{
+   size_t kept = 0;
+   for (size_t i = 0; i < stream->size(); ++i)
+   {
+      if (!alive[i])
+         continue;
+      stream->rays[kept] = stream->rays[i];
+      stream->t[kept] = stream->t[i];
+      stream->k[kept] = stream->k[i];
+      stream->pixels[kept++] = stream->pixels[i];
+   }
+   stream->resize(kept);
+}
+
+uint batchCount(size_t n, uint batch)
+{
+   return static_cast<uint>((n + batch - 1) / batch);
+}
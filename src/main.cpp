@@ -1,3 +1,4 @@
+#include <cstdio>
 #include <fstream>
 #include <sstream>
 #include <vector>
@@ -7,17 +8,19 @@
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
 #include <GL/glew.h>
-#include <assimp/scene.h>
-#include <assimp/postprocess.h>
-#include <assimp/Importer.hpp>
-#include <assimp/material.h>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb/stb_image_write.h>
 
 #include "Utils/Log.h"
 #include "Utils/Error.h"
+#include "Utils/Timer.h"
 #include "Graphics/Shader.h"
 #include "Raytracer.h"
+#include "Accel/TopLevelBVH.h"
+#include "Accel/KdTree.h"
+#include "Accel/Grid.h"
+#include "Accel/LinearScan.h"
+#include "Scene.h"
 #include "Const.h"
 
 #define MAX_LIGHTS 20
@@ -33,6 +36,7 @@ struct Config
    glm::vec3 la;
    glm::vec3 up;
    float yview;
+   AcceleratorKind accel;
 };
 
 struct WindowContext
@@ -41,15 +45,10 @@ struct WindowContext
    float fov;
 };
 
-struct RenderData
-{
-   std::vector<glm::vec3> vertices;
-   std::vector<glm::vec3> normals;
-   std::vector<col3> kas;
-   std::vector<col3> kds;
-   std::vector<col3> kss;
-   std::vector<uint> indices;
-};
+static void saveImage(const Config &config, const col3 *buffer, int frame = -1);
+static void turnScene(const RayTracerData &rest, float angle, glm::vec3 center, glm::vec3 axis,
+                      RayTracerData *rtdata, std::vector<uint> *moved);
+static void saveStats(const char *path, const std::vector<BenchStats> &frames);
 
 static void glfwErrorCallback(int code, const char *desc);
 static void windowResizeCallback(GLFWwindow*, int width, int height);
@@ -59,7 +58,49 @@ template<class T> std::istream& operator>>(std::istream &in, glm::vec<3, T> &v);
 template<class T> std::ostream& operator<<(std::ostream &out, const glm::vec<3, T> &v);
 
 static const char *USAGE_STR =
-"Usage: ./raytracer CONFIG_FILE\n\n"
+"Usage: ./raytracer [OPTIONS] CONFIG_FILE\n\n"
+"Options:\n"
+"  --threads N   number of ray tracing threads (default=all hardware threads)\n"
+"  --headless    render with the configuration camera, save the image and exit\n"
+"  --packet N    trace primary rays in NxN packets, N <= 8, 0 disables (default=8)\n"
+"  --min-throughput X\n"
+"                stop following reflections weighted below X, 0 disables (default=0.001)\n"
+"  --roulette    continue cut off reflections with Russian roulette\n"
+"  --flat-normals\n"
+"                shade with one normal per triangle instead of interpolated ones\n"
+"  --sort-reflections\n"
+"                trace reflections a bounce at a time, sorted by direction and origin\n"
+"  --wavefront   render in separate generate, extend, shade and shadow stages over the\n"
+"                whole frame, timing every stage\n"
+"  --accel bvh|kd|grid|grid2|linear\n"
+"                trace against the instance BVHs, a kd-tree, a uniform grid or a two-level\n"
+"                grid over the whole scene, or test every triangle; all but the BVH are\n"
+"                built on every run (default=configuration accel line, else bvh)\n"
+"  --bvh-build sah|lbvh|sbvh\n"
+"                build the BVH for quality (sah), for build speed (lbvh) or with spatial\n"
+"                splits for long thin triangles (sbvh) (default=sah)\n"
+"  --split-growth X\n"
+"                sbvh: allow X times as many triangle references as triangles (default=1.3)\n"
+"  --split-compare\n"
+"                sbvh: also build the tree without spatial splits and report its SAH cost\n"
+"  --bvh-width N traverse a binary (2), 4-wide or 8-wide BVH (default=8)\n"
+"  --bvh-quantize\n"
+"                store wide BVH child boxes as 8-bit offsets in 80 byte nodes\n"
+"  --tri-test mt|bw|wt\n"
+"                Moller-Trumbore, precomputed Baldwin-Weber or watertight triangle test;\n"
+"                wt also offsets secondary ray origins off the surface (default=mt)\n"
+"  --no-cache    always import the model instead of using its .rtcache file\n"
+"  --stats-json FILE\n"
+"                write ray counters and timing of the last render to FILE\n"
+"  --res WxH     override the configuration resolution\n"
+"  --depth K     override the configuration k_parameter\n"
+"  --repeat N    headless: render N times and report median/min/stddev (default=1)\n"
+"  --no-save     headless: do not save the image\n"
+"  --frames N    headless: render N frames of the scene turning once around the look-at\n"
+"                point, updating the BVH per frame instead of rebuilding it; the other\n"
+"                structures are rebuilt (default=1)\n"
+"  --refit-limit X\n"
+"                rebuild a refitted mesh BVH once its SAH cost grew X times (default=1.5)\n\n"
 "Confiration file template:\n\n"
 "comment\n"
 "path/to/file.obj\n"
@@ -70,7 +111,8 @@ static const char *USAGE_STR =
 "look_at_x look_at_y look_at_z\n"
 "[up_x up_y up_z] (default=[0,1,0])\n"
 "[yview] (default=1)\n"
-"[L light_pos_x light_pos_y light_pos_y light_col_x light_col_y intensity]...";
+"[L light_pos_x light_pos_y light_pos_y light_col_x light_col_y intensity]...\n"
+"[accel bvh|kd|grid|grid2|linear] (anywhere among the lights)";
 
 static const char *INSTRUCTION_STR =
 "Use WASD to move, MOUSE to look around.\n"
@@ -86,9 +128,111 @@ static constexpr float LOOK_SENSITIVITY = 0.15f;
 
 int main(int argc, char *argv[])
 {
-   if (argc != 2)
+   const char *config_file_path = nullptr;
+   RenderOptions render_opts;
+   BVHBuildOptions build_opts;
+   bool accel_override = false;
+   AcceleratorKind accel = AcceleratorKind::BVH;
+   bool headless = false;
+   bool use_cache = true;
+   const char *stats_file_path = nullptr;
+   int xres_override = 0, yres_override = 0, k_override = -1;
+   int repeat = 1;
+   int frames = 1;
+   bool save = true;
+   std::string args;
+   for (int i = 1; i < argc; ++i)
+   {
+      std::string arg = argv[i];
+      args += (i > 1 ? " " : "") + arg;
+      if (arg == "--threads" && i + 1 < argc)
+         render_opts.threads = std::stoi(argv[++i]);
+      else if (arg == "--headless")
+         headless = true;
+      else if (arg == "--packet" && i + 1 < argc)
+         render_opts.packet_size = std::stoi(argv[++i]);
+      else if (arg == "--min-throughput" && i + 1 < argc)
+         render_opts.min_throughput = std::stof(argv[++i]);
+      else if (arg == "--roulette")
+         render_opts.russian_roulette = true;
+      else if (arg == "--flat-normals")
+         render_opts.smooth_normals = false;
+      else if (arg == "--sort-reflections")
+         render_opts.sort_reflections = true;
+      else if (arg == "--wavefront")
+         render_opts.wavefront = true;
+      else if (arg == "--accel" && i + 1 < argc)
+      {
+         if (!parseAcceleratorKind(argv[++i], &accel))
+            ERROR(USAGE_STR);
+         accel_override = true;
+      }
+      else if (arg == "--bvh-build" && i + 1 < argc)
+      {
+         std::string builder = argv[++i];
+         if (builder == "sah")
+            build_opts.builder = BVHBuilder::SAH;
+         else if (builder == "lbvh")
+            build_opts.builder = BVHBuilder::LBVH;
+         else if (builder == "sbvh")
+            build_opts.builder = BVHBuilder::SBVH;
+         else
+            ERROR(USAGE_STR);
+      }
+      else if (arg == "--bvh-width" && i + 1 < argc)
+      {
+         build_opts.width = std::stoi(argv[++i]);
+         if (build_opts.width != 2 && build_opts.width != 4 && build_opts.width != 8)
+            ERROR(USAGE_STR);
+      }
+      else if (arg == "--split-growth" && i + 1 < argc)
+         build_opts.max_split_growth = std::stof(argv[++i]);
+      else if (arg == "--split-compare")
+         build_opts.compare_object_splits = true;
+      else if (arg == "--bvh-quantize")
+         build_opts.quantize = true;
+      else if (arg == "--tri-test" && i + 1 < argc)
+      {
+         std::string test = argv[++i];
+         if (test == "mt")
+            build_opts.triangle_test = TriangleTest::MollerTrumbore;
+         else if (test == "bw")
+            build_opts.triangle_test = TriangleTest::BaldwinWeber;
+         else if (test == "wt")
+            build_opts.triangle_test = TriangleTest::Watertight;
+         else
+            ERROR(USAGE_STR);
+      }
+      else if (arg == "--no-cache")
+         use_cache = false;
+      else if (arg == "--stats-json" && i + 1 < argc)
+         stats_file_path = argv[++i];
+      else if (arg == "--res" && i + 1 < argc)
+      {
+         char x;
+         std::stringstream ss(argv[++i]);
+         if (!(ss >> xres_override >> x >> yres_override) || x != 'x'
+             || xres_override <= 0 || yres_override <= 0)
+            ERROR(USAGE_STR);
+      }
+      else if (arg == "--depth" && i + 1 < argc)
+         k_override = std::stoi(argv[++i]);
+      else if (arg == "--repeat" && i + 1 < argc)
+         repeat = std::max(1, std::stoi(argv[++i]));
+      else if (arg == "--no-save")
+         save = false;
+      else if (arg == "--frames" && i + 1 < argc)
+         frames = std::max(1, std::stoi(argv[++i]));
+      else if (arg == "--refit-limit" && i + 1 < argc)
+         build_opts.max_refit_cost = std::stof(argv[++i]);
+      else if (!config_file_path && arg[0] != '-')
+         config_file_path = argv[i];
+      else
+         ERROR(USAGE_STR);
+   }
+   if (!config_file_path || (build_opts.quantize && build_opts.width == 2))
       ERROR(USAGE_STR);
-   const char *config_file_path = argv[1];
+   build_opts.threads = render_opts.threads;
 
    /* Parse configuration. */
    Config config;
@@ -100,6 +244,7 @@ int main(int argc, char *argv[])
 
       config.up = glm::vec3(0, 1, 0);
       config.yview = 1;
+      config.accel = AcceleratorKind::BVH;
 
       std::getline(config_file, config.comment); // ignore comment line
       std::getline(config_file, config.obj_file_path);
@@ -138,6 +283,14 @@ int main(int argc, char *argv[])
             }
             while (std::getline(config_file, line)) {
                std::stringstream ss(line);
+               if (line.rfind("accel", 0) == 0)
+               {
+                  std::string key, name;
+                  ss >> key >> name;
+                  if (!parseAcceleratorKind(name, &config.accel))
+                     ERROR("Unknown acceleration structure in configuration file.");
+                  continue;
+               }
                char c;
                if (!(ss >> c) || c != 'L')
                   break;
@@ -152,6 +305,131 @@ int main(int argc, char *argv[])
 
    if (rtdata.lights.size() > MAX_LIGHTS)
       ERROR("Too many lights in the scene.");
+   if (xres_override > 0)
+   {
+      config.xres = xres_override;
+      config.yres = yres_override;
+   }
+   if (k_override >= 0)
+      config.k = k_override;
+   if (!accel_override)
+      accel = config.accel;
+
+   BenchStats bench {};
+   bench.config = config_file_path;
+   bench.args = args;
+   bench.accel = acceleratorName(accel);
+
+   /* Load assets. */
+   float dist_bound;
+   TopLevelBVH bvh;
+   KdTree kd;
+   Grid grid;
+   LinearScan linear;
+   /* Everything but the BVH is built from scratch, also per --frames frame.
+    * Returns the build time. */
+   auto buildAccelerator = [&]() {
+      switch (accel)
+      {
+         case AcceleratorKind::KdTree:
+            kd.build(rtdata.meshes, rtdata.instances, build_opts.triangle_test);
+            rtdata.accel = &kd;
+            return kd.stats().build_ms;
+         case AcceleratorKind::Grid:
+         case AcceleratorKind::TwoLevelGrid:
+            grid.build(rtdata.meshes, rtdata.instances, build_opts.triangle_test,
+                       accel == AcceleratorKind::TwoLevelGrid);
+            rtdata.accel = &grid;
+            return grid.stats().build_ms;
+         case AcceleratorKind::LinearScan:
+            linear.build(rtdata.meshes, rtdata.instances, build_opts.triangle_test);
+            rtdata.accel = &linear;
+            return linear.buildMs();
+         case AcceleratorKind::BVH:
+            break;
+      }
+      return 0.f;
+   };
+
+   RenderData rdata;
+   {
+      Timer timer("Scene Load");
+      bool cached = use_cache &&
+                    readSceneCache(config.obj_file_path, &rtdata, &rdata, &bvh, &dist_bound);
+      if (!cached)
+         loadScene(config.obj_file_path, &rtdata, &rdata, &dist_bound);
+      /* The cache only holds BVHs, so it is not written for the other structures. */
+      if (accel != AcceleratorKind::BVH)
+         bench.build_ms = buildAccelerator();
+      else if (!cached || !bvh.builtWith(build_opts))
+      {
+         bvh.build(rtdata.meshes, rtdata.instances, build_opts);
+         if (use_cache)
+            writeSceneCache(config.obj_file_path, rtdata, rdata, bvh, dist_bound);
+         rtdata.accel = &bvh;
+      }
+      else
+      {
+         bvh.collapse(build_opts.width, build_opts.quantize);
+         bvh.useTriangleTest(rtdata.meshes, build_opts.triangle_test);
+         rtdata.accel = &bvh;
+      }
+      bench.load_ms = timer.elapsed();
+      if (accel == AcceleratorKind::BVH)
+         bench.build_ms = bvh.stats().build_ms;
+
+      // Normalize all the other points in the scene.
+      for (Light &light : rtdata.lights)
+         light.position /= dist_bound;
+      config.vp /= dist_bound;
+      config.la /= dist_bound;
+   }
+
+   /* Setup runtime variables. */
+   glm::vec3 position = config.vp;
+   glm::vec3 forward = glm::normalize(config.la - position);
+   glm::vec3 up = glm::normalize(config.up);
+   glm::vec3 right = glm::cross(forward, up);
+   glm::vec3 *buffer = new glm::vec3[config.xres * config.yres];
+   float focal_length = config.yres / config.yview;
+
+   if (headless)
+   {
+      RayTracerData rest;
+      if (frames > 1)
+         rest = rtdata;
+      /* Every frame gets its own record, with the time it took to update the
+       * structure in place of the initial build. */
+      std::vector<BenchStats> frame_stats;
+      for (int frame = 0; frame < frames; ++frame)
+      {
+         if (frame > 0)
+         {
+            std::vector<uint> moved;
+            turnScene(rest, 2 * static_cast<float>(M_PI) * frame / frames, config.la, up,
+                      &rtdata, &moved);
+            if (accel == AcceleratorKind::BVH)
+               bench.build_ms = bvh.update(rtdata.meshes, rtdata.instances, moved, build_opts);
+            else
+               bench.build_ms = buildAccelerator();
+         }
+         if (frames > 1)
+            bench.frame = frame;
+         bench.runs.clear();
+         for (int i = 0; i < repeat; ++i)
+            bench.runs.push_back(rayTrace(&rtdata, config.xres, config.yres, focal_length,
+                                          position, forward, right, config.k,
+                                          render_opts, buffer));
+         if (repeat > 1)
+            printBenchStats(bench);
+         if (save)
+            saveImage(config, buffer, frames > 1 ? frame : -1);
+         frame_stats.push_back(bench);
+      }
+      if (stats_file_path)
+         saveStats(stats_file_path, frame_stats);
+      return 0;
+   }
 
    /* Initialize OpenGL. */
    glfwSetErrorCallback(glfwErrorCallback);
@@ -185,199 +463,106 @@ int main(int argc, char *argv[])
    GL_CALL(glEnable(GL_DEPTH_TEST));
    GL_CALL(glEnable(GL_CULL_FACE));
 
-   /* Load assets. */
-   int indices_count;
-   float dist_bound;
+   /* Setup OpenGL buffers. */
    {
-      RenderData rdata;
-      {
-         Assimp::Importer importer;
-         const aiScene *scene = importer.ReadFile(config.obj_file_path.c_str(),
-                                                  aiProcess_Triangulate | aiProcess_GenNormals |
-                                                  aiProcess_FlipUVs | aiProcess_JoinIdenticalVertices);
-         if (!scene)
-            ERROR(importer.GetErrorString());
-
-         // Precalculate some values from objects in the scene.
-         uint n_tris = 0, n_vertices = 0;
-         {
-            constexpr float inf = std::numeric_limits<float>::infinity();
-            glm::vec3 min_point(inf);
-            glm::vec3 max_point(-inf);
-            for (uint i = 0; i < scene->mNumMeshes; ++i)
-            {
-               const aiMesh *mesh = scene->mMeshes[i];
-               const aiVector3D *verts = mesh->mVertices;
-
-               n_tris += mesh->mNumFaces;
-               n_vertices += mesh->mNumVertices;
-
-               for (uint j = 0; j < mesh->mNumVertices; ++j)
-               {
-                  aiVector3D v = verts[j];
-                  max_point.x = std::max(max_point.x, v.x);
-                  max_point.y = std::max(max_point.y, v.y);
-                  max_point.z = std::max(max_point.z, v.z);
-                  min_point.x = std::min(min_point.x, v.x);
-                  min_point.y = std::min(min_point.y, v.y);
-                  min_point.z = std::min(min_point.z, v.z);
-               }
-            }
-            dist_bound = glm::length(max_point - min_point);
-         }
-
-         rtdata.tris.reserve(n_tris);
-         rtdata.normals.reserve(n_tris);
-         rtdata.mat_indices.reserve(n_tris);
-         rtdata.materials.reserve(scene->mNumMeshes);
-
-         rdata.vertices.reserve(n_vertices);
-         rdata.normals.reserve(n_vertices);
-         rdata.kas.reserve(n_vertices);
-         rdata.kds.reserve(n_vertices);
-         rdata.kss.reserve(n_vertices);
-         rdata.indices.reserve(n_tris * 3);
-
-         uint index_offset = 0;
-         for (uint i = 0; i < scene->mNumMeshes; ++i)
+      GLuint vao;
+      GL_CALL(glGenVertexArrays(1, &vao));
+      GL_CALL(glBindVertexArray(vao));
+
+      /* The meshes go one after another into shared buffers and are drawn
+       * per instance with a base vertex. */
+      auto meshBufferData = [&](GLenum target, auto member) {
+         size_t size = 0;
+         for (const Mesh &mesh : rtdata.meshes)
+            size += (mesh.*member).size() * sizeof((mesh.*member)[0]);
+         GL_CALL(glBufferData(target, size, nullptr, GL_STATIC_DRAW));
+         size_t offset = 0;
+         for (const Mesh &mesh : rtdata.meshes)
          {
-            const aiMesh *mesh = scene->mMeshes[i];
-            const aiMaterial *mat = scene->mMaterials[mesh->mMaterialIndex];
-            aiVector3D *verts = mesh->mVertices;
-            aiVector3D *normals = mesh->mNormals;
-
-            aiColor3D ka, kd, ks;
-            mat->Get(AI_MATKEY_COLOR_AMBIENT, ka);
-            mat->Get(AI_MATKEY_COLOR_DIFFUSE, kd);
-            mat->Get(AI_MATKEY_COLOR_SPECULAR, ks);
-
-            Material material {
-               col3(ka.r, ka.g, ka.b),
-               col3(kd.r, kd.g, kd.b),
-               col3(ks.r, ks.g, ks.b)
-            };
-            rtdata.materials.push_back(material);
-
-            for (uint j = 0; j < mesh->mNumVertices; ++j)
-            {
-               const aiVector3D& v = (verts[j] /= dist_bound);
-               const aiVector3D& n = normals[j];
-
-               rdata.vertices.push_back(glm::vec3(v.x, v.y, v.z));
-               rdata.normals.push_back(glm::vec3(n.x, n.y, n.z));
-               rdata.kas.push_back(material.ka);
-               rdata.kds.push_back(material.kd);
-               rdata.kss.push_back(material.ks);
-            }
-
-            for (uint j = 0; j < mesh->mNumFaces; ++j)
-            {
-               aiFace face = mesh->mFaces[j];
-               Triangle &tri = rtdata.tris.emplace_back();
-               assert(face.mNumIndices == 3);
-
-               for (uint k = 0; k < face.mNumIndices; ++k)
-               {
-                  uint idx = face.mIndices[k];
-                  tri.p[k] = vec3(verts[idx].x, verts[idx].y, verts[idx].z);
-                  rdata.indices.push_back(index_offset + idx);
-               }
-               tri.bar.u -= tri.bar.P;
-               tri.bar.v -= tri.bar.P;
-               {
-                  uint idx = face.mIndices[0];
-                  rtdata.normals.push_back(vec3(normals[idx].x,
-                                                normals[idx].y,
-                                                normals[idx].z));
-               }
-               rtdata.mat_indices.push_back(i);
-            }
-
-            index_offset += mesh->mNumVertices;
+            size_t bytes = (mesh.*member).size() * sizeof((mesh.*member)[0]);
+            GL_CALL(glBufferSubData(target, offset, bytes, (mesh.*member).data()));
+            offset += bytes;
          }
+      };
+
+      GLuint vvbo;
+      GL_CALL(glGenBuffers(1, &vvbo));
+      GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, vvbo));
+      meshBufferData(GL_ARRAY_BUFFER, &Mesh::vertices);
+      GL_CALL(glEnableVertexAttribArray(0));
+      GL_CALL(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0));
+
+      GLuint nvbo;
+      GL_CALL(glGenBuffers(1, &nvbo));
+      GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, nvbo));
+      meshBufferData(GL_ARRAY_BUFFER, &Mesh::normals);
+      GL_CALL(glEnableVertexAttribArray(1));
+      GL_CALL(glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0));
+
+      GLuint kavbo;
+      GL_CALL(glGenBuffers(1, &kavbo));
+      GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, kavbo));
+      GL_CALL(glBufferData(GL_ARRAY_BUFFER,
+                           rdata.kas.size() * sizeof(col3),
+                           rdata.kas.data(),
+                           GL_STATIC_DRAW));
+      GL_CALL(glEnableVertexAttribArray(2));
+      GL_CALL(glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0));
+
+      GLuint kdvbo;
+      GL_CALL(glGenBuffers(1, &kdvbo));
+      GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, kdvbo));
+      GL_CALL(glBufferData(GL_ARRAY_BUFFER,
+                           rdata.kds.size() * sizeof(col3),
+                           rdata.kds.data(),
+                           GL_STATIC_DRAW));
+      GL_CALL(glEnableVertexAttribArray(3));
+      GL_CALL(glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, 0));
+
+      GLuint ksvbo;
+      GL_CALL(glGenBuffers(1, &ksvbo));
+      GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, ksvbo));
+      GL_CALL(glBufferData(GL_ARRAY_BUFFER,
+                           rdata.kss.size() * sizeof(col3),
+                           rdata.kss.data(),
+                           GL_STATIC_DRAW));
+      GL_CALL(glEnableVertexAttribArray(4));
+      GL_CALL(glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, 0));
+
+      GLuint ebo;
+      GL_CALL(glGenBuffers(1, &ebo));
+      GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo));
+      meshBufferData(GL_ELEMENT_ARRAY_BUFFER, &Mesh::indices);
+   }
 
-         // Normalize all the other points in the scene.
-         for (Light &light : rtdata.lights)
-            light.position /= dist_bound;
-         config.vp /= dist_bound;
-         config.la /= dist_bound;
-      }
-
-      /* Setup OpenGL buffers. */
+   struct MeshDraw
+   {
+      int count;
+      size_t first;
+      int base_vertex;
+   };
+   std::vector<MeshDraw> mesh_draws;
+   {
+      size_t first = 0, base_vertex = 0;
+      for (const Mesh &mesh : rtdata.meshes)
       {
-         GLuint vao;
-         GL_CALL(glGenVertexArrays(1, &vao));
-         GL_CALL(glBindVertexArray(vao));
-
-         GLuint vvbo;
-         GL_CALL(glGenBuffers(1, &vvbo));
-         GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, vvbo));
-         GL_CALL(glBufferData(GL_ARRAY_BUFFER,
-                              rdata.vertices.size() * sizeof(glm::vec3),
-                              rdata.vertices.data(),
-                              GL_STATIC_DRAW));
-         GL_CALL(glEnableVertexAttribArray(0));
-         GL_CALL(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0));
-
-         GLuint nvbo;
-         GL_CALL(glGenBuffers(1, &nvbo));
-         GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, nvbo));
-         GL_CALL(glBufferData(GL_ARRAY_BUFFER,
-                              rdata.normals.size() * sizeof(glm::vec3),
-                              rdata.normals.data(),
-                              GL_STATIC_DRAW));
-         GL_CALL(glEnableVertexAttribArray(1));
-         GL_CALL(glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0));
-
-         GLuint kavbo;
-         GL_CALL(glGenBuffers(1, &kavbo));
-         GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, kavbo));
-         GL_CALL(glBufferData(GL_ARRAY_BUFFER,
-                              rdata.kas.size() * sizeof(col3),
-                              rdata.kas.data(),
-                              GL_STATIC_DRAW));
-         GL_CALL(glEnableVertexAttribArray(2));
-         GL_CALL(glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0));
-
-         GLuint kdvbo;
-         GL_CALL(glGenBuffers(1, &kdvbo));
-         GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, kdvbo));
-         GL_CALL(glBufferData(GL_ARRAY_BUFFER,
-                              rdata.kds.size() * sizeof(col3),
-                              rdata.kds.data(),
-                              GL_STATIC_DRAW));
-         GL_CALL(glEnableVertexAttribArray(3));
-         GL_CALL(glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, 0));
-
-         GLuint ksvbo;
-         GL_CALL(glGenBuffers(1, &ksvbo));
-         GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, ksvbo));
-         GL_CALL(glBufferData(GL_ARRAY_BUFFER,
-                              rdata.kss.size() * sizeof(col3),
-                              rdata.kss.data(),
-                              GL_STATIC_DRAW));
-         GL_CALL(glEnableVertexAttribArray(4));
-         GL_CALL(glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, 0));
-
-         GLuint ebo;
-         GL_CALL(glGenBuffers(1, &ebo));
-         GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo));
-         GL_CALL(glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                              rdata.indices.size() * sizeof(uint),
-                              rdata.indices.data(),
-                              GL_STATIC_DRAW));
+         mesh_draws.push_back(MeshDraw { static_cast<int>(mesh.indices.size()), first,
+                                         static_cast<int>(base_vertex) });
+         first += mesh.indices.size();
+         base_vertex += mesh.vertices.size();
       }
-
-      indices_count = static_cast<int>(rdata.indices.size());
    }
+   rdata = RenderData(); // CPU copies are no longer needed
 
    /* Setup shader. */
-   GLuint mvp_loc, vp_loc;
+   GLuint mvp_loc, vp_loc, model_loc, normal_model_loc;
    {
       GLuint shader = Graphics::loadGraphicsShader("shaders/vertex.glsl", "shaders/fragment.glsl");
       GL_CALL(glUseProgram(shader));
       GL_CALL(mvp_loc = glGetUniformLocation(shader, "mvp"));
       GL_CALL(vp_loc = glGetUniformLocation(shader, "vp"));
+      GL_CALL(model_loc = glGetUniformLocation(shader, "model"));
+      GL_CALL(normal_model_loc = glGetUniformLocation(shader, "normal_model"));
       {
          GL_CALL(GLint light_count_loc = glGetUniformLocation(shader, "light_count"));
          GL_CALL(glUniform1i(light_count_loc, static_cast<int>(rtdata.lights.size())));
@@ -412,16 +597,8 @@ int main(int argc, char *argv[])
       GL_CALL(glUniform1f(C_loc, C));
    }
 
-   /* Setup runtime variables. */
-   glm::vec3 position = config.vp;
-   glm::vec3 forward = glm::normalize(config.la - position);
-   glm::vec3 up = glm::normalize(config.up);
-   glm::vec3 right = glm::cross(forward, up);
-   glm::vec3 *buffer = new glm::vec3[config.xres * config.yres];
-
-   float focal_length;
+   /* Setup window projection. */
    {
-      focal_length = config.yres / config.yview;
       float x = sqrtf(config.xres * config.xres + config.yres * config.yres);
       window_context.fov = 2 * std::atan(0.5f * x / focal_length);
       windowResizeCallback(window, config.xres, config.yres);
@@ -493,8 +670,13 @@ int main(int argc, char *argv[])
          {
             int r_state = glfwGetKey(window, GLFW_KEY_R);
             if (r_last_state == GLFW_RELEASE && r_state == GLFW_PRESS)
-               rayTrace(&rtdata, config.xres, config.yres, focal_length,
-                        position, forward, right, config.k, buffer);
+            {
+               bench.runs = { rayTrace(&rtdata, config.xres, config.yres, focal_length,
+                                       position, forward, right, config.k,
+                                       render_opts, buffer) };
+               if (stats_file_path)
+                  saveStats(stats_file_path, { bench });
+            }
             r_last_state = r_state;
          }
          /* Update configuration. */
@@ -520,6 +702,7 @@ int main(int argc, char *argv[])
                   out << color << ' ';
                   out << l.intensity * 100 << '\n';
                }
+               out << "accel " << acceleratorName(config.accel) << '\n';
                print("Configuration updated.");
             }
             u_last_state = u_state;
@@ -534,27 +717,99 @@ int main(int argc, char *argv[])
       }
 
       GL_CALL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
-      GL_CALL(glDrawElements(GL_TRIANGLES, indices_count, GL_UNSIGNED_INT, 0));
+      for (const Instance &inst : rtdata.instances)
+      {
+         const MeshDraw &draw = mesh_draws[inst.mesh];
+         glm::mat3 normal_model = glm::transpose(glm::mat3(inst.to_object));
+         GL_CALL(glUniformMatrix4fv(model_loc, 1, GL_FALSE, &inst.to_world[0][0]));
+         GL_CALL(glUniformMatrix3fv(normal_model_loc, 1, GL_FALSE, &normal_model[0][0]));
+         GL_CALL(glDrawElementsBaseVertex(GL_TRIANGLES, draw.count, GL_UNSIGNED_INT,
+                                          reinterpret_cast<void*>(draw.first * sizeof(uint)),
+                                          draw.base_vertex));
+      }
       glfwPollEvents();
       glfwSwapBuffers(window);
    }
    
-   /* Save ray tracing output to a file. */
-   glm::vec<3, unsigned char> img[config.xres * config.yres];
+   saveImage(config, buffer);
+
+   // No cleanup, because app exists anyway.
+
+   return 0;
+}
+
+/* Frames of a sequence get their number appended to the file name. */
+void saveImage(const Config &config, const col3 *buffer, int frame /* = -1 */)
+{
+   std::vector<glm::vec<3, unsigned char>> img(config.xres * config.yres);
    for (int i = 0; i < config.yres; ++i)
       for (int j = 0; j < config.xres; ++j)
       {
          int idx = i * config.xres + j;
          img[idx] = 256.f * glm::min(buffer[idx], col3(1-EPS));
       }
-   std::string out_filepath = config.output_file_path + ".jpg";
+   std::string out_filepath = config.output_file_path;
+   if (frame >= 0)
+   {
+      char suffix[16];
+      std::snprintf(suffix, sizeof(suffix), "_%04d", frame);
+      out_filepath += suffix;
+   }
+   out_filepath += ".jpg";
    stbi_write_jpg(out_filepath.c_str(),
                   config.xres, config.yres, 3,
-                  img, 3 * config.xres);
+                  img.data(), 3 * config.xres);
+}
 
-   // No cleanup, because app exists anyway.
+/* A single frame is written as one record, a sequence as an array of them. */
+void saveStats(const char *path, const std::vector<BenchStats> &frames)
+{
+   std::ofstream out(path);
+   if (!out.is_open())
+      ERROR("Failed to open stats file.");
+   if (frames.size() == 1)
+      writeBenchJson(frames[0], out);
+   else
+      writeBenchJson(frames, out);
+}
 
-   return 0;
+/*
+ * Poses the scene as a turntable frame: the rest pose turned by angle around
+ * the axis through center. Meshes placed only by one untransformed instance,
+ * like the baked static mesh, have their vertices moved and are listed in
+ * moved; the other instances are turned by their transforms.
+ */
+void turnScene(const RayTracerData &rest, float angle, glm::vec3 center, glm::vec3 axis,
+               RayTracerData *rtdata, std::vector<uint> *moved)
+{
+   glm::mat4 rotation = glm::rotate(angle, axis);
+   glm::mat4 turn = glm::translate(center) * rotation * glm::translate(-center);
+   glm::mat3 normal_turn(rotation);
+
+   std::vector<uint> users(rest.meshes.size(), 0);
+   for (const Instance &inst : rest.instances)
+      users[inst.mesh]++;
+   moved->clear();
+   for (size_t i = 0; i < rest.instances.size(); ++i)
+   {
+      const Instance &inst = rest.instances[i];
+      if (inst.identity && users[inst.mesh] == 1)
+      {
+         const Mesh &from = rest.meshes[inst.mesh];
+         Mesh &to = rtdata->meshes[inst.mesh];
+         for (size_t v = 0; v < from.vertices.size(); ++v)
+         {
+            to.vertices[v] = glm::vec3(turn * glm::vec4(from.vertices[v], 1));
+            to.normals[v] = normal_turn * from.normals[v];
+         }
+         moved->push_back(inst.mesh);
+         continue;
+      }
+      glm::mat4 to_world = turn * inst.to_world;
+      rtdata->instances[i] = Instance { .mesh = inst.mesh, .identity = false,
+                                        .to_world = to_world,
+                                        .to_object = glm::inverse(to_world) };
+   }
 }
 
 void glfwErrorCallback(int code, const char *desc)